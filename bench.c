@@ -0,0 +1,422 @@
+// implement bench program: throughput of the number theory and file encryption functions
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <gmp.h>
+#include "numtheory.h"
+#include "randstate.h"
+#include "rsa.h"
+#include "mempool.h"
+
+// most samples kept per benchmark
+#define BENCH_MAX_SAMPLES 100000
+
+// longest list of sizes -b accepts
+#define BENCH_MAX_SIZES 16
+
+// operands of one benchmark, built before the clock starts
+typedef struct {
+	uint64_t bits;
+	mpz_t o;
+	mpz_t a;
+	mpz_t d;
+	mpz_t n;
+	mpz_t p;     // a prime of bits bits
+	mpz_t e;     // the public exponent of a key with an n of bits bits
+	mpz_t kn;    // the modulus of that key
+	mpz_t kd;    // the private exponent of that key
+	rand_ctx rng;
+	uint8_t *plain;
+	size_t plain_len;
+	char *cipher;
+	size_t cipher_len;
+} bench_case;
+
+// one benchmarked function: what it needs built and how to run it once
+typedef struct {
+	const char *name;
+	bool needs_prime;
+	bool needs_key;
+	bool counts_bytes;  // reports MB/s of plaintext
+	void (*run)(bench_case *bc);
+} bench_op;
+
+// summary of the samples of one benchmark
+typedef struct {
+	const char *name;
+	uint64_t bits;
+	uint64_t samples;
+	double mean;
+	uint64_t min;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+	double ops_per_s;
+	double mb_per_s;  // negative when the benchmark does not count bytes
+} bench_result;
+
+static void run_pow_mod(bench_case *bc) {
+	pow_mod(bc->o, bc->a, bc->d, bc->n);
+}
+
+static void run_is_prime(bench_case *bc) {
+	is_prime(bc->p, 0, &bc->rng);
+}
+
+static void run_make_prime(bench_case *bc) {
+	make_prime(bc->o, bc->bits, 0, PRIME_TEST_MR, &bc->rng);
+}
+
+static void run_gcd(bench_case *bc) {
+	gcd(bc->o, bc->a, bc->n);
+}
+
+static void run_mod_inverse(bench_case *bc) {
+	mod_inverse(bc->o, bc->a, bc->p);
+}
+
+static void run_encrypt_file(bench_case *bc) {
+	FILE *in = fmemopen(bc->plain, bc->plain_len, "r");
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	rsa_encrypt_file(in, out, bc->kn, bc->e);
+	fclose(in);
+	fclose(out);
+	free(buf);
+}
+
+static void run_decrypt_file(bench_case *bc) {
+	FILE *in = fmemopen(bc->cipher, bc->cipher_len, "r");
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	rsa_decrypt_file(in, out, bc->kn, bc->kd);
+	fclose(in);
+	fclose(out);
+	free(buf);
+}
+
+static const bench_op bench_ops[] = {
+	{ "pow_mod", false, false, false, run_pow_mod },
+	{ "is_prime", true, false, false, run_is_prime },
+	{ "make_prime", false, false, false, run_make_prime },
+	{ "gcd", false, false, false, run_gcd },
+	{ "mod_inverse", true, false, false, run_mod_inverse },
+	{ "rsa_encrypt_file", false, true, true, run_encrypt_file },
+	{ "rsa_decrypt_file", false, true, true, run_decrypt_file },
+};
+
+#define BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *x, const void *y) {
+	uint64_t a = *(const uint64_t *) x;
+	uint64_t b = *(const uint64_t *) y;
+	return (a > b) - (a < b);
+}
+
+// nearest-rank percentile of sorted samples
+static uint64_t percentile(const uint64_t *sorted, uint64_t count, uint32_t pct) {
+	uint64_t rank = (count * pct + 99) / 100;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// builds the operands of one benchmark from the fixed seed, so every run times the same work
+static void bench_case_init(bench_case *bc, const bench_op *op, uint64_t bits, uint64_t seed, size_t plain_len) {
+	bc->bits = bits;
+	mpz_inits(bc->o, bc->a, bc->d, bc->n, bc->p, bc->e, bc->kn, bc->kd, NULL);
+	randstate_init(seed);
+	rand_ctx_init(&bc->rng, seed);
+	// a full-size base, exponent and odd modulus
+	mpz_urandomb(bc->n, state, bits);
+	mpz_setbit(bc->n, bits - 1);
+	mpz_setbit(bc->n, 0);
+	mpz_urandomb(bc->a, state, bits);
+	mpz_mod(bc->a, bc->a, bc->n);
+	mpz_urandomb(bc->d, state, bits);
+	if (op->needs_prime) {
+		make_prime(bc->p, bits, 0, PRIME_TEST_MR, &bc->rng);
+		mpz_urandomb(bc->a, state, bits);
+		mpz_mod(bc->a, bc->a, bc->p);
+		if (mpz_sgn(bc->a) == 0) {
+			mpz_set_ui(bc->a, 2);
+		}
+	}
+	bc->plain = NULL;
+	bc->plain_len = 0;
+	bc->cipher = NULL;
+	bc->cipher_len = 0;
+	if (op->needs_key) {
+		mpz_t p;
+		mpz_init(p);
+		mpz_t q;
+		mpz_init(q);
+		rsa_make_pub(p, q, bc->kn, bc->e, bits, 0, PRIME_TEST_MR, &bc->rng);
+		rsa_make_priv(bc->kd, bc->e, p, q);
+		mpz_clears(p, q, NULL);
+		bc->plain_len = plain_len;
+		bc->plain = (uint8_t *) malloc(plain_len);
+		for (size_t i = 0; i < plain_len; i += 1) {
+			bc->plain[i] = gmp_urandomb_ui(state, 8);
+		}
+		FILE *in = fmemopen(bc->plain, plain_len, "r");
+		FILE *out = open_memstream(&bc->cipher, &bc->cipher_len);
+		rsa_encrypt_file(in, out, bc->kn, bc->e);
+		fclose(in);
+		fclose(out);
+	}
+}
+
+static void bench_case_clear(bench_case *bc) {
+	mpz_clears(bc->o, bc->a, bc->d, bc->n, bc->p, bc->e, bc->kn, bc->kd, NULL);
+	rand_ctx_clear(&bc->rng);
+	randstate_clear();
+	free(bc->plain);
+	free(bc->cipher);
+}
+
+// times one benchmark: warmup untimed runs, then samples until min_samples are taken and budget_ns has passed
+static void bench_run(bench_result *r, const bench_op *op, uint64_t bits, uint64_t seed, size_t plain_len, uint32_t warmup, uint64_t min_samples, uint64_t budget_ns, uint64_t *samples) {
+	bench_case bc;
+	bench_case_init(&bc, op, bits, seed, plain_len);
+	for (uint32_t i = 0; i < warmup; i += 1) {
+		op->run(&bc);
+	}
+	uint64_t count = 0;
+	uint64_t total = 0;
+	while (count < BENCH_MAX_SAMPLES && (count < min_samples || total < budget_ns)) {
+		uint64_t start = now_ns();
+		op->run(&bc);
+		samples[count] = now_ns() - start;
+		total += samples[count];
+		count += 1;
+	}
+	qsort(samples, count, sizeof(uint64_t), cmp_u64);
+	r->name = op->name;
+	r->bits = bits;
+	r->samples = count;
+	r->mean = (double) total / count;
+	r->min = samples[0];
+	r->p50 = percentile(samples, count, 50);
+	r->p90 = percentile(samples, count, 90);
+	r->p99 = percentile(samples, count, 99);
+	r->max = samples[count - 1];
+	r->ops_per_s = 1e9 / r->mean;
+	r->mb_per_s = op->counts_bytes ? (double) plain_len / r->mean * 1e3 : -1;
+	bench_case_clear(&bc);
+}
+
+// writes the results as JSON, one result object per line so baselines are easy to read back
+static void write_json(FILE *out, bench_result *rs, uint64_t count, uint64_t seed, uint32_t warmup, uint64_t budget_ms, size_t plain_len) {
+	fprintf(out, "{\n  \"seed\": %" PRIu64 ",\n  \"warmup\": %u,\n  \"budget_ms\": %" PRIu64 ",\n  \"file_bytes\": %zu,\n  \"results\": [\n", seed, warmup, budget_ms, plain_len);
+	for (uint64_t i = 0; i < count; i += 1) {
+		bench_result *r = &rs[i];
+		fprintf(out, "    {\"name\": \"%s\", \"bits\": %" PRIu64 ", \"samples\": %" PRIu64 ", \"ns_per_op\": %.0f, \"ops_per_s\": %.3f, ", r->name, r->bits, r->samples, r->mean, r->ops_per_s);
+		if (r->mb_per_s >= 0) {
+			fprintf(out, "\"mb_per_s\": %.3f, ", r->mb_per_s);
+		} else {
+			fprintf(out, "\"mb_per_s\": null, ");
+		}
+		fprintf(out, "\"min_ns\": %" PRIu64 ", \"p50_ns\": %" PRIu64 ", \"p90_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}%s\n", r->min, r->p50, r->p90, r->p99, r->max, i + 1 < count ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+// finds the median time of a benchmark in a baseline written by write_json
+// returns false if the baseline has no such benchmark
+static bool baseline_p50(FILE *base, const char *name, uint64_t bits, uint64_t *p50) {
+	char line[1024];
+	char key[128];
+	snprintf(key, sizeof(key), "{\"name\": \"%s\", \"bits\": %" PRIu64 ",", name, bits);
+	rewind(base);
+	while (fgets(line, sizeof(line), base)) {
+		char *at = strstr(line, key);
+		char *med = strstr(line, "\"p50_ns\": ");
+		if (at && med && sscanf(med, "\"p50_ns\": %" SCNu64, p50) == 1) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void print_error(void) {
+	fprintf(stderr, "Usage: ./bench [options]\n  ./bench times pow_mod, is_prime, make_prime, gcd, mod_inverse, rsa_encrypt_file and rsa_decrypt_file\n  at several sizes with fixed seeds and reports ns/op, ops/s, MB/s and percentiles.\n    -b <bits>   : Comma-separated sizes in bits. Default: 1024,2048,3072,4096\n    -f <name>   : Only run the benchmarks whose name contains <name>. Default: all\n    -s <seed>   : Seed of the operands. Default: 2021\n    -w <runs>   : Untimed warmup runs per benchmark. Default: 2\n    -n <runs>   : Least number of timed runs per benchmark. Default: 5\n    -T <ms>     : Keep timing each benchmark for at least <ms> milliseconds. Default: 1000\n    -m <bytes>  : Plaintext size for the file benchmarks. Default: 65536\n    -j <file>   : Write the results as JSON to <file> (- for standard output).\n    -c <file>   : Compare the median times against a baseline JSON file from -j.\n    -r <pct>    : With -c, exit with 1 if any benchmark is more than <pct> percent slower. Default: off\n    -A          : Use GMP's default allocator instead of the pooled one (see mempool.h).\n    -h          : Display program synopsis and usage.\n");
+}
+
+int main(int argc, char **argv) {
+	int opt = 0; // used for getopt
+	// set default values
+	uint64_t sizes[BENCH_MAX_SIZES] = { 1024, 2048, 3072, 4096 };
+	uint32_t nsizes = 4;
+	char *filter = "";
+	uint64_t seed = 2021;
+	uint32_t warmup = 2;
+	uint64_t min_samples = 5;
+	uint64_t budget_ms = 1000;
+	size_t plain_len = 65536;
+	char *json_name = NULL;
+	char *base_name = NULL;
+	double regress = -1;
+	bool pooled = true;
+
+	// gets user input and runs until processes all the commands
+	while ((opt = getopt(argc, argv, "b:f:s:w:n:T:m:j:c:r:Ah")) != -1) { //list of valid commands
+		// sizes in bits
+		if (opt == 'b') {
+			nsizes = 0;
+			for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+				uint64_t bits = strtoull(tok, NULL, 10);
+				if (bits < 64 || nsizes == BENCH_MAX_SIZES) {
+					fprintf(stderr, "./bench: Sizes must be at least 64 bits and at most %u of them, not %s.\n", BENCH_MAX_SIZES, tok);
+					print_error();
+					return 1;
+				}
+				sizes[nsizes] = bits;
+				nsizes += 1;
+			}
+		}
+		// benchmark filter
+		else if (opt == 'f') {
+			filter = optarg;
+		}
+		// seed
+		else if (opt == 's') {
+			seed = strtoull(optarg, NULL, 10);
+		}
+		// warmup runs
+		else if (opt == 'w') {
+			warmup = strtoul(optarg, NULL, 10);
+		}
+		// least timed runs
+		else if (opt == 'n') {
+			min_samples = strtoull(optarg, NULL, 10);
+			if (min_samples < 1 || min_samples > BENCH_MAX_SAMPLES) {
+				fprintf(stderr, "./bench: Number of runs must be 1-%u, not %" PRIu64 ".\n", BENCH_MAX_SAMPLES, min_samples);
+				print_error();
+				return 1;
+			}
+		}
+		// time budget
+		else if (opt == 'T') {
+			budget_ms = strtoull(optarg, NULL, 10);
+		}
+		// plaintext size
+		else if (opt == 'm') {
+			plain_len = strtoull(optarg, NULL, 10);
+			if (plain_len < 1) {
+				fprintf(stderr, "./bench: Plaintext size must be at least 1 byte.\n");
+				print_error();
+				return 1;
+			}
+		}
+		// JSON output
+		else if (opt == 'j') {
+			json_name = optarg;
+		}
+		// baseline
+		else if (opt == 'c') {
+			base_name = optarg;
+		}
+		// regression threshold
+		else if (opt == 'r') {
+			regress = strtod(optarg, NULL);
+		}
+		// default allocator
+		else if (opt == 'A') {
+			pooled = false;
+		}
+		// usage message
+		else if (opt == 'h') {
+			print_error();
+			return 0;
+		}
+		// if it's not in the above options, return an error number
+		else {
+			print_error();
+			return 1;
+		}
+	}
+
+	// GMP buffers come from per-thread pools like in the tools, unless asked not to
+	if (pooled) {
+		mempool_install();
+	}
+
+	FILE *base = NULL;
+	if (base_name) {
+		base = fopen(base_name, "r");
+		if (!base) {
+			fprintf(stderr, "Couldn't open %s to read the baseline: No such file or directory\n", base_name);
+			return 1;
+		}
+	}
+
+	bench_result *rs = (bench_result *) malloc(BENCH_OPS * nsizes * sizeof(bench_result));
+	uint64_t *samples = (uint64_t *) malloc(BENCH_MAX_SAMPLES * sizeof(uint64_t));
+	uint64_t count = 0;
+	bool regressed = false;
+	// the table goes to standard error when standard output carries the JSON
+	FILE *table = json_name && strcmp(json_name, "-") == 0 ? stderr : stdout;
+	fprintf(table, "%-18s %6s %8s %14s %12s %10s %12s %12s %12s\n", "benchmark", "bits", "samples", "ns/op", "ops/s", "MB/s", "p50 ns", "p90 ns", "p99 ns");
+	for (uint32_t i = 0; i < BENCH_OPS; i += 1) {
+		if (!strstr(bench_ops[i].name, filter)) {
+			continue;
+		}
+		for (uint32_t j = 0; j < nsizes; j += 1) {
+			bench_result *r = &rs[count];
+			bench_run(r, &bench_ops[i], sizes[j], seed, plain_len, warmup, min_samples, budget_ms * 1000000u, samples);
+			count += 1;
+			fprintf(table, "%-18s %6" PRIu64 " %8" PRIu64 " %14.0f %12.2f ", r->name, r->bits, r->samples, r->mean, r->ops_per_s);
+			if (r->mb_per_s >= 0) {
+				fprintf(table, "%10.3f ", r->mb_per_s);
+			} else {
+				fprintf(table, "%10s ", "-");
+			}
+			fprintf(table, "%12" PRIu64 " %12" PRIu64 " %12" PRIu64, r->p50, r->p90, r->p99);
+			uint64_t old = 0;
+			if (base && baseline_p50(base, r->name, r->bits, &old) && old > 0) {
+				// positive is slower than the baseline
+				double change = ((double) r->p50 / old - 1) * 100;
+				fprintf(table, "  %+.1f%% vs baseline", change);
+				if (regress >= 0 && change > regress) {
+					fprintf(table, " (regression)");
+					regressed = true;
+				}
+			}
+			fprintf(table, "\n");
+			fflush(table);
+		}
+	}
+
+	if (json_name) {
+		FILE *out = strcmp(json_name, "-") == 0 ? stdout : fopen(json_name, "w");
+		if (!out) {
+			fprintf(stderr, "Couldn't open %s to write the results: No such file or directory\n", json_name);
+			return 1;
+		}
+		write_json(out, rs, count, seed, warmup, budget_ms, plain_len);
+		if (out != stdout) {
+			fclose(out);
+		}
+	}
+
+	if (base) {
+		fclose(base);
+	}
+	free(samples);
+	free(rs);
+	return regressed ? 1 : 0;
+}
@@ -0,0 +1,347 @@
+// implements the ChaCha20 stream cipher and the Poly1305 authenticator (RFC 8439)
+#include "chacha.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// reads a little-endian 32-bit word
+static uint32_t load32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// writes a little-endian 32-bit word
+static void store32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+// writes a little-endian 64-bit word
+static void store64(uint8_t *p, uint64_t v) {
+	store32(p, v);
+	store32(p + 4, v >> 32);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+// computes one 64-byte block of key stream from the 16-word input state
+static void chacha20_block(uint32_t out[16], const uint32_t in[16]) {
+	uint32_t x[16];
+	memcpy(x, in, sizeof(x));
+	// 20 rounds: 10 column rounds, each followed by a diagonal round
+	for (int i = 0; i < 10; i += 1) {
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; i += 1) {
+		out[i] = x[i] + in[i];
+	}
+}
+
+// sets up the input state: constants, key, counter, nonce
+static void chacha20_setup(uint32_t s[16], const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter) {
+	// "expand 32-byte k"
+	s[0] = 0x61707865;
+	s[1] = 0x3320646e;
+	s[2] = 0x79622d32;
+	s[3] = 0x6b206574;
+	for (int i = 0; i < 8; i += 1) {
+		s[4 + i] = load32(key + 4 * i);
+	}
+	s[12] = counter;
+	s[13] = load32(nonce);
+	s[14] = load32(nonce + 4);
+	s[15] = load32(nonce + 8);
+}
+
+//
+// Encrypts or decrypts with the ChaCha20 stream cipher (the same operation both ways).
+// out may alias in.
+//
+// out: will store len bytes of in XORed with the key stream.
+// in: the input bytes.
+// len: the number of bytes.
+// key: the 32-byte key.
+// nonce: the 12-byte nonce, never to be used twice with one key.
+// counter: the block counter of the first 64 bytes.
+//
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter) {
+	uint32_t s[16];
+	uint32_t ks[16];
+	chacha20_setup(s, key, nonce, counter);
+	// whole blocks a word at a time
+	while (len >= CHACHA_BLOCK_BYTES) {
+		chacha20_block(ks, s);
+		for (int i = 0; i < 16; i += 1) {
+			store32(out + 4 * i, load32(in + 4 * i) ^ ks[i]);
+		}
+		s[12] += 1;
+		in += CHACHA_BLOCK_BYTES;
+		out += CHACHA_BLOCK_BYTES;
+		len -= CHACHA_BLOCK_BYTES;
+	}
+	// the tail a byte at a time
+	if (len > 0) {
+		uint8_t block[CHACHA_BLOCK_BYTES];
+		chacha20_block(ks, s);
+		for (int i = 0; i < 16; i += 1) {
+			store32(block + 4 * i, ks[i]);
+		}
+		for (size_t i = 0; i < len; i += 1) {
+			out[i] = in[i] ^ block[i];
+		}
+	}
+}
+
+//
+// Starts a Poly1305 code with a one-time key.
+//
+// ctx: the state to initialize.
+// key: the 32-byte one-time key, never to be used for two messages.
+//
+void poly1305_init(poly1305_ctx *ctx, const uint8_t key[32]) {
+	// r with the bits RFC 8439 clears, split into 26-bit digits
+	ctx->r[0] = load32(key) & 0x3ffffff;
+	ctx->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+	ctx->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+	ctx->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+	ctx->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+	memset(ctx->h, 0, sizeof(ctx->h));
+	for (int i = 0; i < 4; i += 1) {
+		ctx->pad[i] = load32(key + 16 + 4 * i);
+	}
+	ctx->used = 0;
+}
+
+// adds whole 16-byte blocks to the accumulator: h = (h + block + hibit) * r (mod 2^130 - 5)
+// hibit is 2^128 for full message blocks and 0 for the padded last block
+static void poly1305_blocks(poly1305_ctx *ctx, const uint8_t *m, size_t len, uint32_t hibit) {
+	uint64_t r0 = ctx->r[0];
+	uint64_t r1 = ctx->r[1];
+	uint64_t r2 = ctx->r[2];
+	uint64_t r3 = ctx->r[3];
+	uint64_t r4 = ctx->r[4];
+	// 2^130 = 5 (mod p), so the digits that wrap around are multiplied by 5
+	uint64_t s1 = r1 * 5;
+	uint64_t s2 = r2 * 5;
+	uint64_t s3 = r3 * 5;
+	uint64_t s4 = r4 * 5;
+	uint32_t h0 = ctx->h[0];
+	uint32_t h1 = ctx->h[1];
+	uint32_t h2 = ctx->h[2];
+	uint32_t h3 = ctx->h[3];
+	uint32_t h4 = ctx->h[4];
+	while (len >= 16) {
+		h0 += load32(m) & 0x3ffffff;
+		h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+		h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+		h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+		h4 += (load32(m + 12) >> 8) | hibit;
+		uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+		uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4 + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+		uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0 + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+		uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1 + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+		uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2 + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+		// carry the digits back down to 26 bits (h stays partially reduced)
+		uint32_t c = d0 >> 26;
+		h0 = d0 & 0x3ffffff;
+		d1 += c;
+		c = d1 >> 26;
+		h1 = d1 & 0x3ffffff;
+		d2 += c;
+		c = d2 >> 26;
+		h2 = d2 & 0x3ffffff;
+		d3 += c;
+		c = d3 >> 26;
+		h3 = d3 & 0x3ffffff;
+		d4 += c;
+		c = d4 >> 26;
+		h4 = d4 & 0x3ffffff;
+		h0 += c * 5;
+		c = h0 >> 26;
+		h0 &= 0x3ffffff;
+		h1 += c;
+		m += 16;
+		len -= 16;
+	}
+	ctx->h[0] = h0;
+	ctx->h[1] = h1;
+	ctx->h[2] = h2;
+	ctx->h[3] = h3;
+	ctx->h[4] = h4;
+}
+
+//
+// Adds bytes to a Poly1305 code.
+//
+// ctx: the state.
+// data: the bytes.
+// len: the number of bytes.
+//
+void poly1305_update(poly1305_ctx *ctx, const uint8_t *data, size_t len) {
+	// finish a partial block first
+	if (ctx->used > 0) {
+		size_t take = 16 - ctx->used < len ? 16 - ctx->used : len;
+		memcpy(ctx->buf + ctx->used, data, take);
+		ctx->used += take;
+		data += take;
+		len -= take;
+		if (ctx->used < 16) {
+			return;
+		}
+		poly1305_blocks(ctx, ctx->buf, 16, 1u << 24);
+		ctx->used = 0;
+	}
+	size_t whole = len & ~(size_t) 15;
+	poly1305_blocks(ctx, data, whole, 1u << 24);
+	memcpy(ctx->buf, data + whole, len - whole);
+	ctx->used = len - whole;
+}
+
+//
+// Finishes a Poly1305 code.
+//
+// ctx: the state, unusable afterwards.
+// tag: will store the 16-byte code.
+//
+void poly1305_finish(poly1305_ctx *ctx, uint8_t tag[CHACHA_TAG_BYTES]) {
+	// the last partial block gets a 1 byte after its data instead of the 2^128 bit
+	if (ctx->used > 0) {
+		ctx->buf[ctx->used] = 1;
+		memset(ctx->buf + ctx->used + 1, 0, 16 - ctx->used - 1);
+		poly1305_blocks(ctx, ctx->buf, 16, 0);
+	}
+	uint32_t h0 = ctx->h[0];
+	uint32_t h1 = ctx->h[1];
+	uint32_t h2 = ctx->h[2];
+	uint32_t h3 = ctx->h[3];
+	uint32_t h4 = ctx->h[4];
+	// fully carry h
+	uint32_t c = h1 >> 26;
+	h1 &= 0x3ffffff;
+	h2 += c;
+	c = h2 >> 26;
+	h2 &= 0x3ffffff;
+	h3 += c;
+	c = h3 >> 26;
+	h3 &= 0x3ffffff;
+	h4 += c;
+	c = h4 >> 26;
+	h4 &= 0x3ffffff;
+	h0 += c * 5;
+	c = h0 >> 26;
+	h0 &= 0x3ffffff;
+	h1 += c;
+	// g = h - p = h + 5 - 2^130, picked without branching if it does not go negative
+	uint32_t g0 = h0 + 5;
+	c = g0 >> 26;
+	g0 &= 0x3ffffff;
+	uint32_t g1 = h1 + c;
+	c = g1 >> 26;
+	g1 &= 0x3ffffff;
+	uint32_t g2 = h2 + c;
+	c = g2 >> 26;
+	g2 &= 0x3ffffff;
+	uint32_t g3 = h3 + c;
+	c = g3 >> 26;
+	g3 &= 0x3ffffff;
+	uint32_t g4 = h4 + c - (1u << 26);
+	uint32_t mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+	// h mod 2^128 as four 32-bit words, plus pad
+	uint64_t f0 = (uint64_t) (h0 | (h1 << 26)) + ctx->pad[0];
+	uint64_t f1 = (uint64_t) ((h1 >> 6) | (h2 << 20)) + ctx->pad[1] + (f0 >> 32);
+	uint64_t f2 = (uint64_t) ((h2 >> 12) | (h3 << 14)) + ctx->pad[2] + (f1 >> 32);
+	uint64_t f3 = (uint64_t) ((h3 >> 18) | (h4 << 8)) + ctx->pad[3] + (f2 >> 32);
+	store32(tag, f0);
+	store32(tag + 4, f1);
+	store32(tag + 8, f2);
+	store32(tag + 12, f3);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+// computes the tag of an AEAD message: Poly1305 under the first key stream block,
+// over aad, ciphertext and their lengths, each padded to 16 bytes
+static void aead_tag(uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *ct, size_t len, const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES]) {
+	static const uint8_t zeros[16] = { 0 };
+	uint8_t otk[32] = { 0 };
+	chacha20_xor(otk, otk, sizeof(otk), key, nonce, 0);
+	poly1305_ctx mac;
+	poly1305_init(&mac, otk);
+	poly1305_update(&mac, aad, aad_len);
+	poly1305_update(&mac, zeros, (16 - aad_len % 16) % 16);
+	poly1305_update(&mac, ct, len);
+	poly1305_update(&mac, zeros, (16 - len % 16) % 16);
+	uint8_t lengths[16];
+	store64(lengths, aad_len);
+	store64(lengths + 8, len);
+	poly1305_update(&mac, lengths, sizeof(lengths));
+	poly1305_finish(&mac, tag);
+	memset(otk, 0, sizeof(otk));
+}
+
+//
+// Encrypts and authenticates a message with ChaCha20-Poly1305 (RFC 8439).
+// out may alias in.
+//
+// out: will store the len bytes of ciphertext.
+// tag: will store the 16-byte authentication tag.
+// in: the plaintext.
+// len: the number of plaintext bytes.
+// aad: associated data, authenticated but not encrypted.
+// aad_len: the number of associated data bytes.
+// key: the 32-byte key.
+// nonce: the 12-byte nonce, never to be used twice with one key.
+//
+void chacha20_poly1305_seal(uint8_t *out, uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *in, size_t len, const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES]) {
+	// the message starts at block 1, block 0 made the one-time key
+	chacha20_xor(out, in, len, key, nonce, 1);
+	aead_tag(tag, out, len, aad, aad_len, key, nonce);
+}
+
+//
+// Checks and decrypts a message sealed with chacha20_poly1305_seal.
+// Nothing is decrypted unless the tag matches. out may alias in.
+//
+// out: will store the len bytes of plaintext.
+// in: the ciphertext.
+// len: the number of ciphertext bytes.
+// tag: the 16-byte authentication tag.
+// aad: the associated data the message was sealed with.
+// aad_len: the number of associated data bytes.
+// key: the 32-byte key.
+// nonce: the 12-byte nonce the message was sealed with.
+// returns: true if the tag matches, false otherwise.
+//
+bool chacha20_poly1305_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES]) {
+	uint8_t expected[CHACHA_TAG_BYTES];
+	aead_tag(expected, in, len, aad, aad_len, key, nonce);
+	// compare in constant time
+	uint8_t diff = 0;
+	for (int i = 0; i < CHACHA_TAG_BYTES; i += 1) {
+		diff |= expected[i] ^ tag[i];
+	}
+	if (diff != 0) {
+		return false;
+	}
+	chacha20_xor(out, in, len, key, nonce, 1);
+	return true;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// sizes of the ChaCha20-Poly1305 key, nonce and authentication tag in bytes (RFC 8439)
+#define CHACHA_KEY_BYTES 32
+#define CHACHA_NONCE_BYTES 12
+#define CHACHA_TAG_BYTES 16
+
+// bytes of key stream one ChaCha20 block produces
+#define CHACHA_BLOCK_BYTES 64
+
+//
+// Running state of a Poly1305 message authentication code.
+// Numbers are kept in five 26-bit digits so every product fits in 64 bits.
+//
+// r: the clamped multiplier half of the one-time key.
+// h: the accumulator.
+// pad: the half of the one-time key added at the end.
+// buf: bytes waiting for a full 16-byte block.
+// used: the number of bytes in buf.
+//
+typedef struct {
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+	uint8_t buf[16];
+	size_t used;
+} poly1305_ctx;
+
+//
+// Encrypts or decrypts with the ChaCha20 stream cipher (the same operation both ways).
+// out may alias in.
+//
+// out: will store len bytes of in XORed with the key stream.
+// in: the input bytes.
+// len: the number of bytes.
+// key: the 32-byte key.
+// nonce: the 12-byte nonce, never to be used twice with one key.
+// counter: the block counter of the first 64 bytes.
+//
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES], uint32_t counter);
+
+//
+// Starts a Poly1305 code with a one-time key.
+//
+// ctx: the state to initialize.
+// key: the 32-byte one-time key, never to be used for two messages.
+//
+void poly1305_init(poly1305_ctx *ctx, const uint8_t key[32]);
+
+//
+// Adds bytes to a Poly1305 code.
+//
+// ctx: the state.
+// data: the bytes.
+// len: the number of bytes.
+//
+void poly1305_update(poly1305_ctx *ctx, const uint8_t *data, size_t len);
+
+//
+// Finishes a Poly1305 code.
+//
+// ctx: the state, unusable afterwards.
+// tag: will store the 16-byte code.
+//
+void poly1305_finish(poly1305_ctx *ctx, uint8_t tag[CHACHA_TAG_BYTES]);
+
+//
+// Encrypts and authenticates a message with ChaCha20-Poly1305 (RFC 8439).
+// out may alias in.
+//
+// out: will store the len bytes of ciphertext.
+// tag: will store the 16-byte authentication tag.
+// in: the plaintext.
+// len: the number of plaintext bytes.
+// aad: associated data, authenticated but not encrypted.
+// aad_len: the number of associated data bytes.
+// key: the 32-byte key.
+// nonce: the 12-byte nonce, never to be used twice with one key.
+//
+void chacha20_poly1305_seal(uint8_t *out, uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *in, size_t len, const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES]);
+
+//
+// Checks and decrypts a message sealed with chacha20_poly1305_seal.
+// Nothing is decrypted unless the tag matches. out may alias in.
+//
+// out: will store the len bytes of plaintext.
+// in: the ciphertext.
+// len: the number of ciphertext bytes.
+// tag: the 16-byte authentication tag.
+// aad: the associated data the message was sealed with.
+// aad_len: the number of associated data bytes.
+// key: the 32-byte key.
+// nonce: the 12-byte nonce the message was sealed with.
+// returns: true if the tag matches, false otherwise.
+//
+bool chacha20_poly1305_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t tag[CHACHA_TAG_BYTES], const uint8_t *aad, size_t aad_len, const uint8_t key[CHACHA_KEY_BYTES], const uint8_t nonce[CHACHA_NONCE_BYTES]);
@@ -0,0 +1,163 @@
+// implement chachatest program: checks ChaCha20, Poly1305 and their AEAD against the RFC 8439 test vectors
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include "chacha.h"
+
+// the plaintext of RFC 8439 sections 2.4.2 and 2.8.2
+static const char *sunscreen = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+
+// RFC 8439 2.3.2: the key stream block of key 00..1f, nonce 000000090000004a00000000, counter 1
+static const char *block_232 = "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+	"d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e";
+
+// RFC 8439 2.4.2: the sunscreen text under key 00..1f, nonce 000000000000004a00000000, counter 1
+static const char *cipher_242 = "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+	"f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+	"07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+	"5af90bbf74a35be6b40b8eedf2785e42874d";
+
+// RFC 8439 2.5.2: the one-time key and tag of "Cryptographic Forum Research Group"
+static const char *key_252 = "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b";
+static const char *tag_252 = "a8061dc1305136c6c22b8baf0c0127a9";
+
+// RFC 8439 2.8.2: the sunscreen text sealed under key 80..9f with this nonce and associated data
+static const char *nonce_282 = "070000004041424344454647";
+static const char *aad_282 = "50515253c0c1c2c3c4c5c6c7";
+static const char *cipher_282 = "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+	"3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+	"92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+	"3ff4def08e4b7a9de576d26586cec64b6116";
+static const char *tag_282 = "1ae10b594f09e26a7e902ecbd0600691";
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+// counts one check and prints it when it does not hold
+static void expect(bool cond, const char *what) {
+	checks += 1;
+	if (!cond) {
+		failures += 1;
+		fprintf(stderr, "chachatest: FAILED %s\n", what);
+	}
+}
+
+// decodes a hex string into out, returns the number of bytes
+static size_t from_hex(uint8_t *out, const char *hex) {
+	size_t len = strlen(hex) / 2;
+	for (size_t i = 0; i < len; i += 1) {
+		unsigned int byte;
+		sscanf(hex + 2 * i, "%2x", &byte);
+		out[i] = byte;
+	}
+	return len;
+}
+
+// fills a key with the bytes first, first+1, ...
+static void count_key(uint8_t key[CHACHA_KEY_BYTES], uint8_t first) {
+	for (uint32_t i = 0; i < CHACHA_KEY_BYTES; i += 1) {
+		key[i] = first + i;
+	}
+}
+
+static void test_block(void) {
+	uint8_t key[CHACHA_KEY_BYTES];
+	uint8_t nonce[CHACHA_NONCE_BYTES];
+	uint8_t want[CHACHA_BLOCK_BYTES];
+	uint8_t got[CHACHA_BLOCK_BYTES];
+	count_key(key, 0);
+	from_hex(nonce, "000000090000004a00000000");
+	from_hex(want, block_232);
+	// the key stream is what XORing zeros gives
+	memset(got, 0, sizeof(got));
+	chacha20_xor(got, got, sizeof(got), key, nonce, 1);
+	expect(memcmp(got, want, sizeof(want)) == 0, "2.3.2 ChaCha20 block");
+}
+
+static void test_cipher(void) {
+	uint8_t key[CHACHA_KEY_BYTES];
+	uint8_t nonce[CHACHA_NONCE_BYTES];
+	uint8_t want[128];
+	uint8_t got[128];
+	count_key(key, 0);
+	from_hex(nonce, "000000000000004a00000000");
+	size_t len = from_hex(want, cipher_242);
+	expect(len == strlen(sunscreen), "2.4.2 vector length");
+	chacha20_xor(got, (const uint8_t *) sunscreen, len, key, nonce, 1);
+	expect(memcmp(got, want, len) == 0, "2.4.2 ChaCha20 encryption");
+	// in place, the same operation decrypts
+	chacha20_xor(got, got, len, key, nonce, 1);
+	expect(memcmp(got, sunscreen, len) == 0, "2.4.2 ChaCha20 decryption in place");
+}
+
+static void test_poly1305(void) {
+	uint8_t key[32];
+	uint8_t want[CHACHA_TAG_BYTES];
+	uint8_t got[CHACHA_TAG_BYTES];
+	const char *msg = "Cryptographic Forum Research Group";
+	size_t len = strlen(msg);
+	from_hex(key, key_252);
+	from_hex(want, tag_252);
+	poly1305_ctx ctx;
+	poly1305_init(&ctx, key);
+	poly1305_update(&ctx, (const uint8_t *) msg, len);
+	poly1305_finish(&ctx, got);
+	expect(memcmp(got, want, sizeof(want)) == 0, "2.5.2 Poly1305");
+	// one byte at a time goes through the partial block buffer
+	poly1305_init(&ctx, key);
+	for (size_t i = 0; i < len; i += 1) {
+		poly1305_update(&ctx, (const uint8_t *) msg + i, 1);
+	}
+	poly1305_finish(&ctx, got);
+	expect(memcmp(got, want, sizeof(want)) == 0, "2.5.2 Poly1305 fed one byte at a time");
+}
+
+static void test_aead(void) {
+	uint8_t key[CHACHA_KEY_BYTES];
+	uint8_t nonce[CHACHA_NONCE_BYTES];
+	uint8_t aad[12];
+	uint8_t want[128];
+	uint8_t want_tag[CHACHA_TAG_BYTES];
+	uint8_t got[128];
+	uint8_t tag[CHACHA_TAG_BYTES];
+	uint8_t plain[128];
+	count_key(key, 0x80);
+	from_hex(nonce, nonce_282);
+	size_t aad_len = from_hex(aad, aad_282);
+	size_t len = from_hex(want, cipher_282);
+	from_hex(want_tag, tag_282);
+	chacha20_poly1305_seal(got, tag, (const uint8_t *) sunscreen, len, aad, aad_len, key, nonce);
+	expect(memcmp(got, want, len) == 0, "2.8.2 AEAD ciphertext");
+	expect(memcmp(tag, want_tag, sizeof(tag)) == 0, "2.8.2 AEAD tag");
+	bool opened = chacha20_poly1305_open(plain, got, len, tag, aad, aad_len, key, nonce);
+	expect(opened && memcmp(plain, sunscreen, len) == 0, "2.8.2 AEAD opens");
+
+	// a flipped bit anywhere must make open fail
+	tag[CHACHA_TAG_BYTES - 1] ^= 1;
+	expect(!chacha20_poly1305_open(plain, got, len, tag, aad, aad_len, key, nonce), "a tampered tag is rejected");
+	tag[CHACHA_TAG_BYTES - 1] ^= 1;
+	got[len / 2] ^= 0x80;
+	expect(!chacha20_poly1305_open(plain, got, len, tag, aad, aad_len, key, nonce), "a tampered ciphertext is rejected");
+	got[len / 2] ^= 0x80;
+	aad[0] ^= 1;
+	expect(!chacha20_poly1305_open(plain, got, len, tag, aad, aad_len, key, nonce), "tampered associated data is rejected");
+	aad[0] ^= 1;
+	expect(!chacha20_poly1305_open(plain, got, len - 1, tag, aad, aad_len, key, nonce), "a truncated ciphertext is rejected");
+}
+
+int main(void) {
+	test_block();
+	test_cipher();
+	test_poly1305();
+	test_aead();
+	if (failures > 0) {
+		fprintf(stderr, "chachatest: %" PRIu64 " of %" PRIu64 " checks failed\n", failures, checks);
+		return 1;
+	}
+	fprintf(stderr, "chachatest: %" PRIu64 " checks passed\n", checks);
+	return 0;
+}
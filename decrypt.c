@@ -5,43 +5,57 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <gmp.h>
 #include <sys/stat.h>
 #include <string.h> 
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "mempool.h"
 
 int print_file(void) {
-	fprintf(stderr, "Usage: ./decrypt [options]\n  ./decrypt decrypts an input file using the specified private key file,\n  writing the result to the specified output file.\n    -i <infile> : Read input from <infile>. Default: standard input.\n    -o <outfile>: Write output to <outfile>. Default: standard output.\n    -n <keyfile>: Private key is in <keyfile>. Default: rsa.priv.\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
+	fprintf(stderr, "Usage: ./decrypt [options]\n  ./decrypt decrypts an input file using the specified private key file,\n  writing the result to the specified output file.\n    -i <infile> : Read input from <infile>. Default: standard input.\n    -o <outfile>: Write output to <outfile>. Default: standard output.\n    -n <keyfile>: Private key is in <keyfile>. Default: rsa.priv.\n    -t <threads>: Decrypt blocks on <threads> worker threads. Default: 1\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
 	return 0;
 }
 
 int main (int argc, char ** argv) {
     int opt = 0; // used for getopt
     // set default numbers
-    char input[] = "stdin"; 
-    char output[] = "stdout";
-    char file[] = "rsa.priv";
+    char *input = "stdin"; 
+    char *output = "stdout";
+    char *file = "rsa.priv";
+    uint32_t threads = 1;
     uint32_t message = 0;
     int give_out = 0;  
     int give_in = 0;
+    // GMP buffers come from per-thread pools, installed before the first number exists
+    mempool_install();
 
     // gets user input and runs until processes all the commands
-    while ((opt = getopt(argc, argv, "i:o:nvh")) != -1) { //list of valid commands
+    while ((opt = getopt(argc, argv, "i:o:n:t:vh")) != -1) { //list of valid commands
         // specifies inputfile
 	if (opt == 'i') {
 		give_in = 1;
-		strcpy(input, optarg);
+		input = optarg;
 	}
 	// specifies output file
 	if (opt=='o') {
 		give_out = 1;
-		strcpy(output, optarg);
+		output = optarg;
 	}
 	// public key name
 	if (opt=='n') {
-        	strcpy(file, optarg);
+		file = optarg;
+	}
+	// number of worker threads
+	if (opt=='t') {
+		threads = strtoul(optarg, NULL, 10);
+		if (threads < 1 || threads > 128) {
+			fprintf(stderr, "./decrypt: Number of threads must be 1-128, not %u.\n", threads);
+			print_file();
+			return 1;
+		}
 	}
 	// enables verbose
 	if (opt=='v') { 
@@ -53,19 +67,15 @@ int main (int argc, char ** argv) {
 		return 0;
         }
 	// if it's not in the above options, return an error number
-	if (opt!='h' && opt!='v' && opt!='n' && opt!='o' && opt!= 'i') {
+	if (opt!='h' && opt!='v' && opt!='n' && opt!='t' && opt!='o' && opt!= 'i') {
 		print_file();
 		return 1;
 	}
 	
     }
  
-	mpz_t n;
-	mpz_init(n);
-	mpz_t d;
-        mpz_init(d);
-	mpz_t s;
-	mpz_init(s);
+	rsa_priv_key key;
+	rsa_priv_key_init(&key);
 		
     	FILE *priv = fopen(file, "r");
 	if (!priv) {// if there was an error with opening the file
@@ -89,22 +99,37 @@ int main (int argc, char ** argv) {
                 return 1;
         }
 
-	rsa_read_priv(n, d, priv);
+	// reads both legacy (n, d) and CRT private keys
+	rsa_read_priv_key(&key, priv);
 	// verbose
 	if (message == 1) {	
-		gmp_fprintf(stderr, "n - modulus (%d bits): %Zd\nd - private key (%d bits): %Zd\n",  mpz_sizeinbase(n,2), n, mpz_sizeinbase(d,2), d);
+		gmp_fprintf(stderr, "n - modulus (%d bits): %Zd\nd - private key (%d bits): %Zd\n",  mpz_sizeinbase(key.n,2), key.n, mpz_sizeinbase(key.d,2), key.d);
+		if (key.crt) {
+			gmp_fprintf(stderr, "p (%d bits): %Zd\nq (%d bits): %Zd\n", mpz_sizeinbase(key.p,2), key.p, mpz_sizeinbase(key.q,2), key.q);
+			for (uint32_t i = 0; i + 2 < key.primes; i += 1) {
+				gmp_fprintf(stderr, "r%u (%d bits): %Zd\n", i+3, mpz_sizeinbase(key.r[i],2), key.r[i]);
+			}
+		}
 	}
 
-	rsa_decrypt_file(in,out,n,d);
+	bool ok = rsa_decrypt_file_mt(in,out,&key,threads);
 	
 	// close files and clear vars
 	fclose(priv);
 	if (give_in == 1) { fclose(in); }
 	if (give_out == 1) { fclose(out); }
-	mpz_clear(n);
-	mpz_clear(d);
-	mpz_clear(s);
-	return 0;
+	rsa_priv_key_clear(&key);
+	// a damaged or tampered ciphertext leaves no partial plaintext behind
+	if (!ok && give_out == 1) {
+		remove(output);
+	}
+	// worker threads have exited, so their counters are in
+	if (message == 1) {
+		mempool_stats pool;
+		mempool_get_stats(&pool);
+		fprintf(stderr, "allocator: %" PRIu64 " allocations, %" PRIu64 " served from the pool, %" PRIu64 " grown in place, %" PRIu64 " frees, %" PRIu64 " returned to malloc\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+	}
+	return ok ? 0 : 1;
 }
 
 
@@ -10,37 +10,50 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "mempool.h"
 
 int print_error(void) {
-	fprintf(stderr, "Usage: ./encrypt [options]\n  ./encrypt encrypts an input file using the specified public key file,\n  writing the result to the specified output file.\n    -i <infile> : Read input from <infile>. Default: standard input.\n    -o <outfile>: Write output to <outfile>. Default: standard output.\n    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
+	fprintf(stderr, "Usage: ./encrypt [options]\n  ./encrypt encrypts an input file using the specified public key file,\n  writing the result to the specified output file.\n    -i <infile> : Read input from <infile>. Default: standard input.\n    -o <outfile>: Write output to <outfile>. Default: standard output.\n    -n <keyfile>: Public key is in <keyfile>. Default: rsa.pub.\n    -b          : Write the compact binary ciphertext format instead of hex text.\n    -H          : Wrap a random ChaCha20-Poly1305 key with RSA and encrypt the input with it (fast for large files).\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
 	return 0;
 }
 
 int main (int argc, char ** argv) {
     int opt = 0; // used for getopt
     // set default numbers
-    char input[] = "stdin"; 
-    char output[] = "stdout";
-    char file[] = "rsa.pub";
+    char *input = "stdin"; 
+    char *output = "stdout";
+    char *file = "rsa.pub";
+    uint32_t binary = 0;
+    uint32_t hybrid = 0;
     int give_out = 0;
     int give_in = 0;
     uint32_t message = 0;
+    // GMP buffers come from per-thread pools, installed before the first number exists
+    mempool_install();
   
     // gets user input and runs until processes all the commands
-    while ((opt = getopt(argc, argv, "i:o:nvh")) != -1) { //list of valid commands
+    while ((opt = getopt(argc, argv, "i:o:n:bHvh")) != -1) { //list of valid commands
         // specifies inputfile
 	if (opt == 'i') {
 		give_in = 1;
-		strcpy(input, optarg);
+		input = optarg;
 	}
 	// specifies output file
 	if (opt=='o') {
 		give_out = 1;
-		strcpy(output, optarg);
+		output = optarg;
 	}
 	// public key name
 	if (opt=='n') {
-		strcpy(file, optarg);
+		file = optarg;
+	}
+	// binary ciphertext
+	if (opt=='b') {
+		binary = 1;
+	}
+	// hybrid ciphertext
+	if (opt=='H') {
+		hybrid = 1;
 	}
 	// enables verbose
 	if (opt=='v') { 
@@ -52,7 +65,7 @@ int main (int argc, char ** argv) {
 		return 0;
         }
 	// if it's not in the above options, return an error number
-	if (opt!='h' && opt!='v' && opt!='n' && opt!='o' && opt!= 'i') {
+	if (opt!='h' && opt!='v' && opt!='n' && opt!='b' && opt!='H' && opt!='o' && opt!= 'i') {
 		print_error();
 		return 1;
 	}
@@ -82,7 +95,8 @@ int main (int argc, char ** argv) {
 		in = fopen(input, "r");
 	}
 	if (give_out == 1) {
-		out = fopen(output, "w");
+		// read-write, so a regular output file can be memory-mapped
+		out = fopen(output, "w+");
 	}
 	if (!in) {// if there was an error with opening the file
                 fprintf(stderr, "Couldn't open %s to read plaintext: No such file or directory\n", input);
@@ -107,7 +121,15 @@ int main (int argc, char ** argv) {
 		return 1;
 	}
 
-	rsa_encrypt_file(in,out,n,e);
+	if (hybrid == 1) {
+		if (!rsa_encrypt_file_hybrid(in,out,n,e)) {
+			return 1;
+		}
+	} else if (binary == 1) {
+		rsa_encrypt_file_bin(in,out,n,e);
+	} else {
+		rsa_encrypt_file(in,out,n,e);
+	}
 	fclose(public);
 	if (give_in == 1) { fclose(in); }
 	if (give_out == 1) { fclose(out); } 
@@ -115,6 +137,11 @@ int main (int argc, char ** argv) {
 	mpz_clear(e);
 	mpz_clear(s);
 	mpz_clear(user);
+	if (message == 1) {
+		mempool_stats pool;
+		mempool_get_stats(&pool);
+		fprintf(stderr, "allocator: %" PRIu64 " allocations, %" PRIu64 " served from the pool, %" PRIu64 " grown in place, %" PRIu64 " frees, %" PRIu64 " returned to malloc\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+	}
 	return 0;
 }
 
@@ -0,0 +1,130 @@
+// implement gcdtest program: checks the Lehmer gcd and mod_inverse against GMP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+
+// random operand pairs per case
+#define TEST_PAIRS 16000
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+// sets x to a random number of up to the given number of bits, negative half of the time if sign is set
+static void random_bits(mpz_t x, uint64_t bits, bool sign, rand_ctx *rng) {
+	mpz_set_ui(x, 0);
+	for (uint64_t w = 0; w < bits; w += 64) {
+		mpz_mul_2exp(x, x, 64);
+		mpz_add_ui(x, x, rand_ctx_u64(rng));
+	}
+	mpz_fdiv_r_2exp(x, x, bits);
+	if (sign && (rand_ctx_u64(rng) & 1) != 0) {
+		mpz_neg(x, x);
+	}
+}
+
+// checks gcd(a, b) and, for b > 0, mod_inverse(a, b) against GMP
+static void check_pair(mpz_t a, mpz_t b, const char *what) {
+	mpz_t got;
+	mpz_t want;
+	mpz_inits(got, want, NULL);
+	gcd(got, a, b);
+	mpz_gcd(want, a, b);
+	checks += 1;
+	bool ok = mpz_cmp(got, want) == 0;
+	// both orders, the state starts with r0 >= r1 either way
+	gcd(got, b, a);
+	ok = ok && mpz_cmp(got, want) == 0;
+	if (mpz_cmp_ui(b, 1) > 0) {
+		mod_inverse(got, a, b);
+		// GMP leaves the result undefined when there is no inverse, mod_inverse returns 0
+		if (mpz_invert(want, a, b) == 0) {
+			mpz_set_ui(want, 0);
+		}
+		ok = ok && mpz_cmp(got, want) == 0;
+	}
+	if (!ok) {
+		failures += 1;
+		gmp_fprintf(stderr, "gcdtest: FAILED %s (a = %Zx, b = %Zx)\n", what, a, b);
+	}
+	mpz_clears(got, want, NULL);
+}
+
+int main(void) {
+	rand_ctx rng;
+	rand_ctx_init(&rng, 2022);
+	mpz_t a;
+	mpz_t b;
+	mpz_t g;
+	mpz_inits(a, b, g, NULL);
+
+	// zero on either or both sides, and one
+	int64_t small[] = { 0, 1, -1, 2, 3, -7, 62, 1 << 30 };
+	for (uint32_t i = 0; i < sizeof(small) / sizeof(small[0]); i += 1) {
+		for (uint32_t j = 0; j < sizeof(small) / sizeof(small[0]); j += 1) {
+			mpz_set_si(a, small[i]);
+			mpz_set_si(b, small[j]);
+			check_pair(a, b, "small constants");
+		}
+		random_bits(b, 1000, false, &rng);
+		mpz_set_si(a, small[i]);
+		check_pair(a, b, "a constant and a long number");
+	}
+
+	for (uint32_t i = 0; i < TEST_PAIRS; i += 1) {
+		// up to 62 bits, where Lehmer's leading parts are the whole numbers (shift is 0)
+		random_bits(a, 1 + rand_ctx_range(&rng, 0, 61), true, &rng);
+		random_bits(b, 1 + rand_ctx_range(&rng, 0, 61), false, &rng);
+		check_pair(a, b, "operands of up to 62 bits");
+
+		// around the 62-bit boundary
+		random_bits(a, 60 + rand_ctx_range(&rng, 0, 8), true, &rng);
+		random_bits(b, 60 + rand_ctx_range(&rng, 0, 8), false, &rng);
+		check_pair(a, b, "operands of 60 to 68 bits");
+
+		// equal lengths of up to 2048 bits
+		uint64_t bits = 1 + rand_ctx_range(&rng, 0, 2047);
+		random_bits(a, bits, true, &rng);
+		random_bits(b, bits, false, &rng);
+		check_pair(a, b, "operands of one length");
+
+		// skewed lengths, where a round cannot decide one quotient and divides instead
+		random_bits(a, 1000 + rand_ctx_range(&rng, 0, 1000), true, &rng);
+		random_bits(b, 1 + rand_ctx_range(&rng, 0, 200), false, &rng);
+		check_pair(a, b, "a long and a short operand");
+		check_pair(b, a, "a short and a long operand");
+
+		// a large common factor, so the gcd is long and there is no inverse
+		random_bits(g, 1 + rand_ctx_range(&rng, 0, 500), false, &rng);
+		random_bits(a, 1 + rand_ctx_range(&rng, 0, 500), true, &rng);
+		random_bits(b, 1 + rand_ctx_range(&rng, 0, 500), false, &rng);
+		mpz_mul(a, a, g);
+		mpz_mul(b, b, g);
+		check_pair(a, b, "operands with a common factor");
+	}
+
+	// consecutive Fibonacci numbers, whose quotients are all 1: the most steps for their length
+	mpz_set_ui(a, 1);
+	mpz_set_ui(b, 1);
+	for (uint32_t i = 0; i < 3000; i += 1) {
+		mpz_add(a, a, b);
+		mpz_swap(a, b);
+		if (i % 100 == 0) {
+			check_pair(a, b, "consecutive Fibonacci numbers");
+		}
+	}
+
+	mpz_clears(a, b, g, NULL);
+	rand_ctx_clear(&rng);
+	if (failures > 0) {
+		fprintf(stderr, "gcdtest: %" PRIu64 " of %" PRIu64 " checks failed\n", failures, checks);
+		return 1;
+	}
+	fprintf(stderr, "gcdtest: %" PRIu64 " checks passed\n", checks);
+	return 0;
+}
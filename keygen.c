@@ -6,27 +6,357 @@
 #include <gmp.h>
 #include <sys/stat.h>
 #include <string.h> 
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "mempool.h"
+#include "primepool.h"
 #include <limits.h>
 #include <time.h>
 void print_error(void) {
-	fprintf(stderr,"Usage: ./keygen [options]\n  ./keygen generates a public / private key pair, placing the keys into the public and private\n  key files as specified below. The keys have a modulus (n) whose length is specified in\n  the program options.\n    -s <seed>   : Use <seed> as the random number seed. Default: time()\n    -b <bits>   : Public modulus n must have at least <bits> bits. Default: 1024\n    -i <iters>  : Run <iters> Miller-Rabin iterations for primality testing. Default: 50\n    -n <pbfile> : Public key file is <pbfile>. Default: rsa.pub\n    -d <pvfile> : Private key file is <pvfile>. Default: rsa.priv\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
+	fprintf(stderr,"Usage: ./keygen [options]\n  ./keygen generates a public / private key pair, placing the keys into the public and private\n  key files as specified below. The keys have a modulus (n) whose length is specified in\n  the program options.\n    -s <seed>   : Use <seed> as the random number seed. Default: time()\n    -b <bits>   : Public modulus n must have at least <bits> bits. Default: 1024\n    -i <iters>  : Run <iters> Miller-Rabin iterations for primality testing. Default: picked from the prime size\n    -p <test>   : Test primes with <test>: mr (Miller-Rabin) or bpsw (Baillie-PSW). Default: mr\n    -n <pbfile> : Public key file is <pbfile>. Default: rsa.pub\n    -d <pvfile> : Private key file is <pvfile>. Default: rsa.priv\n    -t <threads>: Search for primes on <threads> threads. Default: 1\n    -k <primes> : Make n the product of <primes> primes (2-4), at least 25 bits each. Default: 2\n    -P <pooldir>: Take the primes from the prime pool in <pooldir> (see primegen), searching only when it runs out.\n    -c <count>  : Bulk mode: make <count> key pairs on <threads> threads, one key per thread at a time.\n    -o <outdir> : In bulk mode, write the keys to <outdir>/<id>.pub and <outdir>/<id>.priv. Default: keys\n    -u <name>   : In bulk mode, the username and id of each key, with %%n replaced by its number (0 to count-1). Default: user%%n\n    -S <file>   : Write key generation statistics as JSON to <file> (- for standard output).\n    -v          : Enable verbose output, including key generation statistics.\n    -h          : Display program synopsis and usage.\n");
 }
+
+// monotonic clock in nanoseconds, for the phase timings
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// a prime pool to take the primes of the key from
+typedef struct {
+	const char *dir;
+	uint64_t rejected; // pooled numbers that failed the check
+} pool_source;
+
+// rsa_prime_source that takes primes out of a pool
+// the pool lives outside this process, so every prime is checked with Baillie-PSW before it is used
+static bool take_pooled(mpz_t p, uint64_t bits, void *arg) {
+	pool_source *src = (pool_source *) arg;
+	prime_ws ws;
+	prime_ws_init(&ws, bits);
+	bool found = false;
+	while (!found && primepool_take(src->dir, p, bits)) {
+		found = is_prime_bpsw(p, &ws);
+		if (!found) {
+			src->rejected += 1;
+		}
+	}
+	prime_ws_clear(&ws);
+	return found;
+}
+
+// prints the counters of the searches for one prime
+static void print_prime_stats(FILE *out, const char *name, prime_stats *ps) {
+	fprintf(out, "%s search: %" PRIu64 " starts, %" PRIu64 " candidates, %" PRIu64 " rejected by trial division, %" PRIu64 " tested, %" PRIu64 " Miller-Rabin rounds, %" PRIu64 " Lucas tests, %.3f ms\n", name, ps->starts, ps->candidates, ps->sieved, ps->tested, ps->rounds, ps->lucas, ps->ns / 1e6);
+}
+
+// writes the counters of the searches for one prime as a JSON object
+static void write_prime_stats(FILE *out, const char *name, prime_stats *ps) {
+	fprintf(out, "  \"%s\": {\"starts\": %" PRIu64 ", \"candidates\": %" PRIu64 ", \"sieved\": %" PRIu64 ", \"tested\": %" PRIu64 ", \"mr_rounds\": %" PRIu64 ", \"lucas_tests\": %" PRIu64 ", \"ns\": %" PRIu64 "},\n", name, ps->starts, ps->candidates, ps->sieved, ps->tested, ps->rounds, ps->lucas, ps->ns);
+}
+
+// adds the counters of one prime search to a running total
+static void add_prime_stats(prime_stats *total, prime_stats *ps) {
+	total->starts += ps->starts;
+	total->candidates += ps->candidates;
+	total->sieved += ps->sieved;
+	total->tested += ps->tested;
+	total->rounds += ps->rounds;
+	total->lucas += ps->lucas;
+	total->ns += ps->ns;
+}
+
+// what every key of a bulk key generation is made with
+typedef struct {
+	uint32_t bits;
+	uint32_t primes;
+	uint32_t iters;
+	prime_test test;
+	const char *pool_dir;    // NULL to always search for the primes
+	const char *dir;         // where the key files go
+	const char *name;        // username template, %n is the key number
+	const char *stats_name;  // NULL for no JSON statistics
+	uint32_t verbose;
+} bulk_settings;
+
+// state shared by the bulk key generation threads, which claim key numbers in order
+typedef struct {
+	const bulk_settings *set;
+	pthread_mutex_t lock;
+	uint64_t next;           // next key number to hand out
+	uint64_t count;
+	uint64_t written;        // keys whose two files were both written
+	rand_ctx rng;            // key i gets the i-th fork, whichever thread makes it
+	bool failed;
+	rsa_keygen_stats total;  // counters of every key added up, timings are summed over the threads
+	uint64_t rejected;       // pooled primes that failed the check
+	uint64_t ns;             // time spent making keys, summed over the threads
+} bulk_state;
+
+// writes the username of key i to out: the template with every %n replaced by i and %% by %
+// returns false if it does not fit or is not a base-62 number, since usernames are signed as one
+static bool bulk_username(char *out, size_t size, const char *tmpl, uint64_t i) {
+	size_t len = 0;
+	for (const char *c = tmpl; *c != '\0'; c += 1) {
+		int w = 1;
+		if (c[0] == '%' && c[1] == 'n') {
+			w = snprintf(out + len, size - len, "%" PRIu64, i);
+			c += 1;
+		} else if (c[0] == '%' && c[1] == '%') {
+			w = snprintf(out + len, size - len, "%%");
+			c += 1;
+		} else if (isalnum((unsigned char) c[0]) && len + 1 < size) {
+			out[len] = c[0];
+			out[len+1] = '\0';
+		} else {
+			return false;
+		}
+		if (w < 0 || len + w >= size) {
+			return false;
+		}
+		len += w;
+	}
+	return len > 0 && strchr(out, '%') == NULL;
+}
+
+// writes dir/name followed by ext to path, returns false if it does not fit
+static bool bulk_path(char *path, size_t size, const char *dir, const char *name, const char *ext) {
+	int len = snprintf(path, size, "%s/%s%s", dir, name, ext);
+	return len > 0 && (size_t) len < size;
+}
+
+// creates path with the given permissions and opens it for writing
+// an existing file is set to them too, open only applies them to a file it creates
+static FILE *bulk_open(const char *path, mode_t mode) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fchmod(fd, mode) != 0) {
+		close(fd);
+		return NULL;
+	}
+	FILE *f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+	}
+	return f;
+}
+
+// bulk key generation thread: makes, signs and writes keys until every number is claimed
+static void *bulk_worker(void *arg) {
+	bulk_state *st = (bulk_state *) arg;
+	const bulk_settings *set = st->set;
+	mpz_t primes[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < RSA_MAX_PRIMES; i += 1) {
+		mpz_init(primes[i]);
+	}
+	mpz_t n;
+	mpz_t e;
+	mpz_t user;
+	mpz_t sign;
+	mpz_inits(n, e, user, sign, NULL);
+	rsa_priv_key key;
+	rsa_priv_key_init(&key);
+	pool_source pool_src = { set->pool_dir, 0 };
+	char username[LOGIN_NAME_MAX];
+	char public_path[4096];
+	char private_path[4096];
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		if (st->next == st->count || st->failed) {
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		uint64_t index = st->next;
+		st->next += 1;
+		rand_ctx rng;
+		rand_ctx_fork(&rng, &st->rng);
+		pthread_mutex_unlock(&st->lock);
+
+		uint64_t start = now_ns();
+		bulk_username(username, sizeof(username), set->name, index);
+		// one thread per key, the other threads are busy with keys of their own
+		rsa_keygen_stats stats;
+		rsa_make_pub_source(primes, set->primes, n, e, set->bits, set->iters, set->test, 1, &rng, &stats, set->pool_dir != NULL ? take_pooled : NULL, &pool_src);
+		rsa_make_priv_key_multi(&key, n, e, primes, set->primes);
+		mpz_set_str(user, username, 62);
+		rsa_sign_key(sign, user, &key);
+		bool named = bulk_path(public_path, sizeof(public_path), set->dir, username, ".pub") && bulk_path(private_path, sizeof(private_path), set->dir, username, ".priv");
+		FILE *public = named ? bulk_open(public_path, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) : NULL;
+		FILE *private = named ? bulk_open(private_path, S_IRUSR | S_IWUSR) : NULL;
+		bool ok = public != NULL && private != NULL;
+		if (ok) {
+			rsa_write_pub(n, e, sign, username, public);
+			rsa_write_priv_key(&key, private);
+		}
+		// a full disk only shows when the buffers are flushed
+		ok = (public == NULL || fclose(public) == 0) && ok;
+		ok = (private == NULL || fclose(private) == 0) && ok;
+		// half a key pair is no use to anyone, and a truncated one would fail to load later
+		if (!ok && named) {
+			unlink(public_path);
+			unlink(private_path);
+		}
+		rand_ctx_clear(&rng);
+		uint64_t ns = now_ns() - start;
+
+		pthread_mutex_lock(&st->lock);
+		if (!ok) {
+			fprintf(stderr, "./keygen: Couldn't write the key files of %s in %s\n", username, set->dir);
+			st->failed = true;
+		} else {
+			st->written += 1;
+		}
+		add_prime_stats(&st->total.p, &stats.p);
+		add_prime_stats(&st->total.q, &stats.q);
+		for (uint32_t i = 0; i + 2 < set->primes; i += 1) {
+			add_prime_stats(&st->total.r[i], &stats.r[i]);
+		}
+		st->total.retries += stats.retries;
+		st->total.sourced += stats.sourced;
+		st->total.e_attempts += stats.e_attempts;
+		st->total.primes_ns += stats.primes_ns;
+		st->total.e_ns += stats.e_ns;
+		st->ns += ns;
+		if (set->verbose == 1 && ok) {
+			fprintf(stderr, "key %" PRIu64 ": %s (%" PRIu64 " bits), %.3f ms\n", index, username, (uint64_t) mpz_sizeinbase(n,2), ns / 1e6);
+		}
+		pthread_mutex_unlock(&st->lock);
+	}
+	pthread_mutex_lock(&st->lock);
+	st->rejected += pool_src.rejected;
+	pthread_mutex_unlock(&st->lock);
+	for (uint32_t i = 0; i < RSA_MAX_PRIMES; i += 1) {
+		mpz_clear(primes[i]);
+	}
+	mpz_clears(n, e, user, sign, NULL);
+	rsa_priv_key_clear(&key);
+	return NULL;
+}
+
+// makes count key pairs on several threads and writes them to set->dir as <username>.pub and <username>.priv,
+// the layout rsaserver -k loads; key i only depends on seed and i, not on the number of threads
+// returns the exit status of the program
+static int bulk_keygen(const bulk_settings *set, uint64_t count, uint32_t threads, uint64_t seed) {
+	// every name is checked up front, so a bad template fails before any key is made
+	char username[LOGIN_NAME_MAX];
+	char other[LOGIN_NAME_MAX];
+	if (!bulk_username(username, sizeof(username), set->name, count - 1)) {
+		fprintf(stderr, "./keygen: Username template %s must give letters and digits only, with %%n for the key number.\n", set->name);
+		print_error();
+		return 1;
+	}
+	if (count > 1 && bulk_username(other, sizeof(other), set->name, 0) && strcmp(username, other) == 0) {
+		fprintf(stderr, "./keygen: Username template %s needs %%n to give every key its own name.\n", set->name);
+		print_error();
+		return 1;
+	}
+	if (mkdir(set->dir, S_IRWXU) != 0 && errno != EEXIST) {
+		fprintf(stderr, "./keygen: Couldn't create output directory %s\n", set->dir);
+		return 1;
+	}
+	if (threads > count) {
+		threads = count;
+	}
+	bulk_state st;
+	memset(&st, 0, sizeof(st));
+	st.set = set;
+	pthread_mutex_init(&st.lock, NULL);
+	st.count = count;
+	rand_ctx_init(&st.rng, seed);
+
+	uint64_t start = now_ns();
+	pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	for (uint32_t i = 0; i < threads; i += 1) {
+		pthread_create(&workers[i], NULL, bulk_worker, &st);
+	}
+	for (uint32_t i = 0; i < threads; i += 1) {
+		pthread_join(workers[i], NULL);
+	}
+	uint64_t elapsed = now_ns() - start;
+	free(workers);
+	// the workers have exited, so their counters are in
+	mempool_stats pool;
+	mempool_get_stats(&pool);
+
+	// throughput
+	// a failed write stops the threads from claiming new keys, but the ones already running still finish
+	uint64_t made = st.written;
+	double seconds = elapsed / 1e9;
+	fprintf(stderr, "keygen: %" PRIu64 " keys of %u bits in %.3f s on %u threads, %.1f keys/s, %.3f ms per key per thread\n", made, set->bits, seconds, threads, made / seconds, made > 0 ? st.ns / 1e6 / made : 0.0);
+	if (set->verbose == 1) {
+		print_prime_stats(stderr, "p", &st.total.p);
+		print_prime_stats(stderr, "q", &st.total.q);
+		char name[12];
+		for (uint32_t i = 2; i < set->primes; i += 1) {
+			snprintf(name, sizeof(name), "r%u", i+1);
+			print_prime_stats(stderr, name, &st.total.r[i-2]);
+		}
+		fprintf(stderr, "key retries: %" PRIu64 "\ne attempts: %" PRIu64 "\n", st.total.retries, st.total.e_attempts);
+		if (set->pool_dir != NULL) {
+			fprintf(stderr, "prime pool: %" PRIu64 " primes taken from %s, %" PRIu64 " rejected\n", st.total.sourced, set->pool_dir, st.rejected);
+		}
+		fprintf(stderr, "allocator: %" PRIu64 " allocations, %" PRIu64 " served from the pool, %" PRIu64 " grown in place, %" PRIu64 " frees, %" PRIu64 " returned to malloc\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+	}
+	// statistics as JSON, the counters of all keys added up
+	if (set->stats_name != NULL) {
+		FILE *out = strcmp(set->stats_name, "-") == 0 ? stdout : fopen(set->stats_name, "w");
+		if (!out) {
+			fprintf(stderr, "Couldn't open %s to write statistics: No such file or directory\n", set->stats_name);
+		} else {
+			fprintf(out, "{\n  \"keys\": %" PRIu64 ",\n  \"bits\": %u,\n  \"threads\": %u,\n  \"primes\": %u,\n  \"test\": \"%s\",\n  \"seed\": %" PRIu64 ",\n", made, set->bits, threads, set->primes, set->test == PRIME_TEST_BPSW ? "bpsw" : "mr", seed);
+			write_prime_stats(out, "p", &st.total.p);
+			write_prime_stats(out, "q", &st.total.q);
+			char name[12];
+			for (uint32_t i = 2; i < set->primes; i += 1) {
+				snprintf(name, sizeof(name), "r%u", i+1);
+				write_prime_stats(out, name, &st.total.r[i-2]);
+			}
+			fprintf(out, "  \"retries\": %" PRIu64 ",\n  \"e_attempts\": %" PRIu64 ",\n", st.total.retries, st.total.e_attempts);
+			fprintf(out, "  \"pooled\": %" PRIu64 ",\n  \"pool_rejected\": %" PRIu64 ",\n", st.total.sourced, st.rejected);
+			fprintf(out, "  \"allocator\": {\"allocs\": %" PRIu64 ", \"reused\": %" PRIu64 ", \"grows\": %" PRIu64 ", \"frees\": %" PRIu64 ", \"released\": %" PRIu64 "},\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+			fprintf(out, "  \"keys_per_s\": %.3f,\n  \"ns\": {\"primes\": %" PRIu64 ", \"e\": %" PRIu64 ", \"keys\": %" PRIu64 ", \"total\": %" PRIu64 "}\n}\n", made / seconds, st.total.primes_ns, st.total.e_ns, st.ns, elapsed);
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
+	}
+	rand_ctx_clear(&st.rng);
+	pthread_mutex_destroy(&st.lock);
+	return st.failed ? 1 : 0;
+}
+
 int main (int argc, char ** argv) {
     int opt = 0; // used for getopt
     // set default numbers
-    uint32_t iter = 50; 
-    char public_name[] = "rsa.pub";
-    char private_name[] = "rsa.priv";
-    uint32_t seed = time(NULL);
+    uint32_t iter = 0; // 0 picks the rounds from the size of each candidate
+    prime_test test = PRIME_TEST_MR;
+    char *public_name = "rsa.pub";
+    char *private_name = "rsa.priv";
+    uint64_t seed = time(NULL);
 //    extern gmp_randstate_t state;
     uint32_t bit = 1024;
     uint32_t message = 0;
+    uint32_t threads = 1;
+    uint32_t count = 2; // number of primes in n
+    char *stats_name = NULL;
+    pool_source pool_src = { NULL, 0 };
+    uint64_t bulk = 0; // number of keys in bulk mode, 0 for a single key
+    char *bulk_dir = "keys";
+    char *bulk_name = "user%n";
+    // GMP buffers come from per-thread pools, installed before the first number exists
+    mempool_install();
   
     // gets user input and runs until processes all the commands
-    while ((opt = getopt(argc, argv, "b:i:n:d:s:vh")) != -1) { //list of valid commands
+    while ((opt = getopt(argc, argv, "b:i:p:n:d:s:t:k:P:c:o:u:S:vh")) != -1) { //list of valid commands
         // min number of bits needed for public modulus
 	if (opt == 'b') {
 		 bit = strtoul(optarg, NULL, 10);
@@ -45,18 +375,73 @@ int main (int argc, char ** argv) {
                          return 1;
 		}
 	}
+	// primality test
+	if (opt=='p') {
+		if (strcmp(optarg, "mr") == 0) {
+			test = PRIME_TEST_MR;
+		} else if (strcmp(optarg, "bpsw") == 0) {
+			test = PRIME_TEST_BPSW;
+		} else {
+			fprintf(stderr, "./keygen: Primality test must be mr or bpsw, not %s.\n", optarg);
+			print_error();
+			return 1;
+		}
+	}
 	// public key name
 	if (opt=='n') {
-        	strcpy(public_name, optarg);
+        	public_name = optarg;
 	}
 	 // private key name
 	if (opt=='d') {
-        	strcpy(private_name, optarg);
+        	private_name = optarg;
 	}
 	 // set seed
 	if (opt=='s') {
-                seed = strtoul(optarg, NULL, 10);
+                seed = strtoull(optarg, NULL, 10);
         }
+	// number of prime search threads
+	if (opt=='t') {
+		threads = strtoul(optarg, NULL, 10);
+		if (threads < 1 || threads > 128) {
+			fprintf(stderr, "./keygen: Number of threads must be 1-128, not %u.\n", threads);
+			print_error();
+			return 1;
+		}
+	}
+	// number of primes
+	if (opt=='k') {
+		count = strtoul(optarg, NULL, 10);
+		if (count < 2 || count > RSA_MAX_PRIMES) {
+			fprintf(stderr, "./keygen: Number of primes must be 2-%u, not %u.\n", RSA_MAX_PRIMES, count);
+			print_error();
+			return 1;
+		}
+	}
+	// prime pool
+	if (opt=='P') {
+		pool_src.dir = optarg;
+	}
+	// bulk mode
+	if (opt=='c') {
+		bulk = strtoull(optarg, NULL, 10);
+		if (bulk < 1 || bulk > 100000000) {
+			fprintf(stderr, "./keygen: Number of keys must be 1-100000000, not %s.\n", optarg);
+			print_error();
+			return 1;
+		}
+	}
+	// bulk output directory
+	if (opt=='o') {
+		bulk_dir = optarg;
+	}
+	// bulk username template
+	if (opt=='u') {
+		bulk_name = optarg;
+	}
+	// statistics file
+	if (opt=='S') {
+		stats_name = optarg;
+	}
 	// enables verbose
 	if (opt=='v') { 
 		 message = 1;
@@ -67,23 +452,36 @@ int main (int argc, char ** argv) {
 		return 0;
         }
 	// if it's not in the above options, return an error number
-	if (opt!='h' && opt!='v' && opt!='s' && opt!='d' && opt!='n' && opt!='i' && opt!= 'b') {
+	if (opt!='h' && opt!='v' && opt!='s' && opt!='t' && opt!='k' && opt!='P' && opt!='c' && opt!='o' && opt!='u' && opt!='S' && opt!='d' && opt!='n' && opt!='p' && opt!='i' && opt!= 'b') {
 		print_error();
 		return 1;
 	}
 	
     }
-	randstate_init(seed); // intialize the random state 
-	mpz_t p;
-        mpz_init(p);
-        mpz_t q;
-        mpz_init(q);
+	if (bit < 25 * count) {
+		fprintf(stderr, "./keygen: %u primes need at least %u bits, not %u.\n", count, 25 * count, bit);
+		print_error();
+		return 1;
+	}
+	if (bulk > 0) {
+		bulk_settings bs = { bit, count, iter, test, pool_src.dir, bulk_dir, bulk_name, stats_name, message };
+		return bulk_keygen(&bs, bulk, threads, seed);
+	}
+	// every random choice of the key comes from this context, whatever the number of threads
+	rand_ctx rng;
+	rand_ctx_init(&rng, seed);
+	// p, q and the further primes of a multi-prime key
+	mpz_t primes[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < RSA_MAX_PRIMES; i += 1) {
+		mpz_init(primes[i]);
+	}
 	mpz_t n;
         mpz_init(n);
 	mpz_t e;
         mpz_init(e);
-	mpz_t d;
-        mpz_init(d);
+	// private key with its CRT components
+	rsa_priv_key key;
+	rsa_priv_key_init(&key);
       	
   	FILE *public = fopen(public_name, "w");  
 	if (!public) {// if there was an error with opening the file
@@ -99,8 +497,13 @@ int main (int argc, char ** argv) {
 	if (fchmod(priv, S_IRUSR |  S_IWUSR) != 0) {
 		fprintf(stderr, "chmod error");
 	}
-	rsa_make_pub(p, q, n, e, bit, iter);
-	rsa_make_priv(d,e,p,q);
+	// counters and timings of every phase
+	rsa_keygen_stats stats;
+	uint64_t start = now_ns();
+	rsa_make_pub_source(primes, count, n, e, bit, iter, test, threads, &rng, &stats, pool_src.dir != NULL ? take_pooled : NULL, &pool_src);
+	uint64_t pub_done = now_ns();
+	rsa_make_priv_key_multi(&key, n, e, primes, count);
+	uint64_t priv_done = now_ns();
 	// get user name
 	char username[LOGIN_NAME_MAX];
 	char* u = getenv("USER");
@@ -113,23 +516,71 @@ int main (int argc, char ** argv) {
 	//sign
 	mpz_t sign;
 	mpz_init(sign);
-	rsa_sign(sign, user, d, n);
+	rsa_sign_key(sign, user, &key);
+	uint64_t sign_done = now_ns();
 	rsa_write_pub(n,e,sign, username, public);
-	rsa_write_priv(n,d,private);
+	rsa_write_priv_key(&key,private);
+	uint64_t write_done = now_ns();
+	// the prime search threads have exited, so their counters are in
+	mempool_stats pool;
+	mempool_get_stats(&pool);
+	// statistics name of a further prime, r3 and r4 like the other prime infos of RFC 8017
+	char name[8];
 	
 	// verbose
 	//mpz_t size_p;
-	int size_p = mpz_sizeinbase(p,2);
-	int size_q = mpz_sizeinbase(q,2);
+	int size_p = mpz_sizeinbase(primes[0],2);
+	int size_q = mpz_sizeinbase(primes[1],2);
 	if (message == 1) {
-		gmp_fprintf(stderr, "username: %s\nuser signature: %Zd\np (%d bits): %Zd\nq (%d bits): %Zd\nn - modulus (%d bits): %Zd\ne - public exponent (%d bits): %Zd\nd - private exponent (%d bits): %Zd\n", username, sign, size_p, p, size_q, q,mpz_sizeinbase(n,2), n,mpz_sizeinbase(e,2), e, mpz_sizeinbase(d,2), d);
+		gmp_fprintf(stderr, "username: %s\nuser signature: %Zd\np (%d bits): %Zd\nq (%d bits): %Zd\nn - modulus (%d bits): %Zd\ne - public exponent (%d bits): %Zd\nd - private exponent (%d bits): %Zd\n", username, sign, size_p, primes[0], size_q, primes[1],mpz_sizeinbase(n,2), n,mpz_sizeinbase(e,2), e, mpz_sizeinbase(key.d,2), key.d);
+		for (uint32_t i = 2; i < count; i += 1) {
+			gmp_fprintf(stderr, "r%u (%d bits): %Zd\n", i+1, mpz_sizeinbase(primes[i],2), primes[i]);
+		}
+		print_prime_stats(stderr, "p", &stats.p);
+		print_prime_stats(stderr, "q", &stats.q);
+		for (uint32_t i = 2; i < count; i += 1) {
+			snprintf(name, sizeof(name), "r%u", i+1);
+			print_prime_stats(stderr, name, &stats.r[i-2]);
+		}
+		fprintf(stderr, "key retries: %" PRIu64 "\ne attempts: %" PRIu64 "\n", stats.retries, stats.e_attempts);
+		if (pool_src.dir != NULL) {
+			fprintf(stderr, "prime pool: %" PRIu64 " primes taken from %s, %" PRIu64 " rejected\n", stats.sourced, pool_src.dir, pool_src.rejected);
+		}
+		fprintf(stderr, "time: primes %.3f ms, e %.3f ms, private key %.3f ms, signature %.3f ms, writing %.3f ms, total %.3f ms\n", stats.primes_ns / 1e6, stats.e_ns / 1e6, (priv_done - pub_done) / 1e6, (sign_done - priv_done) / 1e6, (write_done - sign_done) / 1e6, (write_done - start) / 1e6);
+		fprintf(stderr, "allocator: %" PRIu64 " allocations, %" PRIu64 " served from the pool, %" PRIu64 " grown in place, %" PRIu64 " frees, %" PRIu64 " returned to malloc\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+	}
+	// statistics as JSON
+	if (stats_name != NULL) {
+		FILE *out = strcmp(stats_name, "-") == 0 ? stdout : fopen(stats_name, "w");
+		if (!out) {
+			fprintf(stderr, "Couldn't open %s to write statistics: No such file or directory\n", stats_name);
+		} else {
+			fprintf(out, "{\n  \"bits\": %" PRIu64 ",\n  \"threads\": %u,\n  \"primes\": %u,\n  \"test\": \"%s\",\n  \"seed\": %" PRIu64 ",\n", (uint64_t) mpz_sizeinbase(n,2), threads, count, test == PRIME_TEST_BPSW ? "bpsw" : "mr", seed);
+			write_prime_stats(out, "p", &stats.p);
+			write_prime_stats(out, "q", &stats.q);
+			for (uint32_t i = 2; i < count; i += 1) {
+				snprintf(name, sizeof(name), "r%u", i+1);
+				write_prime_stats(out, name, &stats.r[i-2]);
+			}
+			fprintf(out, "  \"retries\": %" PRIu64 ",\n  \"e_attempts\": %" PRIu64 ",\n", stats.retries, stats.e_attempts);
+			fprintf(out, "  \"pooled\": %" PRIu64 ",\n  \"pool_rejected\": %" PRIu64 ",\n", stats.sourced, pool_src.rejected);
+			fprintf(out, "  \"allocator\": {\"allocs\": %" PRIu64 ", \"reused\": %" PRIu64 ", \"grows\": %" PRIu64 ", \"frees\": %" PRIu64 ", \"released\": %" PRIu64 "},\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+			fprintf(out, "  \"ns\": {\"primes\": %" PRIu64 ", \"e\": %" PRIu64 ", \"private\": %" PRIu64 ", \"sign\": %" PRIu64 ", \"write\": %" PRIu64 ", \"total\": %" PRIu64 "}\n}\n", stats.primes_ns, stats.e_ns, priv_done - pub_done, sign_done - priv_done, write_done - sign_done, write_done - start);
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
 	}
 
 	// end
-	randstate_clear();
+	rand_ctx_clear(&rng);
 	fclose(public);
 	fclose(private);
-	mpz_clears(sign, user, p, q, n, e, d, NULL);
+	rsa_priv_key_clear(&key);
+	for (uint32_t i = 0; i < RSA_MAX_PRIMES; i += 1) {
+		mpz_clear(primes[i]);
+	}
+	mpz_clears(sign, user, n, e, NULL);
 	return 0;
 } 
 
@@ -0,0 +1,329 @@
+// implements an in-memory keystore indexed by username and key id
+#include "keystore.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <gmp.h>
+#include "rsa.h"
+#include "montsimd.h"
+
+// FNV-1a hash of a string
+static uint64_t keystore_hash(const char *str) {
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (; *str != '\0'; str += 1) {
+		h ^= (uint8_t) *str;
+		h *= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+// frees an entry and everything it holds
+static void keystore_entry_free(keystore_entry *entry) {
+	mont_batch_clear(&entry->pub);
+	if (entry->has_priv) {
+		rsa_priv_batch_clear(&entry->priv, &entry->cp, entry->cq);
+	}
+	rsa_priv_key_clear(&entry->priv);
+	mpz_clears(entry->n, entry->e, entry->s, NULL);
+	free(entry);
+}
+
+// drops one reference to an entry, ks->lock must be held
+static void keystore_unref(keystore_entry *entry) {
+	entry->refs -= 1;
+	if (entry->refs == 0) {
+		keystore_entry_free(entry);
+	}
+}
+
+// builds the path dir/id.ext into buf, returns false if it does not fit
+static bool keystore_path(char *buf, size_t size, const char *dir, const char *id, const char *ext) {
+	int len = snprintf(buf, size, "%s/%s%s", dir, id, ext);
+	return len > 0 && (size_t) len < size;
+}
+
+// true if the file behind st is the one an entry was loaded from
+static bool keystore_same_file(const struct stat *st, ino_t ino, off_t size, const struct timespec *mtime) {
+	return st->st_ino == ino && st->st_size == size
+		&& st->st_mtim.tv_sec == mtime->tv_sec && st->st_mtim.tv_nsec == mtime->tv_nsec;
+}
+
+// parses the key id from dir, returns NULL if the public key is missing, malformed or fails to verify
+// pub and priv are the stats of the two files, priv is NULL if there is no private key
+static keystore_entry *keystore_load(const char *dir, const char *id, const struct stat *pub, const struct stat *priv) {
+	char path[4096];
+	if (!keystore_path(path, sizeof(path), dir, id, ".pub")) {
+		return NULL;
+	}
+	FILE *pbfile = fopen(path, "r");
+	if (!pbfile) {
+		return NULL;
+	}
+	keystore_entry *entry = (keystore_entry *) calloc(1, sizeof(keystore_entry));
+	strcpy(entry->id, id);
+	mpz_inits(entry->n, entry->e, entry->s, NULL);
+	rsa_priv_key_init(&entry->priv);
+	// same layout as rsa_read_pub, but with the username length bounded
+	int fields = gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n%255s", entry->n, entry->e, entry->s, entry->username);
+	fclose(pbfile);
+	bool valid = fields == 4 && mpz_odd_p(entry->n) != 0 && mpz_cmp_ui(entry->n, 1) > 0;
+	// the username signature is verified here once instead of on every use, with the context kept for the key
+	if (valid) {
+		mont_batch_init(&entry->pub, entry->n);
+		mpz_t user;
+		mpz_init(user);
+		valid = mpz_set_str(user, entry->username, 62) == 0 && rsa_verify_ctx(user, entry->s, entry->e, &entry->pub);
+		mpz_clear(user);
+		if (!valid) {
+			mont_batch_clear(&entry->pub);
+		}
+	}
+	if (!valid) {
+		rsa_priv_key_clear(&entry->priv);
+		mpz_clears(entry->n, entry->e, entry->s, NULL);
+		free(entry);
+		return NULL;
+	}
+	entry->pub_ino = pub->st_ino;
+	entry->pub_size = pub->st_size;
+	entry->pub_mtime = pub->st_mtim;
+	// the private key is optional, and ignored if it belongs to another modulus
+	if (priv != NULL && keystore_path(path, sizeof(path), dir, id, ".priv")) {
+		FILE *pvfile = fopen(path, "r");
+		if (pvfile) {
+			rsa_read_priv_key(&entry->priv, pvfile);
+			fclose(pvfile);
+			if (mpz_cmp(entry->priv.n, entry->n) == 0 && mpz_sgn(entry->priv.d) > 0) {
+				entry->has_priv = true;
+				rsa_priv_batch_init(&entry->priv, &entry->cp, entry->cq);
+			}
+		}
+		// recorded even if the file could not be read, so an unchanged unusable one is not loaded again on every reload
+		entry->priv_ino = priv->st_ino;
+		entry->priv_size = priv->st_size;
+		entry->priv_mtime = priv->st_mtim;
+	}
+	entry->refs = 1;
+	return entry;
+}
+
+// inserts entry into the open addressing index under key
+static void keystore_index(keystore_entry **index, uint64_t slots, const char *key, keystore_entry *entry) {
+	uint64_t i = keystore_hash(key) & (slots - 1);
+	while (index[i] != NULL) {
+		i = (i + 1) & (slots - 1);
+	}
+	index[i] = entry;
+}
+
+// finds the entry stored under key, by_user picks whether key is compared to usernames or ids
+static keystore_entry *keystore_find(keystore_entry **index, uint64_t slots, const char *key, bool by_user) {
+	if (slots == 0) {
+		return NULL;
+	}
+	uint64_t i = keystore_hash(key) & (slots - 1);
+	while (index[i] != NULL) {
+		const char *name = by_user ? index[i]->username : index[i]->id;
+		if (strcmp(name, key) == 0) {
+			return index[i];
+		}
+		i = (i + 1) & (slots - 1);
+	}
+	return NULL;
+}
+
+// Loads every key of a directory into a new keystore.
+// Keys that cannot be parsed or whose signature does not verify are skipped.
+//
+// ks: the keystore to initialize.
+// dir: the directory holding the <id>.pub and <id>.priv files.
+// returns: the number of keys loaded, or -1 if the directory cannot be read (ks is then empty but usable).
+int64_t keystore_open(keystore *ks, const char *dir) {
+	pthread_mutex_init(&ks->lock, NULL);
+	pthread_mutex_init(&ks->reload, NULL);
+	ks->dir = strdup(dir);
+	ks->entries = NULL;
+	ks->count = 0;
+	ks->slots = 0;
+	ks->by_user = NULL;
+	ks->by_id = NULL;
+	if (keystore_reload(ks) < 0) {
+		return -1;
+	}
+	return (int64_t) keystore_size(ks);
+}
+
+// Frees any memory used by a keystore.
+// Every entry returned by keystore_get or keystore_get_id must have been put back.
+//
+// ks: the keystore to free.
+void keystore_close(keystore *ks) {
+	for (uint64_t i = 0; i < ks->count; i += 1) {
+		keystore_unref(ks->entries[i]);
+	}
+	free(ks->entries);
+	free(ks->by_user);
+	free(ks->by_id);
+	free(ks->dir);
+	pthread_mutex_destroy(&ks->lock);
+	pthread_mutex_destroy(&ks->reload);
+}
+
+// Rescans the directory of a keystore.
+// Keys whose files changed are parsed again, new keys are added and keys whose files are gone are dropped.
+// Lookups keep working during a reload and see either the old or the new set of keys.
+//
+// ks: the keystore to reload.
+// returns: the number of keys added, changed or dropped, or -1 if the directory cannot be read.
+int64_t keystore_reload(keystore *ks) {
+	// only reloads change the entries and indexes, so while this is held they can be read without ks->lock
+	pthread_mutex_lock(&ks->reload);
+	DIR *d = opendir(ks->dir);
+	if (!d) {
+		pthread_mutex_unlock(&ks->reload);
+		return -1;
+	}
+	// parse what changed, outside ks->lock so lookups are not held up
+	uint64_t count = 0;
+	uint64_t cap = ks->count + 16;
+	keystore_entry **entries = (keystore_entry **) malloc(cap * sizeof(keystore_entry *));
+	uint64_t kept = 0;
+	uint64_t loaded = 0;
+	uint64_t replaced = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+		if (len <= 4 || len - 4 >= KEYSTORE_NAME_MAX || strcmp(de->d_name + len - 4, ".pub") != 0) {
+			continue;
+		}
+		char id[KEYSTORE_NAME_MAX];
+		memcpy(id, de->d_name, len - 4);
+		id[len - 4] = '\0';
+		char path[4096];
+		struct stat pub;
+		struct stat priv;
+		if (!keystore_path(path, sizeof(path), ks->dir, id, ".pub") || stat(path, &pub) != 0 || !S_ISREG(pub.st_mode)) {
+			continue;
+		}
+		bool has_priv = keystore_path(path, sizeof(path), ks->dir, id, ".priv") && stat(path, &priv) == 0 && S_ISREG(priv.st_mode);
+		// reuse the old entry if neither of its files changed
+		keystore_entry *old = keystore_find(ks->by_id, ks->slots, id, false);
+		keystore_entry *entry = NULL;
+		if (old != NULL && keystore_same_file(&pub, old->pub_ino, old->pub_size, &old->pub_mtime)
+			&& (has_priv ? old->priv_ino != 0 && keystore_same_file(&priv, old->priv_ino, old->priv_size, &old->priv_mtime) : old->priv_ino == 0)) {
+			entry = old;
+			pthread_mutex_lock(&ks->lock);
+			entry->refs += 1;
+			pthread_mutex_unlock(&ks->lock);
+			kept += 1;
+		} else {
+			entry = keystore_load(ks->dir, id, &pub, has_priv ? &priv : NULL);
+			if (entry == NULL) {
+				continue;
+			}
+			loaded += 1;
+			replaced += old != NULL;
+		}
+		if (count == cap) {
+			cap *= 2;
+			entries = (keystore_entry **) realloc(entries, cap * sizeof(keystore_entry *));
+		}
+		entries[count] = entry;
+		count += 1;
+	}
+	closedir(d);
+	// added or changed keys, plus old keys that are gone
+	int64_t changed = loaded + (ks->count - kept - replaced);
+
+	// build the new indexes, at most half full
+	uint64_t slots = 16;
+	while (slots < 2 * count) {
+		slots *= 2;
+	}
+	keystore_entry **by_user = (keystore_entry **) calloc(slots, sizeof(keystore_entry *));
+	keystore_entry **by_id = (keystore_entry **) calloc(slots, sizeof(keystore_entry *));
+	for (uint64_t i = 0; i < count; i += 1) {
+		// two keys for one username: the first one found wins
+		if (keystore_find(by_user, slots, entries[i]->username, true) == NULL) {
+			keystore_index(by_user, slots, entries[i]->username, entries[i]);
+		}
+		keystore_index(by_id, slots, entries[i]->id, entries[i]);
+	}
+
+	// swap the new set in, then drop the references the old set held
+	pthread_mutex_lock(&ks->lock);
+	keystore_entry **prev = ks->entries;
+	uint64_t prev_count = ks->count;
+	keystore_entry **prev_by_user = ks->by_user;
+	keystore_entry **prev_by_id = ks->by_id;
+	ks->entries = entries;
+	ks->count = count;
+	ks->slots = slots;
+	ks->by_user = by_user;
+	ks->by_id = by_id;
+	for (uint64_t i = 0; i < prev_count; i += 1) {
+		keystore_unref(prev[i]);
+	}
+	pthread_mutex_unlock(&ks->lock);
+	free(prev);
+	free(prev_by_user);
+	free(prev_by_id);
+	pthread_mutex_unlock(&ks->reload);
+	return changed;
+}
+
+// Returns the number of keys in a keystore.
+//
+// ks: the keystore.
+uint64_t keystore_size(keystore *ks) {
+	pthread_mutex_lock(&ks->lock);
+	uint64_t count = ks->count;
+	pthread_mutex_unlock(&ks->lock);
+	return count;
+}
+
+// looks key up in the username or the id index and takes a reference to the entry
+static keystore_entry *keystore_lookup(keystore *ks, const char *key, bool by_user) {
+	pthread_mutex_lock(&ks->lock);
+	keystore_entry *entry = keystore_find(by_user ? ks->by_user : ks->by_id, ks->slots, key, by_user);
+	if (entry != NULL) {
+		entry->refs += 1;
+	}
+	pthread_mutex_unlock(&ks->lock);
+	return entry;
+}
+
+// Looks a key up by username.
+// The entry must be handed back with keystore_put.
+//
+// ks: the keystore.
+// username: the username.
+// returns: the key, or NULL if there is none for username.
+keystore_entry *keystore_get(keystore *ks, const char *username) {
+	return keystore_lookup(ks, username, true);
+}
+
+// Looks a key up by key id (its file name without the .pub extension).
+// The entry must be handed back with keystore_put.
+//
+// ks: the keystore.
+// id: the key id.
+// returns: the key, or NULL if there is none with that id.
+keystore_entry *keystore_get_id(keystore *ks, const char *id) {
+	return keystore_lookup(ks, id, false);
+}
+
+// Hands back an entry returned by keystore_get or keystore_get_id.
+//
+// ks: the keystore the entry came from.
+// entry: the entry.
+void keystore_put(keystore *ks, keystore_entry *entry) {
+	pthread_mutex_lock(&ks->lock);
+	keystore_unref(entry);
+	pthread_mutex_unlock(&ks->lock);
+}
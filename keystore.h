@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <gmp.h>
+#include "rsa.h"
+#include "montsimd.h"
+
+// longest key id or username (including the terminating zero) a keystore accepts
+#define KEYSTORE_NAME_MAX 256
+
+//
+// One key of a keystore, parsed and ready to use.
+// The public key <id>.pub is required; its username signature is checked once when the key is loaded.
+// The private key <id>.priv is optional.
+// Entries are shared between threads and reference counted: get one with keystore_get or
+// keystore_get_id and hand it back with keystore_put. Everything but refs is read only.
+//
+// id: the file name of the key without the .pub extension.
+// username: the username the public key was signed for.
+// n: the public modulus.
+// e: the public exponent.
+// s: the signature of the username.
+// pub: the batched Montgomery context of n, for encryption.
+// has_priv: true if the private key was loaded.
+// priv: the private key.
+// cp: the context of p (of n for a key without CRT components), for decryption.
+// cq: the contexts of q and of the further primes of a multi-prime key.
+//
+typedef struct {
+	char id[KEYSTORE_NAME_MAX];
+	char username[KEYSTORE_NAME_MAX];
+	mpz_t n;
+	mpz_t e;
+	mpz_t s;
+	mont_batch_ctx pub;
+	bool has_priv;
+	rsa_priv_key priv;
+	mont_batch_ctx cp;
+	mont_batch_ctx cq[RSA_MAX_PRIMES-1];
+	// file identities at load time, compared by keystore_reload (priv_ino is 0 without a private key file, even an unreadable one is recorded)
+	ino_t pub_ino;
+	off_t pub_size;
+	struct timespec pub_mtime;
+	ino_t priv_ino;
+	off_t priv_size;
+	struct timespec priv_mtime;
+	uint32_t refs;
+} keystore_entry;
+
+//
+// A directory of keys loaded into memory and indexed by username and by key id.
+// All functions are safe to call from several threads at once.
+//
+// lock: protects the entries, the indexes and the refs of every entry.
+// reload: lets only one reload run at a time.
+// dir: the directory the keys are loaded from.
+// entries: the loaded keys.
+// count: the number of loaded keys.
+// slots: the size of both hash indexes (a power of two, at least twice count).
+// by_user: open addressing hash index keyed by username.
+// by_id: open addressing hash index keyed by key id.
+//
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_mutex_t reload;
+	char *dir;
+	keystore_entry **entries;
+	uint64_t count;
+	uint64_t slots;
+	keystore_entry **by_user;
+	keystore_entry **by_id;
+} keystore;
+
+//
+// Loads every key of a directory into a new keystore.
+// Keys that cannot be parsed or whose signature does not verify are skipped.
+//
+// ks: the keystore to initialize.
+// dir: the directory holding the <id>.pub and <id>.priv files.
+// returns: the number of keys loaded, or -1 if the directory cannot be read (ks is then empty but usable).
+//
+int64_t keystore_open(keystore *ks, const char *dir);
+
+//
+// Frees any memory used by a keystore.
+// Every entry returned by keystore_get or keystore_get_id must have been put back.
+//
+// ks: the keystore to free.
+//
+void keystore_close(keystore *ks);
+
+//
+// Rescans the directory of a keystore.
+// Keys whose files changed are parsed again, new keys are added and keys whose files are gone are dropped.
+// Unchanged keys are kept as they are, so a reload only pays for what changed.
+// Lookups keep working during a reload and see either the old or the new set of keys.
+//
+// ks: the keystore to reload.
+// returns: the number of keys added, changed or dropped, or -1 if the directory cannot be read.
+//
+int64_t keystore_reload(keystore *ks);
+
+//
+// Returns the number of keys in a keystore.
+//
+// ks: the keystore.
+//
+uint64_t keystore_size(keystore *ks);
+
+//
+// Looks a key up by username.
+// The entry must be handed back with keystore_put.
+//
+// ks: the keystore.
+// username: the username.
+// returns: the key, or NULL if there is none for username.
+//
+keystore_entry *keystore_get(keystore *ks, const char *username);
+
+//
+// Looks a key up by key id (its file name without the .pub extension).
+// The entry must be handed back with keystore_put.
+//
+// ks: the keystore.
+// id: the key id.
+// returns: the key, or NULL if there is none with that id.
+//
+keystore_entry *keystore_get_id(keystore *ks, const char *id);
+
+//
+// Hands back an entry returned by keystore_get or keystore_get_id.
+//
+// ks: the keystore the entry came from.
+// entry: the entry.
+//
+void keystore_put(keystore *ks, keystore_entry *entry);
@@ -0,0 +1,188 @@
+// implements a pooled allocator for GMP limb buffers with per-thread size-class caches
+#include "mempool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+// number of size classes: MEMPOOL_MIN_BYTES << c for c below this, the last one is MEMPOOL_MAX_BYTES
+#define MEMPOOL_CLASSES 11
+
+// a cached buffer, the link lives in the buffer itself
+typedef struct mempool_block {
+	struct mempool_block *next;
+} mempool_block;
+
+// the cache and counters of one thread, only ever touched by that thread
+typedef struct {
+	mempool_block *free[MEMPOOL_CLASSES];
+	uint32_t count[MEMPOOL_CLASSES];
+	mempool_stats stats;
+	bool registered; // the exit destructor is set up
+} mempool_cache;
+
+static _Thread_local mempool_cache mempool_local;
+
+// gives the cache back when a thread exits
+static pthread_key_t mempool_key;
+static pthread_once_t mempool_once = PTHREAD_ONCE_INIT;
+
+// counters of exited and trimmed threads
+static pthread_mutex_t mempool_lock = PTHREAD_MUTEX_INITIALIZER;
+static mempool_stats mempool_total;
+
+// returns the size class of a buffer, MEMPOOL_CLASSES or more for buffers too big to pool
+static uint32_t mempool_class(size_t size) {
+	if (size > MEMPOOL_MAX_BYTES) {
+		return MEMPOOL_CLASSES;
+	}
+	uint32_t c = 0;
+	size_t cap = MEMPOOL_MIN_BYTES;
+	while (cap < size) {
+		cap <<= 1;
+		c += 1;
+	}
+	return c;
+}
+
+// malloc that fails the way GMP does when memory runs out
+static void *mempool_malloc(size_t size) {
+	void *p = malloc(size);
+	if (p == NULL) {
+		fprintf(stderr, "GNU MP: Cannot allocate memory (size=%zu)\n", size);
+		abort();
+	}
+	return p;
+}
+
+// frees the cache of a thread and adds its counters to the totals
+static void mempool_flush(mempool_cache *cache) {
+	for (uint32_t c = 0; c < MEMPOOL_CLASSES; c += 1) {
+		while (cache->free[c] != NULL) {
+			mempool_block *b = cache->free[c];
+			cache->free[c] = b->next;
+			free(b);
+			cache->stats.released += 1;
+		}
+		cache->count[c] = 0;
+	}
+	pthread_mutex_lock(&mempool_lock);
+	mempool_total.allocs += cache->stats.allocs;
+	mempool_total.reused += cache->stats.reused;
+	mempool_total.frees += cache->stats.frees;
+	mempool_total.released += cache->stats.released;
+	mempool_total.grows += cache->stats.grows;
+	pthread_mutex_unlock(&mempool_lock);
+	memset(&cache->stats, 0, sizeof(cache->stats));
+}
+
+// pthread key destructor, runs on thread exit
+static void mempool_exit(void *arg) {
+	mempool_flush((mempool_cache *) arg);
+}
+
+static void mempool_make_key(void) {
+	pthread_key_create(&mempool_key, mempool_exit);
+}
+
+// sets up the exit destructor the first time a thread allocates
+static void mempool_register(mempool_cache *cache) {
+	pthread_once(&mempool_once, mempool_make_key);
+	pthread_setspecific(mempool_key, cache);
+	cache->registered = true;
+}
+
+// allocation function handed to GMP
+static void *mempool_alloc(size_t size) {
+	mempool_cache *cache = &mempool_local;
+	if (!cache->registered) {
+		mempool_register(cache);
+	}
+	cache->stats.allocs += 1;
+	uint32_t c = mempool_class(size);
+	if (c >= MEMPOOL_CLASSES) {
+		return mempool_malloc(size);
+	}
+	mempool_block *b = cache->free[c];
+	if (b != NULL) {
+		cache->free[c] = b->next;
+		cache->count[c] -= 1;
+		cache->stats.reused += 1;
+		return b;
+	}
+	return mempool_malloc((size_t) MEMPOOL_MIN_BYTES << c);
+}
+
+// free function handed to GMP, which passes back the size it asked for
+static void mempool_free(void *ptr, size_t size) {
+	mempool_cache *cache = &mempool_local;
+	cache->stats.frees += 1;
+	uint32_t c = mempool_class(size);
+	if (c >= MEMPOOL_CLASSES || cache->count[c] >= MEMPOOL_CACHE) {
+		free(ptr);
+		cache->stats.released += 1;
+		return;
+	}
+	// a thread can free buffers it never allocated, they still have to go back when it exits
+	if (!cache->registered) {
+		mempool_register(cache);
+	}
+	mempool_block *b = (mempool_block *) ptr;
+	b->next = cache->free[c];
+	cache->free[c] = b;
+	cache->count[c] += 1;
+}
+
+// reallocation function handed to GMP
+// a buffer that stays in its size class already has the room
+static void *mempool_realloc(void *ptr, size_t old_size, size_t new_size) {
+	uint32_t oc = mempool_class(old_size);
+	uint32_t nc = mempool_class(new_size);
+	if (oc == nc && oc < MEMPOOL_CLASSES) {
+		mempool_local.stats.grows += 1;
+		return ptr;
+	}
+	if (oc >= MEMPOOL_CLASSES && nc >= MEMPOOL_CLASSES) {
+		mempool_local.stats.allocs += 1;
+		void *p = realloc(ptr, new_size);
+		if (p == NULL) {
+			fprintf(stderr, "GNU MP: Cannot reallocate memory (old_size=%zu new_size=%zu)\n", old_size, new_size);
+			abort();
+		}
+		return p;
+	}
+	void *p = mempool_alloc(new_size);
+	memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+	mempool_free(ptr, old_size);
+	return p;
+}
+
+// Makes GMP take its limb buffers from the pooled allocator.
+// Must be called before the first number is allocated, since GMP hands back the size it asked for.
+void mempool_install(void) {
+	mp_set_memory_functions(mempool_alloc, mempool_realloc, mempool_free);
+}
+
+// Adds up the counters of the pooled allocator.
+// Threads that are still running only report once they exit or call mempool_trim.
+//
+// stats: will store the totals.
+void mempool_get_stats(mempool_stats *stats) {
+	pthread_mutex_lock(&mempool_lock);
+	*stats = mempool_total;
+	pthread_mutex_unlock(&mempool_lock);
+	// the calling thread can read its own counters
+	stats->allocs += mempool_local.stats.allocs;
+	stats->reused += mempool_local.stats.reused;
+	stats->frees += mempool_local.stats.frees;
+	stats->released += mempool_local.stats.released;
+	stats->grows += mempool_local.stats.grows;
+}
+
+// Gives every buffer the calling thread has cached back to malloc and reports its counters.
+void mempool_trim(void) {
+	mempool_flush(&mempool_local);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size classes are powers of two from MEMPOOL_MIN_BYTES up to MEMPOOL_MAX_BYTES
+// bigger buffers (numbers past 128k bits) go straight to malloc
+#define MEMPOOL_MIN_BYTES 16
+#define MEMPOOL_MAX_BYTES 16384
+
+// freed buffers a thread keeps per size class, the rest go back to malloc
+#define MEMPOOL_CACHE 64
+
+//
+// Counters of the pooled allocator.
+//
+// allocs: buffers GMP asked for, counting a realloc that moved to another size class.
+// reused: allocations served from a thread cache instead of malloc (the allocations avoided).
+// frees: buffers GMP gave back.
+// released: freed buffers that went back to malloc because their cache was full or too big.
+// grows: reallocs that stayed inside their size class and cost nothing.
+//
+typedef struct {
+	uint64_t allocs;
+	uint64_t reused;
+	uint64_t frees;
+	uint64_t released;
+	uint64_t grows;
+} mempool_stats;
+
+//
+// Makes GMP take its limb buffers from the pooled allocator.
+// Each thread keeps a cache of freed buffers per size class, so the mpz_init / mpz_clear pairs of
+// the number theory functions stop going to malloc, and threads do not contend for it.
+// Must be called before the first number is allocated, since GMP hands back the size it asked for.
+//
+void mempool_install(void);
+
+//
+// Adds up the counters of the pooled allocator.
+// Threads that are still running only report once they exit or call mempool_trim.
+//
+// stats: will store the totals.
+//
+void mempool_get_stats(mempool_stats *stats);
+
+//
+// Gives every buffer the calling thread has cached back to malloc and reports its counters.
+//
+void mempool_trim(void);
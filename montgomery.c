@@ -0,0 +1,439 @@
+// implements Montgomery modular arithmetic
+#include "montgomery.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+
+// computes -n0^-1 mod 2^GMP_NUMB_BITS for an odd limb n0
+static mp_limb_t mont_limb_inverse(mp_limb_t n0) {
+	// n0*n0 = 1 (mod 8), so n0 is its own inverse to 3 bits
+	// every Newton step doubles the number of correct bits
+	mp_limb_t inv = n0;
+	for (int i = 0; i < 6; i += 1) {
+		inv *= 2 - n0 * inv;
+	}
+	return -inv;
+}
+
+// copies the limbs of x into rp, padding with zeros up to size limbs
+static void mont_set_limbs(mp_limb_t *rp, mpz_t x, mp_size_t size) {
+	mp_size_t xn = mpz_size(x);
+	if (xn > 0) {
+		mpn_copyi(rp, mpz_limbs_read(x), xn);
+	}
+	if (xn < size) {
+		mpn_zero(rp + xn, size - xn);
+	}
+}
+
+// Montgomery reduction of the 2*size limbs in tp: rp = tp * R^-1 (mod n)
+// tp is destroyed. The result is less than R but not always less than n.
+static void mont_redc(mp_limb_t *rp, mp_limb_t *tp, const mont_ctx *ctx) {
+	mp_size_t size = ctx->size;
+	mp_limb_t *up = tp;
+	// clear one low limb per step by adding a multiple of n
+	// the carry out of each step is parked in the limb that was just cleared
+	for (mp_size_t i = 0; i < size; i += 1) {
+		mp_limb_t q = up[0] * ctx->ninv;
+		up[0] = mpn_addmul_1(up, ctx->n, size, q);
+		up += 1;
+	}
+	// add the parked carries to the high half
+	if (mpn_add_n(rp, up, tp, size) != 0) {
+		mpn_sub_n(rp, rp, ctx->n, size);
+	}
+}
+
+// the fixed-size kernels accumulate columns with x86-64 inline assembly on 64-bit limbs
+#if defined(__x86_64__) && defined(__GNUC__) && GMP_NUMB_BITS == 64
+#define MONT_FIXED_X86 1
+#else
+#define MONT_FIXED_X86 0
+#endif
+
+// largest limb count with a fixed-size kernel
+// past it the kernels lose to the subquadratic products of mpn_mul_n and mpn_sqr
+#define MONT_FIXED_MAX 32
+
+#if MONT_FIXED_X86
+
+// adds x*y to the three-limb column accumulator c2:c1:c0
+#define MONT_MAC(c0, c1, c2, x, y) \
+	do { \
+		mp_limb_t lo_ = (x), hi_; \
+		__asm__("mulq %5\n\taddq %%rax, %0\n\tadcq %%rdx, %1\n\tadcq $0, %2" \
+			: "+r"(c0), "+r"(c1), "+r"(c2), "+a"(lo_), "=d"(hi_) \
+			: "rm"(y) \
+			: "cc"); \
+	} while (0)
+
+// adds the three-limb value y2:y1:y0 to c2:c1:c0
+#define MONT_ADD3(c0, c1, c2, y0, y1, y2) \
+	__asm__("addq %3, %0\n\tadcq %4, %1\n\tadcq %5, %2" : "+r"(c0), "+r"(c1), "+r"(c2) : "r"(y0), "r"(y1), "r"(y2) : "cc")
+
+// finishes a kernel: r holds the product shifted down by R plus a carry limb
+// one subtraction brings it below R, and below n when both factors were
+static inline void mont_fixed_finish(mp_limb_t *rp, const mp_limb_t *r, mp_limb_t carry, const mp_limb_t *np, mp_size_t size) {
+	if (carry != 0 || mpn_cmp(r, np, size) >= 0) {
+		mpn_sub_n(rp, r, np, size);
+	} else {
+		mpn_copyi(rp, r, size);
+	}
+}
+
+// Montgomery product by product scanning: column i of a*b and of m*n is summed in one pass,
+// and while i is in the low half the multiple m[i] is picked to clear it
+// size is a constant in every caller, so the loops unroll and the accumulator stays in registers
+static inline __attribute__((always_inline)) void mont_fixed_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mp_limb_t *np, mp_limb_t ninv, const mp_size_t size) {
+	mp_limb_t m[MONT_FIXED_MAX];
+	mp_limb_t r[MONT_FIXED_MAX];
+	mp_limb_t c0 = 0, c1 = 0, c2 = 0;
+#pragma GCC unroll 64
+	for (mp_size_t i = 0; i < 2 * size - 1; i += 1) {
+		mp_size_t lo = i < size ? 0 : i - size + 1;
+		mp_size_t top = i < size ? i : size; // m[i] is not known yet in the low half
+#pragma GCC unroll 32
+		for (mp_size_t j = lo; j <= i - lo; j += 1) {
+			MONT_MAC(c0, c1, c2, ap[j], bp[i - j]);
+		}
+#pragma GCC unroll 32
+		for (mp_size_t j = lo; j < top; j += 1) {
+			MONT_MAC(c0, c1, c2, m[j], np[i - j]);
+		}
+		if (i < size) {
+			m[i] = c0 * ninv;
+			MONT_MAC(c0, c1, c2, m[i], np[0]);
+		} else {
+			r[i - size] = c0;
+		}
+		c0 = c1;
+		c1 = c2;
+		c2 = 0;
+	}
+	r[size - 1] = c0;
+	mont_fixed_finish(rp, r, c1, np, size);
+}
+
+// Montgomery square by product scanning, like mont_fixed_mul
+// the cross products a[j]*a[i-j] with j < i-j appear twice in a column, so they are summed once and doubled
+static inline __attribute__((always_inline)) void mont_fixed_sqr(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *np, mp_limb_t ninv, const mp_size_t size) {
+	mp_limb_t m[MONT_FIXED_MAX];
+	mp_limb_t r[MONT_FIXED_MAX];
+	mp_limb_t c0 = 0, c1 = 0, c2 = 0;
+#pragma GCC unroll 64
+	for (mp_size_t i = 0; i < 2 * size - 1; i += 1) {
+		mp_size_t lo = i < size ? 0 : i - size + 1;
+		mp_size_t top = i < size ? i : size; // m[i] is not known yet in the low half
+		mp_limb_t d0 = 0, d1 = 0, d2 = 0;
+#pragma GCC unroll 32
+		for (mp_size_t j = lo; j < i - j; j += 1) {
+			MONT_MAC(d0, d1, d2, ap[j], ap[i - j]);
+		}
+		d2 = (d2 << 1) | (d1 >> (GMP_NUMB_BITS - 1));
+		d1 = (d1 << 1) | (d0 >> (GMP_NUMB_BITS - 1));
+		d0 <<= 1;
+		if (i % 2 == 0) {
+			MONT_MAC(d0, d1, d2, ap[i / 2], ap[i / 2]);
+		}
+		MONT_ADD3(c0, c1, c2, d0, d1, d2);
+#pragma GCC unroll 32
+		for (mp_size_t j = lo; j < top; j += 1) {
+			MONT_MAC(c0, c1, c2, m[j], np[i - j]);
+		}
+		if (i < size) {
+			m[i] = c0 * ninv;
+			MONT_MAC(c0, c1, c2, m[i], np[0]);
+		} else {
+			r[i - size] = c0;
+		}
+		c0 = c1;
+		c1 = c2;
+		c2 = 0;
+	}
+	r[size - 1] = c0;
+	mont_fixed_finish(rp, r, c1, np, size);
+}
+
+// stamps out the product and squaring kernels of one limb count
+#define MONT_FIXED_KERNELS(size) \
+	static void mont_mul_##size(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mp_limb_t *np, mp_limb_t ninv) { \
+		mont_fixed_mul(rp, ap, bp, np, ninv, size); \
+	} \
+	static void mont_sqr_##size(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mp_limb_t *np, mp_limb_t ninv) { \
+		(void) bp; \
+		mont_fixed_sqr(rp, ap, np, ninv, size); \
+	}
+
+MONT_FIXED_KERNELS(8)
+MONT_FIXED_KERNELS(16)
+MONT_FIXED_KERNELS(24)
+MONT_FIXED_KERNELS(32)
+
+#endif
+
+// picks the fixed-size kernels for the size of a context, if there are any
+static void mont_pick_kernels(mont_ctx *ctx) {
+	ctx->mul = NULL;
+	ctx->sqr = NULL;
+#if MONT_FIXED_X86
+	switch (ctx->size) {
+	case 8: ctx->mul = mont_mul_8; ctx->sqr = mont_sqr_8; break;
+	case 16: ctx->mul = mont_mul_16; ctx->sqr = mont_sqr_16; break;
+	case 24: ctx->mul = mont_mul_24; ctx->sqr = mont_sqr_24; break;
+	case 32: ctx->mul = mont_mul_32; ctx->sqr = mont_sqr_32; break;
+	default: break;
+	}
+#endif
+}
+
+// limbs in the single allocation of a context of size limbs: n, r2, one, then room for
+// the numerator (2*size+1 limbs) and quotient (size+2 limbs) of the divisions in mont_setup
+static mp_size_t mont_block_limbs(mp_size_t size) {
+	return 6 * size + 3;
+}
+
+// fills n, ninv, one and r2 of a context whose block holds size limbs per number
+// divides with mpn_tdiv_qr in the tail of the block, so it never allocates
+static void mont_setup(mont_ctx *ctx, mpz_t n) {
+	mp_size_t size = ctx->size;
+	mp_limb_t *np = ctx->one + size;
+	mp_limb_t *qp = np + 2 * size + 1;
+	mont_set_limbs(ctx->n, n, size);
+	ctx->ninv = mont_limb_inverse(ctx->n[0]);
+	// one = R mod n
+	mpn_zero(np, size);
+	np[size] = 1;
+	mpn_tdiv_qr(qp, ctx->one, 0, np, size + 1, ctx->n, size);
+	// r2 = R^2 mod n
+	mpn_zero(np, 2 * size);
+	np[2 * size] = 1;
+	mpn_tdiv_qr(qp, ctx->r2, 0, np, 2 * size + 1, ctx->n, size);
+	mont_pick_kernels(ctx);
+}
+
+// Initializes a Montgomery context for the modulus n.
+// n must be odd and greater than 1.
+//
+// ctx: the context to initialize.
+// n: the modulus.
+void mont_init(mont_ctx *ctx, mpz_t n) {
+	mp_size_t size = mpz_size(n);
+	ctx->size = size;
+	// n, r2, one and the setup scratch share one allocation
+	ctx->n = (mp_limb_t *) malloc(mont_block_limbs(size) * sizeof(mp_limb_t));
+	ctx->r2 = ctx->n + size;
+	ctx->one = ctx->r2 + size;
+	mpz_init_set(ctx->modulus, n);
+	mont_setup(ctx, n);
+}
+
+// Switches an initialized Montgomery context to the modulus n.
+// Reuses the memory of the context when n has the same number of limbs as the old modulus.
+// n must be odd and greater than 1.
+//
+// ctx: the context to switch.
+// n: the new modulus.
+void mont_reinit(mont_ctx *ctx, mpz_t n) {
+	mp_size_t size = mpz_size(n);
+	if (size != ctx->size) {
+		ctx->size = size;
+		ctx->n = (mp_limb_t *) realloc(ctx->n, mont_block_limbs(size) * sizeof(mp_limb_t));
+		ctx->r2 = ctx->n + size;
+		ctx->one = ctx->r2 + size;
+	}
+	mpz_set(ctx->modulus, n);
+	mont_setup(ctx, n);
+}
+
+// Frees any memory used by an initialized Montgomery context.
+//
+// ctx: the context to free.
+void mont_clear(mont_ctx *ctx) {
+	free(ctx->n);
+	mpz_clear(ctx->modulus);
+}
+
+// Computes a Montgomery product: rp = ap * bp * R^-1 (mod n).
+// ap and bp must be size limbs long and less than R. rp may alias ap or bp.
+//
+// rp: will store the product (size limbs).
+// ap: the first factor.
+// bp: the second factor.
+// ctx: the Montgomery context of the modulus.
+// tp: scratch space of at least 2*size limbs.
+void mont_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mont_ctx *ctx, mp_limb_t *tp) {
+	// the fixed-size kernels keep their columns in registers and need no scratch
+	if (ctx->mul != NULL) {
+		if (ap == bp) {
+			ctx->sqr(rp, ap, bp, ctx->n, ctx->ninv);
+		} else {
+			ctx->mul(rp, ap, bp, ctx->n, ctx->ninv);
+		}
+		return;
+	}
+	if (ap == bp) {
+		mpn_sqr(tp, ap, ctx->size);
+	} else {
+		mpn_mul_n(tp, ap, bp, ctx->size);
+	}
+	mont_redc(rp, tp, ctx);
+}
+
+// picks the sliding window width for an exponent of the given bit length
+// wider windows need fewer multiplications but a larger table of odd powers
+uint32_t mont_window_bits(uint64_t bits) {
+	if (bits <= 7) {
+		return 1;
+	}
+	if (bits <= 25) {
+		return 2;
+	}
+	if (bits <= 80) {
+		return 3;
+	}
+	if (bits <= 240) {
+		return 4;
+	}
+	if (bits <= 672) {
+		return 5;
+	}
+	if (bits <= 1792) {
+		return 6;
+	}
+	return 7;
+}
+
+// returns bit i of the limb array dp
+static inline uint32_t mont_bit(const mp_limb_t *dp, uint64_t i) {
+	return (dp[i / GMP_NUMB_BITS] >> (i % GMP_NUMB_BITS)) & 1;
+}
+
+// Does modular exponentiation using Montgomery reduction and a sliding window.
+// At the end, o = a ^ d (mod n) where n is the modulus of ctx.
+// o may alias a or d.
+//
+// o: will store the result.
+// a: the base.
+// d: the exponent.
+// ctx: the Montgomery context of the modulus.
+// window: the window width in bits (1-MONT_MAX_WINDOW), or 0 to pick it from the size of d.
+void mont_pow_mod_window(mpz_t o, mpz_t a, mpz_t d, const mont_ctx *ctx, uint32_t window) {
+	if (window == 0) {
+		window = mpz_sgn(d) > 0 ? mont_window_bits(mpz_sizeinbase(d, 2)) : 1;
+	}
+	if (window > MONT_MAX_WINDOW) {
+		window = MONT_MAX_WINDOW;
+	}
+	mp_limb_t *sp = (mp_limb_t *) malloc(MONT_POW_SCRATCH(ctx->size, window) * sizeof(mp_limb_t));
+	mont_pow_mod_scratch(o, a, d, ctx, window, sp);
+	free(sp);
+}
+
+// Does modular exponentiation using Montgomery reduction and a sliding window in caller-provided scratch.
+// Never allocates as long as a is in the range [0, n) and o already has room for the result.
+// At the end, o = a ^ d (mod n) where n is the modulus of ctx.
+// o may alias a or d.
+//
+// o: will store the result.
+// a: the base.
+// d: the exponent.
+// ctx: the Montgomery context of the modulus.
+// window: the window width in bits (1-MONT_MAX_WINDOW), or 0 to pick it from the size of d.
+// sp: scratch space of at least MONT_POW_SCRATCH(size, window) limbs, for the window actually used.
+void mont_pow_mod_scratch(mpz_t o, mpz_t a, mpz_t d, const mont_ctx *ctx, uint32_t window, mp_limb_t *sp) {
+	// a^0 = 1, same as the plain pow_mod
+	if (mpz_sgn(d) <= 0) {
+		mpz_set_ui(o, 1);
+		return;
+	}
+	mp_size_t size = ctx->size;
+	uint64_t bits = mpz_sizeinbase(d, 2);
+	if (window == 0) {
+		window = mont_window_bits(bits);
+	}
+	if (window > MONT_MAX_WINDOW) {
+		window = MONT_MAX_WINDOW;
+	}
+	// table[k] holds b^(2k+1) in Montgomery form, for every odd power below 2^window
+	uint64_t entries = (uint64_t) 1 << (window - 1);
+	// x, the product scratch, b^2 and the table share the scratch space
+	mp_limb_t *x = sp;
+	mp_limb_t *tp = x + size;
+	mp_limb_t *b2 = tp + 2 * size;
+	mp_limb_t *table = b2 + size;
+
+	// bring the base into range [0, n) and then into Montgomery form
+	if (mpz_sgn(a) < 0 || mpz_cmp(a, ctx->modulus) >= 0) {
+		mpz_t r;
+		mpz_init(r);
+		mpz_mod(r, a, ctx->modulus);
+		mont_set_limbs(table, r, size);
+		mpz_clear(r);
+	} else {
+		mont_set_limbs(table, a, size);
+	}
+	mont_mul(table, table, ctx->r2, ctx, tp);
+	// precompute the odd powers b^3, b^5, ... from b^2
+	if (entries > 1) {
+		mont_mul(b2, table, table, ctx, tp);
+		for (uint64_t k = 1; k < entries; k += 1) {
+			mont_mul(table + k * size, table + (k - 1) * size, b2, ctx, tp);
+		}
+	}
+
+	// scan the exponent bits in place from the top
+	// zeros cost one squaring each, otherwise take the longest window ending in a one
+	const mp_limb_t *dp = mpz_limbs_read(d);
+	bool started = false;
+	uint64_t i = bits;
+	while (i > 0) {
+		if (mont_bit(dp, i - 1) == 0) {
+			mont_mul(x, x, x, ctx, tp);
+			i -= 1;
+			continue;
+		}
+		// window covers bits [j, i-1] and must end in a one bit
+		uint64_t j = i > window ? i - window : 0;
+		while (mont_bit(dp, j) == 0) {
+			j += 1;
+		}
+		uint64_t value = 0;
+		for (uint64_t k = i; k > j; k -= 1) {
+			value = (value << 1) | mont_bit(dp, k - 1);
+		}
+		if (started) {
+			for (uint64_t k = j; k < i; k += 1) {
+				mont_mul(x, x, x, ctx, tp);
+			}
+			mont_mul(x, x, table + (value >> 1) * size, ctx, tp);
+		} else {
+			mpn_copyi(x, table + (value >> 1) * size, size);
+			started = true;
+		}
+		i = j;
+	}
+
+	// leave Montgomery form: x = x * 1 * R^-1, then fully reduce
+	mpn_copyi(tp, x, size);
+	mpn_zero(tp + size, size);
+	mont_redc(x, tp, ctx);
+	if (mpn_cmp(x, ctx->n, size) >= 0) {
+		mpn_sub_n(x, x, ctx->n, size);
+	}
+	mpn_copyi(mpz_limbs_write(o, size), x, size);
+	mpz_limbs_finish(o, size);
+}
+
+// Does modular exponentiation using Montgomery reduction.
+// At the end, o = a ^ d (mod n) where n is the modulus of ctx.
+// o may alias a or d.
+//
+// o: will store the result.
+// a: the base.
+// d: the exponent.
+// ctx: the Montgomery context of the modulus.
+void mont_pow_mod(mpz_t o, mpz_t a, mpz_t d, const mont_ctx *ctx) {
+	mont_pow_mod_window(o, a, d, ctx, 0);
+}
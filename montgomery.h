@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// largest sliding window width, the odd power table then holds 2^(MONT_MAX_WINDOW-1) entries
+#define MONT_MAX_WINDOW 8
+
+// limbs of scratch mont_pow_mod_scratch needs for a modulus of size limbs and a given window width
+#define MONT_POW_SCRATCH(size, window) ((4 + ((mp_size_t) 1 << ((window) - 1))) * (size))
+
+//
+// A Montgomery product compiled for one limb count: rp = ap * bp * R^-1 (mod n).
+// Squaring kernels ignore bp and square ap.
+//
+typedef void (*mont_fixed_kernel)(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mp_limb_t *np, mp_limb_t ninv);
+
+//
+// Precomputed Montgomery arithmetic context for a fixed odd modulus.
+// Built once per key and reused for every modular exponentiation under it.
+//
+// size: the number of limbs in the modulus.
+// n: the modulus limbs (least significant first).
+// ninv: -n^-1 mod 2^GMP_NUMB_BITS, used by the reduction step.
+// r2: R^2 mod n where R = 2^(size*GMP_NUMB_BITS), used to enter Montgomery form.
+// one: R mod n, the Montgomery form of 1.
+// modulus: the modulus as an mpz, used to reduce oversized bases.
+// mul: the product kernel for this size, or NULL to use the generic mpn path.
+// sqr: the squaring kernel for this size, set whenever mul is.
+//
+typedef struct {
+	mp_size_t size;
+	mp_limb_t *n;
+	mp_limb_t ninv;
+	mp_limb_t *r2;
+	mp_limb_t *one;
+	mpz_t modulus;
+	mont_fixed_kernel mul;
+	mont_fixed_kernel sqr;
+} mont_ctx;
+
+//
+// Initializes a Montgomery context for the modulus n.
+// Moduli of 8, 16, 24 or 32 limbs (512 to 2048 bits, the CRT halves of every standard key size)
+// get kernels with the limb count fixed at compile time where the CPU allows it.
+// n must be odd and greater than 1.
+//
+// ctx: the context to initialize.
+// n: the modulus.
+//
+void mont_init(mont_ctx *ctx, mpz_t n);
+
+//
+// Switches an initialized Montgomery context to the modulus n.
+// Reuses the memory of the context when n has the same number of limbs as the old modulus,
+// so testing many candidates of one size does not allocate.
+// n must be odd and greater than 1.
+//
+// ctx: the context to switch.
+// n: the new modulus.
+//
+void mont_reinit(mont_ctx *ctx, mpz_t n);
+
+//
+// Frees any memory used by an initialized Montgomery context.
+//
+// ctx: the context to free.
+//
+void mont_clear(mont_ctx *ctx);
+
+//
+// Computes a Montgomery product: rp = ap * bp * R^-1 (mod n).
+// ap and bp must be size limbs long and less than R. rp may alias ap or bp.
+//
+// rp: will store the product (size limbs).
+// ap: the first factor.
+// bp: the second factor.
+// ctx: the Montgomery context of the modulus.
+// tp: scratch space of at least 2*size limbs.
+//
+void mont_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mont_ctx *ctx, mp_limb_t *tp);
+
+//
+// Picks the sliding window width used for an exponent of the given bit length.
+//
+// bits: the number of bits in the exponent.
+// returns: the window width in bits.
+//
+uint32_t mont_window_bits(uint64_t bits);
+
+//
+// Does modular exponentiation using Montgomery reduction and a sliding window.
+// Precomputes the odd powers of the base up to 2^window and scans the exponent bits in place.
+// At the end, o = a ^ d (mod n) where n is the modulus of ctx.
+// o may alias a or d.
+//
+// o: will store the result.
+// a: the base.
+// d: the exponent.
+// ctx: the Montgomery context of the modulus.
+// window: the window width in bits (1-MONT_MAX_WINDOW), or 0 to pick it from the size of d.
+//
+void mont_pow_mod_window(mpz_t o, mpz_t a, mpz_t d, const mont_ctx *ctx, uint32_t window);
+
+//
+// Does modular exponentiation using Montgomery reduction and a sliding window in caller-provided scratch.
+// Same as mont_pow_mod_window, but never allocates as long as a is in the range [0, n)
+// and o already has room for the result.
+// At the end, o = a ^ d (mod n) where n is the modulus of ctx.
+// o may alias a or d.
+//
+// o: will store the result.
+// a: the base.
+// d: the exponent.
+// ctx: the Montgomery context of the modulus.
+// window: the window width in bits (1-MONT_MAX_WINDOW), or 0 to pick it from the size of d.
+// sp: scratch space of at least MONT_POW_SCRATCH(size, window) limbs, for the window actually used.
+//
+void mont_pow_mod_scratch(mpz_t o, mpz_t a, mpz_t d, const mont_ctx *ctx, uint32_t window, mp_limb_t *sp);
+
+//
+// Does modular exponentiation using Montgomery reduction.
+// Same as mont_pow_mod_window with the window picked from the size of d.
+// At the end, o = a ^ d (mod n) where n is the modulus of ctx.
+// o may alias a or d.
+//
+// o: will store the result.
+// a: the base.
+// d: the exponent.
+// ctx: the Montgomery context of the modulus.
+//
+void mont_pow_mod(mpz_t o, mpz_t a, mpz_t d, const mont_ctx *ctx);
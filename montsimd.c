@@ -0,0 +1,422 @@
+// implements batched multi-lane Montgomery exponentiation
+#include "montsimd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gmp.h>
+#include "montgomery.h"
+
+// the vector kernels need x86-64 intrinsics, GCC/clang target attributes and 64-bit limbs
+#if defined(__x86_64__) && defined(__GNUC__) && GMP_NUMB_BITS == 64
+#define MONT_BATCH_X86 1
+#include <immintrin.h>
+#else
+#define MONT_BATCH_X86 0
+#endif
+
+// moduli below this size are not worth the conversion cost, they use the scalar path
+#define MONT_BATCH_MIN_BITS 256
+
+// a Montgomery product of every lane: rp = ap * bp * R^-1 (mod n)
+// inputs must be normalized digits of values below 2n, the output is too
+// tp is scratch of 2*digits*MONT_BATCH_LANES words, rp may alias ap or bp
+typedef void (*mont_batch_kernel)(uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch_ctx *ctx, uint64_t *tp);
+
+#if MONT_BATCH_X86
+
+// 26-bit digits: every 32x32-bit product is below 2^52, so one word can soak up
+// every product landing on it for moduli far beyond MONT_BATCH_MAX_BITS before carrying
+__attribute__((target("avx2")))
+static void mont_batch_mul_avx2(uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch_ctx *ctx, uint64_t *tp) {
+	uint64_t size = ctx->digits;
+	const __m256i mask = _mm256_set1_epi64x((1ULL << 26) - 1);
+	const __m256i ninv = _mm256_set1_epi64x(ctx->ninv);
+	__m256i *t = (__m256i *) tp;
+	// a 256-bit register holds 4 lanes, so do the 8 lanes as two halves
+	for (uint32_t h = 0; h < MONT_BATCH_LANES; h += 4) {
+		memset(tp, 0, 2 * size * sizeof(__m256i));
+		for (uint64_t i = 0; i < size; i += 1) {
+			__m256i ai = _mm256_loadu_si256((const __m256i *) (ap + i * MONT_BATCH_LANES + h));
+			__m256i b0 = _mm256_loadu_si256((const __m256i *) (bp + h));
+			// pick q so the lowest word becomes divisible by 2^26
+			__m256i t0 = _mm256_add_epi64(t[i], _mm256_mul_epu32(ai, b0));
+			__m256i q = _mm256_and_si256(_mm256_mul_epu32(t0, ninv), mask);
+			t0 = _mm256_add_epi64(t0, _mm256_mul_epu32(q, _mm256_set1_epi64x(ctx->n[0])));
+			for (uint64_t j = 1; j < size; j += 1) {
+				__m256i bj = _mm256_loadu_si256((const __m256i *) (bp + j * MONT_BATCH_LANES + h));
+				__m256i nj = _mm256_set1_epi64x(ctx->n[j]);
+				__m256i v = _mm256_add_epi64(_mm256_mul_epu32(ai, bj), _mm256_mul_epu32(q, nj));
+				t[i + j] = _mm256_add_epi64(t[i + j], v);
+			}
+			t[i + 1] = _mm256_add_epi64(t[i + 1], _mm256_srli_epi64(t0, 26));
+		}
+		// the result is the top half, carry it back into 26-bit digits
+		__m256i c = _mm256_setzero_si256();
+		for (uint64_t j = 0; j < size; j += 1) {
+			__m256i v = _mm256_add_epi64(t[size + j], c);
+			_mm256_storeu_si256((__m256i *) (rp + j * MONT_BATCH_LANES + h), _mm256_and_si256(v, mask));
+			c = _mm256_srli_epi64(v, 26);
+		}
+	}
+}
+
+// same as the AVX2 kernel with all 8 lanes in one 512-bit register
+__attribute__((target("avx512f")))
+static void mont_batch_mul_avx512(uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch_ctx *ctx, uint64_t *tp) {
+	uint64_t size = ctx->digits;
+	const __m512i mask = _mm512_set1_epi64((1ULL << 26) - 1);
+	const __m512i ninv = _mm512_set1_epi64(ctx->ninv);
+	__m512i *t = (__m512i *) tp;
+	memset(tp, 0, 2 * size * sizeof(__m512i));
+	for (uint64_t i = 0; i < size; i += 1) {
+		__m512i ai = _mm512_loadu_si512((const void *) (ap + i * MONT_BATCH_LANES));
+		__m512i b0 = _mm512_loadu_si512((const void *) bp);
+		// pick q so the lowest word becomes divisible by 2^26
+		__m512i t0 = _mm512_add_epi64(t[i], _mm512_mul_epu32(ai, b0));
+		__m512i q = _mm512_and_si512(_mm512_mul_epu32(t0, ninv), mask);
+		t0 = _mm512_add_epi64(t0, _mm512_mul_epu32(q, _mm512_set1_epi64(ctx->n[0])));
+		for (uint64_t j = 1; j < size; j += 1) {
+			__m512i bj = _mm512_loadu_si512((const void *) (bp + j * MONT_BATCH_LANES));
+			__m512i nj = _mm512_set1_epi64(ctx->n[j]);
+			__m512i v = _mm512_add_epi64(_mm512_mul_epu32(ai, bj), _mm512_mul_epu32(q, nj));
+			t[i + j] = _mm512_add_epi64(t[i + j], v);
+		}
+		t[i + 1] = _mm512_add_epi64(t[i + 1], _mm512_srli_epi64(t0, 26));
+	}
+	// the result is the top half, carry it back into 26-bit digits
+	__m512i c = _mm512_setzero_si512();
+	for (uint64_t j = 0; j < size; j += 1) {
+		__m512i v = _mm512_add_epi64(t[size + j], c);
+		_mm512_storeu_si512((void *) (rp + j * MONT_BATCH_LANES), _mm512_and_si512(v, mask));
+		c = _mm512_srli_epi64(v, 26);
+	}
+}
+
+// 52-bit digits: IFMA adds the low or the high 52 bits of a 52x52-bit product to a word,
+// so each product costs two instructions but there are 4 times fewer of them than with 26-bit digits
+__attribute__((target("avx512f,avx512ifma")))
+static void mont_batch_mul_ifma(uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch_ctx *ctx, uint64_t *tp) {
+	uint64_t size = ctx->digits;
+	const __m512i mask = _mm512_set1_epi64((1ULL << 52) - 1);
+	const __m512i ninv = _mm512_set1_epi64(ctx->ninv);
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i *t = (__m512i *) tp;
+	memset(tp, 0, 2 * size * sizeof(__m512i));
+	for (uint64_t i = 0; i < size; i += 1) {
+		__m512i ai = _mm512_loadu_si512((const void *) (ap + i * MONT_BATCH_LANES));
+		__m512i b0 = _mm512_loadu_si512((const void *) bp);
+		__m512i n0 = _mm512_set1_epi64(ctx->n[0]);
+		// pick q so the lowest word becomes divisible by 2^52
+		__m512i t0 = _mm512_madd52lo_epu64(t[i], ai, b0);
+		__m512i q = _mm512_madd52lo_epu64(zero, _mm512_and_si512(t0, mask), ninv);
+		t0 = _mm512_madd52lo_epu64(t0, q, n0);
+		__m512i t1 = _mm512_madd52hi_epu64(t[i + 1], ai, b0);
+		t1 = _mm512_madd52hi_epu64(t1, q, n0);
+		t[i + 1] = _mm512_add_epi64(t1, _mm512_srli_epi64(t0, 52));
+		for (uint64_t j = 1; j < size; j += 1) {
+			__m512i bj = _mm512_loadu_si512((const void *) (bp + j * MONT_BATCH_LANES));
+			__m512i nj = _mm512_set1_epi64(ctx->n[j]);
+			t[i + j] = _mm512_madd52lo_epu64(_mm512_madd52lo_epu64(t[i + j], ai, bj), q, nj);
+			t[i + j + 1] = _mm512_madd52hi_epu64(_mm512_madd52hi_epu64(t[i + j + 1], ai, bj), q, nj);
+		}
+	}
+	// the result is the top half, carry it back into 52-bit digits
+	__m512i c = _mm512_setzero_si512();
+	for (uint64_t j = 0; j < size; j += 1) {
+		__m512i v = _mm512_add_epi64(t[size + j], c);
+		_mm512_storeu_si512((void *) (rp + j * MONT_BATCH_LANES), _mm512_and_si512(v, mask));
+		c = _mm512_srli_epi64(v, 52);
+	}
+}
+
+#endif
+
+// Returns the fastest kernel the running CPU supports.
+mont_batch_kind mont_batch_detect(void) {
+#if MONT_BATCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma")) {
+		return MONT_BATCH_IFMA;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		return MONT_BATCH_AVX512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return MONT_BATCH_AVX2;
+	}
+#endif
+	return MONT_BATCH_SCALAR;
+}
+
+// Returns a short printable name for a kernel.
+//
+// kind: the kernel.
+const char *mont_batch_name(mont_batch_kind kind) {
+	switch (kind) {
+	case MONT_BATCH_AVX2: return "avx2";
+	case MONT_BATCH_AVX512: return "avx512";
+	case MONT_BATCH_IFMA: return "avx512ifma";
+	default: return "scalar";
+	}
+}
+
+// returns the kernel function of a context
+static mont_batch_kernel mont_batch_get_kernel(const mont_batch_ctx *ctx) {
+#if MONT_BATCH_X86
+	switch (ctx->kind) {
+	case MONT_BATCH_AVX2: return mont_batch_mul_avx2;
+	case MONT_BATCH_AVX512: return mont_batch_mul_avx512;
+	case MONT_BATCH_IFMA: return mont_batch_mul_ifma;
+	default: break;
+	}
+#else
+	(void) ctx;
+#endif
+	return NULL;
+}
+
+// splits x into digit_bits-wide digits and stores them in the given lane of dp
+static void mont_batch_to_digits(uint64_t *dp, mpz_t x, uint32_t lane, const mont_batch_ctx *ctx) {
+	const mp_limb_t *xp = mpz_limbs_read(x);
+	uint64_t xn = mpz_size(x);
+	uint32_t w = ctx->digit_bits;
+	uint64_t mask = ((uint64_t) 1 << w) - 1;
+	for (uint64_t j = 0; j < ctx->digits; j += 1) {
+		uint64_t bit = j * w;
+		uint64_t limb = bit / 64;
+		uint32_t shift = bit % 64;
+		uint64_t v = 0;
+		if (limb < xn) {
+			v = xp[limb] >> shift;
+			// the digit straddles two limbs
+			if (shift + w > 64 && limb + 1 < xn) {
+				v |= xp[limb + 1] << (64 - shift);
+			}
+		}
+		dp[j * MONT_BATCH_LANES + lane] = v & mask;
+	}
+}
+
+// joins the digits in the given lane of dp back into x
+// the value is at most n, so it fits the limbs of the modulus and any digits past them are zero
+static void mont_batch_from_digits(mpz_t x, const uint64_t *dp, uint32_t lane, const mont_batch_ctx *ctx) {
+	uint32_t w = ctx->digit_bits;
+	uint64_t xn = ctx->scalar.size;
+	mp_limb_t *xp = mpz_limbs_write(x, xn);
+	memset(xp, 0, xn * sizeof(mp_limb_t));
+	for (uint64_t j = 0; j < ctx->digits; j += 1) {
+		uint64_t v = dp[j * MONT_BATCH_LANES + lane];
+		uint64_t bit = j * w;
+		uint64_t limb = bit / 64;
+		uint32_t shift = bit % 64;
+		if (limb >= xn) {
+			break;
+		}
+		xp[limb] |= v << shift;
+		if (shift + w > 64 && limb + 1 < xn) {
+			xp[limb + 1] |= v >> (64 - shift);
+		}
+	}
+	mpz_limbs_finish(x, xn);
+}
+
+// Initializes a batched context for the modulus n using the fastest supported kernel.
+// n must be odd and greater than 1.
+//
+// ctx: the context to initialize.
+// n: the modulus.
+void mont_batch_init(mont_batch_ctx *ctx, mpz_t n) {
+	mont_batch_init_kind(ctx, n, mont_batch_detect());
+}
+
+// Initializes a batched context for the modulus n using a specific kernel.
+// Falls back to MONT_BATCH_SCALAR if the CPU or the size of n does not allow that kernel.
+//
+// ctx: the context to initialize.
+// n: the modulus.
+// kind: the requested kernel.
+void mont_batch_init_kind(mont_batch_ctx *ctx, mpz_t n, mont_batch_kind kind) {
+	mont_init(&ctx->scalar, n);
+	uint64_t bits = mpz_sizeinbase(n, 2);
+	if (kind > mont_batch_detect() || bits < MONT_BATCH_MIN_BITS || bits > MONT_BATCH_MAX_BITS) {
+		kind = MONT_BATCH_SCALAR;
+	}
+	ctx->kind = kind;
+	ctx->n = NULL;
+	ctx->ninv = 0;
+	ctx->digit_bits = kind == MONT_BATCH_IFMA ? 52 : 26;
+	// two spare bits so that R > 4n, which keeps every product below 2n without a final subtraction
+	ctx->digits = (bits + 2 + ctx->digit_bits - 1) / ctx->digit_bits;
+	if (kind == MONT_BATCH_SCALAR) {
+		return;
+	}
+	// the modulus digits are the same in every lane, so keep one copy
+	uint64_t *lanes = (uint64_t *) malloc(ctx->digits * MONT_BATCH_LANES * sizeof(uint64_t));
+	mont_batch_to_digits(lanes, n, 0, ctx);
+	ctx->n = (uint64_t *) malloc(ctx->digits * sizeof(uint64_t));
+	for (uint64_t j = 0; j < ctx->digits; j += 1) {
+		ctx->n[j] = lanes[j * MONT_BATCH_LANES];
+	}
+	free(lanes);
+	// -n^-1 mod 2^digit_bits is the low bits of the limb inverse
+	ctx->ninv = ctx->scalar.ninv & (((uint64_t) 1 << ctx->digit_bits) - 1);
+}
+
+// Frees any memory used by an initialized batched context.
+//
+// ctx: the context to free.
+void mont_batch_clear(mont_batch_ctx *ctx) {
+	free(ctx->n);
+	ctx->n = NULL;
+	mont_clear(&ctx->scalar);
+}
+
+// returns bit i of the limb array dp
+static inline uint32_t mont_batch_bit(const mp_limb_t *dp, uint64_t i) {
+	return (dp[i / GMP_NUMB_BITS] >> (i % GMP_NUMB_BITS)) & 1;
+}
+
+// Initializes the scratch space of batched exponentiations under ctx.
+// It has room for the window of an exponent as long as the modulus; longer exponents get that
+// narrower window, which is slower but still correct.
+//
+// ws: the scratch space to initialize.
+// ctx: the batched context it will be used with.
+void mont_batch_ws_init(mont_batch_ws *ws, const mont_batch_ctx *ctx) {
+	uint64_t bits = mpz_sizeinbase(ctx->scalar.modulus, 2);
+	ws->window = mont_window_bits(bits);
+	ws->sp = (mp_limb_t *) malloc(MONT_POW_SCRATCH(ctx->scalar.size, ws->window) * sizeof(mp_limb_t));
+	ws->vec = NULL;
+	if (ctx->kind != MONT_BATCH_SCALAR) {
+		uint64_t entries = (uint64_t) 1 << (ws->window - 1);
+		ws->vec = (uint64_t *) aligned_alloc(64, (4 + entries) * ctx->digits * MONT_BATCH_LANES * sizeof(uint64_t));
+	}
+	// a base below n shifted up by the digits of R
+	mpz_init2(ws->r, bits + ctx->digit_bits * ctx->digits + GMP_NUMB_BITS);
+}
+
+// Frees the scratch space made by mont_batch_ws_init.
+//
+// ws: the scratch space to free.
+void mont_batch_ws_clear(mont_batch_ws *ws) {
+	free(ws->sp);
+	free(ws->vec);
+	ws->sp = NULL;
+	ws->vec = NULL;
+	mpz_clear(ws->r);
+}
+
+// Does modular exponentiation of several bases with one shared exponent in lockstep.
+// At the end, o[i] = a[i] ^ d (mod n) for every i below count.
+// o[i] may alias a[i].
+//
+// o: will store the results.
+// a: the bases.
+// count: the number of bases (1-MONT_BATCH_LANES).
+// d: the exponent shared by every base.
+// ctx: the batched context of the modulus.
+void mont_batch_pow_mod(mpz_ptr o[], mpz_ptr a[], uint32_t count, mpz_t d, const mont_batch_ctx *ctx) {
+	mont_batch_ws ws;
+	mont_batch_ws_init(&ws, ctx);
+	mont_batch_pow_mod_ws(o, a, count, d, ctx, &ws);
+	mont_batch_ws_clear(&ws);
+}
+
+// Does modular exponentiation of several bases with one shared exponent in lockstep, in caller-provided scratch.
+// Never allocates as long as every a[i] is in the range [0, n) and every o[i] already has room for a number as long as n.
+// At the end, o[i] = a[i] ^ d (mod n) for every i below count.
+// o[i] may alias a[i].
+//
+// o: will store the results.
+// a: the bases.
+// count: the number of bases (1-MONT_BATCH_LANES).
+// d: the exponent shared by every base.
+// ctx: the batched context of the modulus.
+// ws: scratch space made by mont_batch_ws_init for ctx, used by one thread at a time.
+void mont_batch_pow_mod_ws(mpz_ptr o[], mpz_ptr a[], uint32_t count, mpz_t d, const mont_batch_ctx *ctx, mont_batch_ws *ws) {
+	mont_batch_kernel mul = mont_batch_get_kernel(ctx);
+	uint64_t bits = mpz_sgn(d) > 0 ? mpz_sizeinbase(d, 2) : 1;
+	uint32_t window = mont_window_bits(bits);
+	if (window > ws->window) {
+		window = ws->window;
+	}
+	// the scalar kernel, or nothing to share: one block at a time
+	if (mul == NULL || count == 1 || mpz_sgn(d) <= 0) {
+		for (uint32_t i = 0; i < count; i += 1) {
+			mont_pow_mod_scratch(o[i], a[i], d, &ctx->scalar, window, ws->sp);
+		}
+		return;
+	}
+	uint64_t entries = (uint64_t) 1 << (window - 1);
+	uint64_t vec = ctx->digits * MONT_BATCH_LANES; // words in one multi-lane number
+	// x, b^2, the product scratch and the table share the scratch space
+	uint64_t *x = ws->vec;
+	uint64_t *b2 = x + vec;
+	uint64_t *tp = b2 + vec;
+	uint64_t *table = tp + 2 * vec;
+
+	// bring every base into Montgomery form: a*R (mod n)
+	// unused lanes get a zero base and their result is thrown away
+	mpz_ptr r = ws->r;
+	for (uint32_t l = 0; l < MONT_BATCH_LANES; l += 1) {
+		if (l < count) {
+			mpz_mod(r, a[l], ctx->scalar.modulus);
+			mpz_mul_2exp(r, r, ctx->digit_bits * ctx->digits);
+			mpz_mod(r, r, ctx->scalar.modulus);
+		} else {
+			mpz_set_ui(r, 0);
+		}
+		mont_batch_to_digits(table, r, l, ctx);
+	}
+	// precompute the odd powers b^3, b^5, ... from b^2
+	if (entries > 1) {
+		mul(b2, table, table, ctx, tp);
+		for (uint64_t k = 1; k < entries; k += 1) {
+			mul(table + k * vec, table + (k - 1) * vec, b2, ctx, tp);
+		}
+	}
+
+	// sliding window over the shared exponent, same schedule as mont_pow_mod_window
+	const mp_limb_t *dp = mpz_limbs_read(d);
+	bool started = false;
+	uint64_t i = bits;
+	while (i > 0) {
+		if (mont_batch_bit(dp, i - 1) == 0) {
+			mul(x, x, x, ctx, tp);
+			i -= 1;
+			continue;
+		}
+		uint64_t j = i > window ? i - window : 0;
+		while (mont_batch_bit(dp, j) == 0) {
+			j += 1;
+		}
+		uint64_t value = 0;
+		for (uint64_t k = i; k > j; k -= 1) {
+			value = (value << 1) | mont_batch_bit(dp, k - 1);
+		}
+		if (started) {
+			for (uint64_t k = j; k < i; k += 1) {
+				mul(x, x, x, ctx, tp);
+			}
+			mul(x, x, table + (value >> 1) * vec, ctx, tp);
+		} else {
+			memcpy(x, table + (value >> 1) * vec, vec * sizeof(uint64_t));
+			started = true;
+		}
+		i = j;
+	}
+
+	// leave Montgomery form by multiplying with 1, the result is at most n
+	memset(b2, 0, vec * sizeof(uint64_t));
+	for (uint32_t l = 0; l < MONT_BATCH_LANES; l += 1) {
+		b2[l] = 1;
+	}
+	mul(x, x, b2, ctx, tp);
+	for (uint32_t l = 0; l < count; l += 1) {
+		mont_batch_from_digits(o[l], x, l, ctx);
+		if (mpz_cmp(o[l], ctx->scalar.modulus) >= 0) {
+			mpz_sub(o[l], o[l], ctx->scalar.modulus);
+		}
+	}
+}
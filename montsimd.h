@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+#include "montgomery.h"
+
+// number of blocks exponentiated together by one batched call
+#define MONT_BATCH_LANES 8
+
+// largest modulus (in bits) the vector kernels accept, bigger moduli use the scalar path
+#define MONT_BATCH_MAX_BITS 16384
+
+//
+// The kernels a batched Montgomery context can run on.
+// MONT_BATCH_SCALAR exponentiates the blocks one at a time with mont_pow_mod.
+// MONT_BATCH_AVX2 and MONT_BATCH_AVX512 use 26-bit digits and 32x32-bit vector multiplies.
+// MONT_BATCH_IFMA uses 52-bit digits and the AVX-512 IFMA multiply-add instructions.
+//
+typedef enum {
+	MONT_BATCH_SCALAR,
+	MONT_BATCH_AVX2,
+	MONT_BATCH_AVX512,
+	MONT_BATCH_IFMA,
+} mont_batch_kind;
+
+//
+// Precomputed context for exponentiating up to MONT_BATCH_LANES blocks under one modulus at once.
+// Numbers are kept in a structure-of-arrays layout: digit j of lane l is at [j*MONT_BATCH_LANES + l],
+// so one vector register holds the same digit of every lane.
+//
+// kind: the kernel in use.
+// digit_bits: the radix of the vector digits (26 or 52).
+// digits: the number of digits per number, with R = 2^(digit_bits*digits) > 4n.
+// n: the modulus digits (least significant first).
+// ninv: -n^-1 mod 2^digit_bits.
+// scalar: the scalar Montgomery context, used for conversions and the scalar kernel.
+//
+typedef struct {
+	mont_batch_kind kind;
+	uint32_t digit_bits;
+	uint64_t digits;
+	uint64_t *n;
+	uint64_t ninv;
+	mont_ctx scalar;
+} mont_batch_ctx;
+
+//
+// Scratch space of the batched exponentiation, sized once from a batched context.
+// A caller that keeps one per thread exponentiates batch after batch without allocating.
+//
+// window: the widest sliding window the scratch has room for.
+// vec: x, b^2, the product scratch and the odd power table of the vector kernels (64-byte aligned).
+// sp: the scratch of mont_pow_mod_scratch for the scalar kernel and single blocks.
+// r: room for a base on its way into Montgomery form.
+//
+typedef struct {
+	uint32_t window;
+	uint64_t *vec;
+	mp_limb_t *sp;
+	mpz_t r;
+} mont_batch_ws;
+
+//
+// Returns the fastest kernel the running CPU supports.
+//
+mont_batch_kind mont_batch_detect(void);
+
+//
+// Returns a short printable name for a kernel.
+//
+// kind: the kernel.
+//
+const char *mont_batch_name(mont_batch_kind kind);
+
+//
+// Initializes a batched context for the modulus n using the fastest supported kernel.
+// n must be odd and greater than 1.
+//
+// ctx: the context to initialize.
+// n: the modulus.
+//
+void mont_batch_init(mont_batch_ctx *ctx, mpz_t n);
+
+//
+// Initializes a batched context for the modulus n using a specific kernel.
+// Falls back to MONT_BATCH_SCALAR if the CPU or the size of n does not allow that kernel.
+//
+// ctx: the context to initialize.
+// n: the modulus.
+// kind: the requested kernel.
+//
+void mont_batch_init_kind(mont_batch_ctx *ctx, mpz_t n, mont_batch_kind kind);
+
+//
+// Frees any memory used by an initialized batched context.
+//
+// ctx: the context to free.
+//
+void mont_batch_clear(mont_batch_ctx *ctx);
+
+//
+// Does modular exponentiation of several bases with one shared exponent in lockstep.
+// At the end, o[i] = a[i] ^ d (mod n) for every i below count.
+// o[i] may alias a[i].
+//
+// o: will store the results.
+// a: the bases.
+// count: the number of bases (1-MONT_BATCH_LANES).
+// d: the exponent shared by every base.
+// ctx: the batched context of the modulus.
+//
+void mont_batch_pow_mod(mpz_ptr o[], mpz_ptr a[], uint32_t count, mpz_t d, const mont_batch_ctx *ctx);
+
+//
+// Initializes the scratch space of batched exponentiations under ctx.
+// It has room for the window of an exponent as long as the modulus; longer exponents get that
+// narrower window, which is slower but still correct.
+//
+// ws: the scratch space to initialize.
+// ctx: the batched context it will be used with.
+//
+void mont_batch_ws_init(mont_batch_ws *ws, const mont_batch_ctx *ctx);
+
+//
+// Frees the scratch space made by mont_batch_ws_init.
+//
+// ws: the scratch space to free.
+//
+void mont_batch_ws_clear(mont_batch_ws *ws);
+
+//
+// Does modular exponentiation of several bases with one shared exponent in lockstep, in caller-provided scratch.
+// Same as mont_batch_pow_mod, but never allocates as long as every a[i] is in the range [0, n)
+// and every o[i] already has room for a number as long as n.
+// At the end, o[i] = a[i] ^ d (mod n) for every i below count.
+// o[i] may alias a[i].
+//
+// o: will store the results.
+// a: the bases.
+// count: the number of bases (1-MONT_BATCH_LANES).
+// d: the exponent shared by every base.
+// ctx: the batched context of the modulus.
+// ws: scratch space made by mont_batch_ws_init for ctx, used by one thread at a time.
+//
+void mont_batch_pow_mod_ws(mpz_ptr o[], mpz_ptr a[], uint32_t count, mpz_t d, const mont_batch_ctx *ctx, mont_batch_ws *ws);
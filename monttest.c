@@ -0,0 +1,178 @@
+// implement monttest program: checks Montgomery products and exponentiations against GMP for every kernel size
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "montgomery.h"
+
+// limb counts tested: the generic path on both sides of every fixed-size kernel (8, 16, 24 and 32)
+#define TEST_MIN_LIMBS 6
+#define TEST_MAX_LIMBS 35
+
+// random moduli per limb count, on top of the ones near a power of two
+#define TEST_RANDOM_MODULI 16
+
+// exponentiations per modulus
+#define TEST_POWS 6
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+// counts one check and prints it when it does not hold
+static void expect(bool cond, const char *what, mpz_t n) {
+	checks += 1;
+	if (!cond) {
+		failures += 1;
+		gmp_fprintf(stderr, "monttest: FAILED %s (%zu limbs, n = %Zx)\n", what, mpz_size(n), n);
+	}
+}
+
+// sets x to a random number of the given number of bits
+static void random_bits(mpz_t x, uint64_t bits, rand_ctx *rng) {
+	mpz_set_ui(x, 0);
+	for (uint64_t w = 0; w < bits; w += 64) {
+		mpz_mul_2exp(x, x, 64);
+		mpz_add_ui(x, x, rand_ctx_u64(rng));
+	}
+	mpz_fdiv_r_2exp(x, x, bits);
+}
+
+// sets x to a random number in [0, n)
+static void random_below(mpz_t x, mpz_t n, rand_ctx *rng) {
+	random_bits(x, mpz_sizeinbase(n, 2) + 64, rng);
+	mpz_mod(x, x, n);
+}
+
+// checks products, squares and exponentiations under the odd modulus n
+static void check_modulus(mpz_t n, rand_ctx *rng) {
+	mont_ctx ctx;
+	mont_init(&ctx, n);
+	mp_size_t size = ctx.size;
+	mpz_t a;
+	mpz_t b;
+	mpz_t d;
+	mpz_t got;
+	mpz_t want;
+	mpz_t rinv;
+	mpz_inits(a, b, d, got, want, rinv, NULL);
+	// R^-1 (mod n), what every Montgomery product carries
+	mpz_setbit(rinv, size * GMP_NUMB_BITS);
+	mpz_invert(rinv, rinv, n);
+	// the factors, the product and 2*size limbs of scratch
+	mp_limb_t *ap = (mp_limb_t *) calloc(5 * size, sizeof(mp_limb_t));
+	mp_limb_t *bp = ap + size;
+	mp_limb_t *tp = bp + size;
+
+	// products and squares, with n - 1, 0 and R - 1 (every limb all ones) as the extreme factors
+	// the results only need to be below R, so they are compared modulo n
+	for (uint32_t i = 0; i < TEST_POWS + 3; i += 1) {
+		random_below(a, n, rng);
+		random_below(b, n, rng);
+		if (i == 0) {
+			mpz_sub_ui(a, n, 1);
+			mpz_sub_ui(b, n, 1);
+		} else if (i == 1) {
+			mpz_set_ui(b, 0);
+		} else if (i == 2) {
+			mpz_set_ui(a, 0);
+			mpz_setbit(a, size * GMP_NUMB_BITS);
+			mpz_sub_ui(a, a, 1);
+			mpz_set(b, a);
+		}
+		mpn_zero(ap, 2 * size);
+		mpz_export(ap, NULL, -1, sizeof(mp_limb_t), 0, 0, a);
+		mpz_export(bp, NULL, -1, sizeof(mp_limb_t), 0, 0, b);
+		mont_mul(tp, ap, bp, &ctx, tp + size);
+		mpz_import(got, size, -1, sizeof(mp_limb_t), 0, 0, tp);
+		mpz_mod(got, got, n);
+		mpz_mul(want, a, b);
+		mpz_mul(want, want, rinv);
+		mpz_mod(want, want, n);
+		expect(mpz_cmp(got, want) == 0, "product", n);
+		mont_mul(tp, ap, ap, &ctx, tp + size);
+		mpz_import(got, size, -1, sizeof(mp_limb_t), 0, 0, tp);
+		mpz_mod(got, got, n);
+		mpz_mul(want, a, a);
+		mpz_mul(want, want, rinv);
+		mpz_mod(want, want, n);
+		expect(mpz_cmp(got, want) == 0, "square", n);
+	}
+
+	// exponentiations: short exponents and one as long as n, several window widths, a base above n and the base n - 1
+	for (uint32_t i = 0; i < TEST_POWS; i += 1) {
+		random_below(a, n, rng);
+		random_bits(d, i == 3 ? mpz_sizeinbase(n, 2) : 1 + rand_ctx_range(rng, 0, 127), rng);
+		if (i == 1) {
+			mpz_add(a, a, n);
+		} else if (i == 2) {
+			mpz_sub_ui(a, n, 1);
+		}
+		mpz_powm(want, a, d, n);
+		mont_pow_mod(got, a, d, &ctx);
+		expect(mpz_cmp(got, want) == 0, "mont_pow_mod", n);
+		mont_pow_mod_window(got, a, d, &ctx, 1 + i % MONT_MAX_WINDOW);
+		expect(mpz_cmp(got, want) == 0, "mont_pow_mod_window", n);
+	}
+	mpz_set_ui(d, 0);
+	mont_pow_mod(got, a, d, &ctx);
+	expect(mpz_cmp_ui(got, 1) == 0, "a zero exponent", n);
+
+	free(ap);
+	mpz_clears(a, b, d, got, want, rinv, NULL);
+	mont_clear(&ctx);
+}
+
+int main(void) {
+	rand_ctx rng;
+	rand_ctx_init(&rng, 2020);
+	mpz_t n;
+	mpz_init(n);
+	uint64_t kernels = 0;
+	for (uint32_t limbs = TEST_MIN_LIMBS; limbs <= TEST_MAX_LIMBS; limbs += 1) {
+		uint64_t bits = (uint64_t) limbs * GMP_NUMB_BITS;
+		mont_ctx probe;
+		mpz_setbit(n, bits - 1);
+		mpz_setbit(n, 0);
+		mont_init(&probe, n);
+		kernels += probe.mul != NULL;
+		mont_clear(&probe);
+		// near 2^k, where the carries run the longest: 2^k - small, 2^(k-1) + small, and top limbs all ones
+		for (uint64_t j = 1; j < 8; j += 2) {
+			mpz_set_ui(n, 0);
+			mpz_setbit(n, bits);
+			mpz_sub_ui(n, n, j);
+			check_modulus(n, &rng);
+			mpz_set_ui(n, j);
+			mpz_setbit(n, bits - 1);
+			check_modulus(n, &rng);
+		}
+		mpz_set_ui(n, 0);
+		mpz_setbit(n, bits);
+		mpz_sub_ui(n, n, 1);
+		mpz_t low;
+		mpz_init(low);
+		random_bits(low, bits / 2, &rng);
+		mpz_sub(n, n, low);
+		mpz_setbit(n, 0);
+		check_modulus(n, &rng);
+		mpz_clear(low);
+		for (uint32_t i = 0; i < TEST_RANDOM_MODULI; i += 1) {
+			random_bits(n, bits, &rng);
+			mpz_setbit(n, bits - 1 - i % 3);
+			mpz_setbit(n, 0);
+			check_modulus(n, &rng);
+		}
+	}
+	mpz_clear(n);
+	rand_ctx_clear(&rng);
+	if (failures > 0) {
+		fprintf(stderr, "monttest: %" PRIu64 " of %" PRIu64 " checks failed\n", failures, checks);
+		return 1;
+	}
+	fprintf(stderr, "monttest: %" PRIu64 " checks passed, %" PRIu64 " limb counts with fixed-size kernels\n", checks, kernels);
+	return 0;
+}
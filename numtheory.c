@@ -6,98 +6,165 @@
 #include <stdlib.h>
 #include <gmp.h>
 #include "randstate.h"
+#include "montgomery.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
 
-// Computes the gretest common divisor of two argumetns a and b
-// Saves the final value in the argument d
+// bits of the leading parts Lehmer's algorithm works on, so that a leading part plus a cofactor fits in an int64_t
+#define NT_LEHMER_BITS 62
+
+// state of a Lehmer gcd: the remainders r0 >= r1 and, for mod_inverse, their cofactors t0 and t1
+// x and y are scratch for the combinations, every number keeps its buffer from step to step
+typedef struct {
+	mpz_t r0;
+	mpz_t r1;
+	mpz_t t0;
+	mpz_t t1;
+	mpz_t x;
+	mpz_t y;
+	bool ext; // track the cofactors
+} nt_gcd_state;
+
+// o = a*x + b*y for single-word a and b
+static void nt_combine(mpz_t o, mpz_t x, int64_t a, mpz_t y, int64_t b) {
+	mpz_mul_si(o, x, a);
+	if (b >= 0) {
+		mpz_addmul_ui(o, y, (unsigned long) b);
+	} else {
+		mpz_submul_ui(o, y, (unsigned long) -b);
+	}
+}
+
+// runs Lehmer's algorithm until r1 is zero, r0 then holds the gcd
+// every round simulates as many Euclidean steps as the leading NT_LEHMER_BITS bits of r0 and r1 decide
+// (Knuth's Algorithm L), collects their quotients in a 2x2 matrix of words and applies it with four
+// single-word multiplications; a round that cannot decide one step does a full division instead
+static void nt_lehmer(nt_gcd_state *st) {
+	while (mpz_sgn(st->r1) != 0) {
+		uint64_t bits = mpz_sizeinbase(st->r0, 2);
+		uint64_t shift = bits > NT_LEHMER_BITS ? bits - NT_LEHMER_BITS : 0;
+		mpz_tdiv_q_2exp(st->x, st->r0, shift);
+		int64_t ah = (int64_t) mpz_get_ui(st->x);
+		mpz_tdiv_q_2exp(st->x, st->r1, shift);
+		int64_t bh = (int64_t) mpz_get_ui(st->x);
+		// (A B; C D) maps the leading parts of (r0, r1) to those after the simulated steps
+		int64_t A = 1, B = 0, C = 0, D = 1;
+		while (bh + C != 0 && bh + D != 0) {
+			// the quotient is certain once both ends of the range of possible leading parts agree
+			int64_t q = (ah + A) / (bh + C);
+			if (q != (ah + B) / (bh + D)) {
+				break;
+			}
+			int64_t t = A - q * C;
+			A = C;
+			C = t;
+			t = B - q * D;
+			B = D;
+			D = t;
+			t = ah - q * bh;
+			ah = bh;
+			bh = t;
+		}
+		if (B == 0) {
+			// not even one quotient was certain (r0 is much longer than r1): one full division step
+			mpz_tdiv_qr(st->x, st->y, st->r0, st->r1);
+			mpz_swap(st->r0, st->r1);
+			mpz_swap(st->r1, st->y);
+			if (st->ext) {
+				// (t0, t1) <- (t1, t0 - q*t1)
+				mpz_mul(st->y, st->x, st->t1);
+				mpz_sub(st->y, st->t0, st->y);
+				mpz_swap(st->t0, st->t1);
+				mpz_swap(st->t1, st->y);
+			}
+			continue;
+		}
+		// (r0, r1) <- (A*r0 + B*r1, C*r0 + D*r1), and the same for the cofactors
+		nt_combine(st->x, st->r0, A, st->r1, B);
+		nt_combine(st->y, st->r0, C, st->r1, D);
+		mpz_swap(st->r0, st->x);
+		mpz_swap(st->r1, st->y);
+		if (st->ext) {
+			nt_combine(st->x, st->t0, A, st->t1, B);
+			nt_combine(st->y, st->t0, C, st->t1, D);
+			mpz_swap(st->t0, st->x);
+			mpz_swap(st->t1, st->y);
+		}
+	}
+}
+
+// sets up the state for remainders of up to bits bits
+static void nt_gcd_init(nt_gcd_state *st, uint64_t bits, bool ext) {
+	st->ext = ext;
+	mpz_init2(st->r0, bits);
+	mpz_init2(st->r1, bits);
+	mpz_init2(st->x, bits + 64);
+	mpz_init2(st->y, bits + 64);
+	if (ext) {
+		mpz_init2(st->t0, bits);
+		mpz_init2(st->t1, bits);
+	}
+}
+
+static void nt_gcd_clear(nt_gcd_state *st) {
+	mpz_clears(st->r0, st->r1, st->x, st->y, NULL);
+	if (st->ext) {
+		mpz_clears(st->t0, st->t1, NULL);
+	}
+}
+
+// Computes the greatest common divisor of two arguments a and b with Lehmer's algorithm
+// Saves the final (nonnegative) value in the argument d
 void gcd(mpz_t d, mpz_t a, mpz_t b) {
-	mpz_t t; // initalizes a temp variable t
-	mpz_init(t);
-	// since the arguments are passed by reference, to not change the original values of the arguments, we copy them to local vars
-	mpz_t aa; // copies a to aa
-        mpz_init_set(aa,a);
- 	mpz_t bb; // copies b to bb
-        mpz_init_set(bb,b);
-
-	// the loop is used to find the greater number that can divide both numbers with zero reminder. Since bb represents the reminder, we run the code until it is equal to 0. We use the mod function to calculates the reminder of both vars.
-	while (mpz_sgn(bb)) {
-		mpz_set(t,bb);
-		mpz_mod(bb, aa, bb);
-		mpz_set(aa, t);
-	}
-	mpz_set(d, aa);
-	mpz_clear(t);
-	mpz_clear(aa);
-	mpz_clear(bb);
-}
-
-// Computes the inverse of arg a mod n.
-// Saves the value in the argument o
+	nt_gcd_state st;
+	nt_gcd_init(&st, mpz_sizeinbase(a, 2) > mpz_sizeinbase(b, 2) ? mpz_sizeinbase(a, 2) : mpz_sizeinbase(b, 2), false);
+	// the arguments are passed by reference, so work on copies with r0 >= r1
+	mpz_abs(st.r0, a);
+	mpz_abs(st.r1, b);
+	if (mpz_cmp(st.r0, st.r1) < 0) {
+		mpz_swap(st.r0, st.r1);
+	}
+	nt_lehmer(&st);
+	mpz_set(d, st.r0);
+	nt_gcd_clear(&st);
+}
+
+// Computes the inverse of arg a mod n with Lehmer's extended algorithm.
+// Saves the value in the argument o, or 0 if there is no inverse
 void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
-	// Since the variables are passed by reference, we create copies of each argument to not change their original values
-	mpz_t r;
-        mpz_init(r);
-	mpz_set(r, n); // r = n
-	mpz_t(rp);
-	mpz_init(rp);
-	mpz_set(rp, a); // rp = a
-	mpz_t t;
-        mpz_init(t); // t = 0
-	mpz_t tp; 
-        mpz_init(tp);
-	mpz_set_ui(tp,1); // t' = 1
-	mpz_t q;
-        mpz_init(q);
-	mpz_t temp_r;
-        mpz_init(temp_r);
-	mpz_t temp_rp;
-        mpz_init(temp_rp);
- 	mpz_t temp_t;
-        mpz_init(temp_t);
-        mpz_t temp_tp;
-        mpz_init(temp_tp);
-	mpz_t temp_1;
-        mpz_init(temp_1);
-
-	// Same concept as GCD, loop while the mod of two vars is not 0.
-	// Eventually, the numbers would reach the form: r*r' + t*t' = gcd(r,t)
-	while (mpz_sgn(rp)!=0) { 
-		// q = r/r'
-		mpz_fdiv_q(q,r,rp); 
-		
-		// define temp r and temp r'
-		mpz_set(temp_r, r); //temp r = r 
-		mpz_set(temp_rp, rp); // temp r' = r'
-		
-		// (r, r') <- (r', r-q*r')
-		mpz_set(r, temp_rp); // r = r'
-		// r' = temp_r-q*r'
-		mpz_mul(temp_1, q, temp_rp);
-		mpz_sub(rp, temp_r, temp_1);
-
-		// define temp t and t'
-                mpz_set(temp_t, t); // temp t = t
-                mpz_set(temp_tp, tp); // temp t' = t'
-		// (t, t') <- (t', t-q*t)
-		mpz_set(t, temp_tp); // t = t'
-		// t' = (temp_t-q)*t'
-                mpz_mul(temp_1, q, temp_tp); //  t' time q
-                mpz_sub(tp, temp_t, temp_1); // t' = t - temp2
-	}
-	// if there's no inverse, set o to 0
-	if (mpz_cmp_ui(r, 1) > 0) {
+	nt_gcd_state st;
+	nt_gcd_init(&st, mpz_sizeinbase(n, 2), true);
+	// r = n with t = 0 and r' = a mod n with t' = 1, so that every remainder r = t*a (mod n)
+	mpz_set(st.r0, n);
+	mpz_mod(st.r1, a, n);
+	mpz_set_ui(st.t0, 0);
+	mpz_set_ui(st.t1, 1);
+	nt_lehmer(&st);
+	// r is now gcd(a, n), and there is an inverse only if it is 1
+	if (mpz_cmp_ui(st.r0, 1) != 0) {
 		mpz_set_ui(o, 0);
-		return;
-	}
-	if (mpz_sgn(t)==-1) {
-		mpz_add(t, t, n);
+	} else {
+		if (mpz_sgn(st.t0) < 0) {
+			mpz_add(st.t0, st.t0, n);
+		}
+		mpz_set(o, st.t0);
 	}
-	mpz_set(o, t);
-	mpz_clears(r, temp_r,rp,temp_rp,t,temp_t,tp,temp_tp,q,temp_1,NULL);
+	nt_gcd_clear(&st);
 }
 
 // does modular exponentiation
 // at the end, o = a ^ d (mod n)
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+	// odd moduli (every RSA modulus and prime candidate) use Montgomery reduction
+	// callers doing many exponentiations under one modulus should keep a mont_ctx instead
+	if (mpz_odd_p(n) != 0 && mpz_cmp_ui(n, 1) > 0) {
+		mont_ctx ctx;
+		mont_init(&ctx, n);
+		mont_pow_mod(o, a, d, &ctx);
+		mont_clear(&ctx);
+		return;
+	}
 	// v=1
 	mpz_t v;
         mpz_init(v);
@@ -106,142 +173,513 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
 	mpz_t p;
         mpz_init(p);
         mpz_set(p, a);
-	// copy of d
-	mpz_t dd;
-        mpz_init(dd);
-        mpz_set(dd, d);
 	// copy of n
 	mpz_t nn;
         mpz_init(nn);
         mpz_set(nn, n);
-	// while d is greater than 0
-	while (mpz_sgn(dd) > 0) {
-		if (mpz_odd_p(dd) != 0) {
+	// read the bits of d in place instead of halving a copy of it
+	mp_bitcnt_t bits = mpz_sgn(d) > 0 ? mpz_sizeinbase(d, 2) : 0;
+	for (mp_bitcnt_t i = 0; i < bits; i += 1) {
+		if (mpz_tstbit(d, i) != 0) {
 			mpz_mul(v, v, p);
 			mpz_mod(v, v, nn);
 		}
-		mpz_mul(p, p, p);
-                mpz_mod(p, p, nn);
-		mpz_div_ui(dd,dd,2);
+		// the last square is never used
+		if (i + 1 < bits) {
+			mpz_mul(p, p, p);
+			mpz_mod(p, p, nn);
+		}
 	}
 	mpz_set(o, v);
-	mpz_clears(v,dd,nn,p,NULL);
+	mpz_clears(v,nn,p,NULL);
 }
 
-// use the Miller-Rabin primality testing to check if a number is prime
-bool is_prime(mpz_t n, uint64_t iters) {
-	extern gmp_randstate_t state;
-	// r = n-1
-	mpz_t r;
-        mpz_init(r);
-        mpz_sub_ui(r, n, 1);
-	// s = 0 
-	mpz_t s;
-        mpz_init(s);
-	// while r is even, divides it by 2 and add 1 to s
-	// end result: n-1 = 2^s*r
-	while (mpz_even_p(r) != 0) {
-		mpz_div_ui(r, r, 2);
-		mpz_add_ui(s,s,1);
-	}
-	mpz_t a;
-        mpz_init(a);
-        mpz_t temp;
-        mpz_init(temp);
-	for (uint64_t i=1; i<iters; i+=1) {
-		// special case when n=4 because the ranfe is from 2 to 2
-		if (mpz_cmp_ui(n, 4) > 0) {  
-			mpz_sub_ui(temp, n, 4);
-			mpz_urandomm(a, state, temp);
-			mpz_add_ui(a, a, 2);
-		}
-		else if (mpz_cmp_ui(n,4) == 0) {
-		//	mpz_set_ui(a, rand()%2);
-		//	mpz_add_ui(a,a,2);
-			mpz_set_ui(a,2);
-		}
-		else {
+// sets up a primality-test workspace for candidates of up to bits bits
+// every buffer is sized here, so the tests themselves do not allocate
+void prime_ws_init(prime_ws *ws, uint64_t bits) {
+	if (bits < 2) {
+		bits = 2;
+	}
+	ws->bits = bits;
+	mpz_t n;
+	mpz_init(n);
+	// any odd number of the largest size gives the context its final limb count
+	mpz_setbit(n, bits - 1);
+	mpz_setbit(n, 0);
+	mont_init(&ws->mont, n);
+	mpz_clear(n);
+	mp_size_t size = ws->mont.size;
+	ws->window = mont_window_bits(bits);
+	// pow scratch, then x and minus_one
+	ws->scratch = (mp_limb_t *) malloc((MONT_POW_SCRATCH(size, ws->window) + 2 * size) * sizeof(mp_limb_t));
+	ws->x = ws->scratch + MONT_POW_SCRATCH(size, ws->window);
+	ws->minus_one = ws->x + size;
+	mpz_init2(ws->n_minus_1, bits);
+	mpz_init2(ws->r, bits);
+	mpz_init2(ws->a, bits);
+	mpz_init2(ws->y, bits);
+	mpz_init2(ws->range, bits);
+	// the Lucas sequence values are products of two residues before they are reduced
+	mpz_init2(ws->lu, 2 * bits + 64);
+	mpz_init2(ws->lv, 2 * bits + 64);
+	mpz_init2(ws->lq, 2 * bits + 64);
+	mpz_init2(ws->lt, 2 * bits + 64);
+	mpz_init2(ws->lk, bits + 1);
+	ws->rounds = 0;
+	ws->lucas = 0;
+}
+
+// frees any memory used by a primality-test workspace
+void prime_ws_clear(prime_ws *ws) {
+	mont_clear(&ws->mont);
+	free(ws->scratch);
+	mpz_clears(ws->n_minus_1, ws->r, ws->a, ws->y, ws->range, NULL);
+	mpz_clears(ws->lu, ws->lv, ws->lq, ws->lt, ws->lk, NULL);
+}
+
+// one Miller-Rabin round with base a, n-1 = 2^s * r already in the workspace
+// returns false if a proves n composite
+static bool is_prime_round(uint64_t s, prime_ws *ws) {
+	const mont_ctx *ctx = &ws->mont;
+	mp_size_t size = ctx->size;
+	ws->rounds += 1;
+	// y = a^r (mod n); if it is 1 or n-1, a says nothing
+	mont_pow_mod_scratch(ws->y, ws->a, ws->r, ctx, ws->window, ws->scratch);
+	if (mpz_cmp_ui(ws->y, 1) == 0 || mpz_cmp(ws->y, ws->n_minus_1) == 0) {
+		return true;
+	}
+	// square in Montgomery form from here on, comparing against the Montgomery forms of 1 and n-1
+	mp_limb_t *x = ws->x;
+	mp_limb_t *tp = ws->scratch;
+	mp_size_t yn = mpz_size(ws->y);
+	mpn_copyi(x, mpz_limbs_read(ws->y), yn);
+	mpn_zero(x + yn, size - yn);
+	mont_mul(x, x, ctx->r2, ctx, tp);
+	for (uint64_t j = 1; j < s; j += 1) {
+		mont_mul(x, x, x, ctx, tp);
+		if (mpn_cmp(x, ctx->n, size) >= 0) {
+			mpn_sub_n(x, x, ctx->n, size);
+		}
+		// a nontrivial square root of 1
+		if (mpn_cmp(x, ctx->one, size) == 0) {
+			return false;
+		}
+		if (mpn_cmp(x, ws->minus_one, size) == 0) {
 			return true;
 		}
+	}
+	// never reached n-1
+	return false;
+}
 
-		mpz_t y;
-                mpz_init(y);
-		pow_mod(y, a, r, n);
-		mpz_t n_minus_1;
-		mpz_init(n_minus_1);
-		mpz_sub_ui(n_minus_1, n, 1);	
-		// checks that the power mod of a^r mod n is not equal to 1 or n-1
-		if (mpz_cmp_ui(y,1) != 0 & mpz_cmp(y, n_minus_1) != 0) {
-			mpz_t j;
-	                mpz_init(j);
-			mpz_set_ui(j, 1); // j =1
-			mpz_t s_minus_1;
-	                mpz_init(s_minus_1); 
-        	        mpz_sub_ui(s_minus_1, s, 1); // s-1
-			while (mpz_cmp(j, s_minus_1) <= 0 & mpz_cmp(y, n_minus_1) != 0) {
-				mpz_set_ui(temp,2);
-				pow_mod(y,y,temp,n); // power mod of y^2 mod n
-				if (mpz_cmp_ui(y,1) == 0) {
-					mpz_clears(s_minus_1,j,y,n_minus_1,r,s,a,temp,NULL);
-					return false;
-				}
-				mpz_add_ui(j,j,1);
-			}
-			// ensures y is not equak to n-1
-			if (mpz_cmp(y,n_minus_1) != 0) {
-				mpz_clears(s_minus_1,j,y,n_minus_1,r,s,a,temp,NULL);
-				return false;
-                        }
-			mpz_clear(s_minus_1);
-			mpz_clear(j);
-			
-		}
-		mpz_clear(y);
-		mpz_clear(n_minus_1);
-	}
-	mpz_clear(r);
-	mpz_clear(s);
-	mpz_clear(a);
-	mpz_clear(temp);
+// picks the number of Miller-Rabin rounds for a random candidate of the given size, with the thresholds of
+// OpenSSL's BN_prime_checks_for_size (worked out with the method of FIPS 186-4 appendix F.1):
+// a random composite survives with probability below 2^-128, and bigger candidates need fewer rounds
+// these are not the 2^-80 rounds of HAC table 4.4, which are fewer for every size
+uint64_t prime_rounds(uint64_t bits) {
+	if (bits >= 3747) {
+		return 3;
+	}
+	if (bits >= 1345) {
+		return 4;
+	}
+	if (bits >= 476) {
+		return 5;
+	}
+	if (bits >= 400) {
+		return 6;
+	}
+	if (bits >= 347) {
+		return 7;
+	}
+	if (bits >= 308) {
+		return 8;
+	}
+	if (bits >= 55) {
+		return 27;
+	}
+	return 34;
+}
+
+// loads an odd n >= 5 into the workspace: switches the Montgomery context and splits n-1 = 2^s * r
+// grows ws if n has more bits than it was set up for; returns s
+static uint64_t prime_ws_load(mpz_t n, prime_ws *ws) {
+	uint64_t bits = mpz_sizeinbase(n, 2);
+	if (bits > ws->bits) {
+		// the counters outlive the buffers
+		uint64_t rounds = ws->rounds;
+		uint64_t lucas = ws->lucas;
+		prime_ws_clear(ws);
+		prime_ws_init(ws, bits);
+		ws->rounds = rounds;
+		ws->lucas = lucas;
+	}
+	mont_reinit(&ws->mont, n);
+	mp_size_t size = ws->mont.size;
+	// Montgomery form of n-1 is n - (Montgomery form of 1)
+	mpn_sub_n(ws->minus_one, ws->mont.n, ws->mont.one, size);
+	// n-1 = 2^s * r with r odd
+	mpz_sub_ui(ws->n_minus_1, n, 1);
+	uint64_t s = mpz_scan1(ws->n_minus_1, 0);
+	mpz_tdiv_q_2exp(ws->r, ws->n_minus_1, s);
+	return s;
+}
+
+// use the Miller-Rabin primality testing to check if a number is prime
+// runs iters rounds with random bases from rng (0 picks the count with prime_rounds), using the buffers of ws
+bool is_prime_ws(mpz_t n, uint64_t iters, rand_ctx *rng, prime_ws *ws) {
+	// small and even numbers
+	if (mpz_cmp_ui(n, 4) < 0) {
+		return mpz_cmp_ui(n, 2) >= 0;
+	}
+	if (mpz_even_p(n) != 0) {
+		return false;
+	}
+	if (iters == 0) {
+		iters = prime_rounds(mpz_sizeinbase(n, 2));
+	}
+	uint64_t s = prime_ws_load(n, ws);
+	// bases come from [2, n-2]
+	mpz_sub_ui(ws->range, n, 3);
+	for (uint64_t i = 0; i < iters; i += 1) {
+		mpz_urandomm(ws->a, rng->state, ws->range);
+		mpz_add_ui(ws->a, ws->a, 2);
+		if (!is_prime_round(s, ws)) {
+			return false;
+		}
+	}
 	return true;
 }
 
-// generates random numbers and tests if they are prime
-// saves prime numbers with at least /bits/ bits long to p
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
-		mpz_t r;
-                mpz_init(r);
-		// while the number is not prime, generate a new number
-		while (1)  {
-			// range is from 2^(bits-1) to 2^bits-1
-			mpz_rrandomb(p,state,bits);
-			// prime testing: can't be even or divided by any other prime number
-			if (mpz_even_p(p) != 0) {
-				continue;
-		   	}
-			mpz_mod_ui(r, p, 5);
-			if (mpz_cmp_ui(r,0) == 0) {
+// halves x modulo the odd n, x must be in [0, n)
+static void lucas_half(mpz_t x, mpz_t n) {
+	if (mpz_odd_p(x) != 0) {
+		mpz_add(x, x, n);
+	}
+	mpz_tdiv_q_2exp(x, x, 1);
+}
+
+// strong Lucas probable prime test with Selfridge's parameters, for an odd n >= 5 that is not a square
+// returns false if n is certainly composite
+static bool is_lucas_prp(mpz_t n, prime_ws *ws) {
+	ws->lucas += 1;
+	// D is the first of 5, -7, 9, -11, ... with Jacobi symbol (D/n) = -1; P = 1, Q = (1-D)/4
+	long d = 5;
+	while (1) {
+		int j = mpz_si_kronecker(d, n);
+		if (j == -1) {
+			break;
+		}
+		// D shares a factor with n
+		if (j == 0 && mpz_cmpabs_ui(n, labs(d)) != 0) {
+			return false;
+		}
+		d = d > 0 ? -(d + 2) : -(d - 2);
+	}
+	long q = (1 - d) / 4;
+	// n+1 = 2^s * k with k odd
+	mpz_add_ui(ws->lk, n, 1);
+	uint64_t s = mpz_scan1(ws->lk, 0);
+	mpz_tdiv_q_2exp(ws->lk, ws->lk, s);
+	// walk the bits of k from the top: U_1 = 1, V_1 = P = 1, lq = Q^1
+	mpz_set_ui(ws->lu, 1);
+	mpz_set_ui(ws->lv, 1);
+	mpz_set_si(ws->lq, q);
+	mpz_mod(ws->lq, ws->lq, n);
+	for (uint64_t i = mpz_sizeinbase(ws->lk, 2) - 1; i > 0; i -= 1) {
+		// U_2m = U_m V_m, V_2m = V_m^2 - 2Q^m
+		mpz_mul(ws->lu, ws->lu, ws->lv);
+		mpz_mod(ws->lu, ws->lu, n);
+		mpz_mul(ws->lv, ws->lv, ws->lv);
+		mpz_submul_ui(ws->lv, ws->lq, 2);
+		mpz_mod(ws->lv, ws->lv, n);
+		mpz_mul(ws->lq, ws->lq, ws->lq);
+		mpz_mod(ws->lq, ws->lq, n);
+		if (mpz_tstbit(ws->lk, i - 1) != 0) {
+			// U_m+1 = (P U_m + V_m) / 2, V_m+1 = (D U_m + P V_m) / 2
+			mpz_add(ws->lt, ws->lu, ws->lv);
+			mpz_mul_si(ws->lu, ws->lu, d);
+			mpz_add(ws->lv, ws->lv, ws->lu);
+			mpz_mod(ws->lv, ws->lv, n);
+			mpz_mod(ws->lu, ws->lt, n);
+			lucas_half(ws->lu, n);
+			lucas_half(ws->lv, n);
+			mpz_mul_si(ws->lq, ws->lq, q);
+			mpz_mod(ws->lq, ws->lq, n);
+		}
+	}
+	// U_k = 0 or V_(k*2^r) = 0 for some r < s
+	if (mpz_sgn(ws->lu) == 0 || mpz_sgn(ws->lv) == 0) {
+		return true;
+	}
+	for (uint64_t r = 1; r < s; r += 1) {
+		mpz_mul(ws->lv, ws->lv, ws->lv);
+		mpz_submul_ui(ws->lv, ws->lq, 2);
+		mpz_mod(ws->lv, ws->lv, n);
+		if (mpz_sgn(ws->lv) == 0) {
+			return true;
+		}
+		mpz_mul(ws->lq, ws->lq, ws->lq);
+		mpz_mod(ws->lq, ws->lq, n);
+	}
+	return false;
+}
+
+// Baillie-PSW primality test: a strong test to base 2 followed by a strong Lucas test
+// no composite passing both is known; it needs no random bases, so it always gives the same answer
+bool is_prime_bpsw(mpz_t n, prime_ws *ws) {
+	// small and even numbers
+	if (mpz_cmp_ui(n, 4) < 0) {
+		return mpz_cmp_ui(n, 2) >= 0;
+	}
+	if (mpz_even_p(n) != 0) {
+		return false;
+	}
+	uint64_t s = prime_ws_load(n, ws);
+	mpz_set_ui(ws->a, 2);
+	if (!is_prime_round(s, ws)) {
+		return false;
+	}
+	// no D works for a square, and squares are never prime
+	if (mpz_perfect_square_p(n) != 0) {
+		return false;
+	}
+	return is_lucas_prp(n, ws);
+}
+
+// checks if n is prime with the chosen test, using the buffers of ws
+// iters and rng are only used by Miller-Rabin
+bool is_prime_test(mpz_t n, prime_test test, uint64_t iters, rand_ctx *rng, prime_ws *ws) {
+	if (test == PRIME_TEST_BPSW) {
+		return is_prime_bpsw(n, ws);
+	}
+	return is_prime_ws(n, iters, rng, ws);
+}
+
+// use the Miller-Rabin primality testing to check if a number is prime
+// the random bases are drawn from rng, so every thread can test with its own context
+// sets up a workspace for this one test; callers testing many candidates should keep a prime_ws
+bool is_prime(mpz_t n, uint64_t iters, rand_ctx *rng) {
+	prime_ws ws;
+	prime_ws_init(&ws, mpz_sizeinbase(n, 2));
+	bool prime = is_prime_ws(n, iters, rng, &ws);
+	prime_ws_clear(&ws);
+	return prime;
+}
+
+// the sieve uses every odd prime below this bound
+#define SIEVE_BOUND 65536
+// how far (in steps of 2) a search walks from one random start before drawing a new one
+#define SIEVE_SPAN (1 << 20)
+
+// odd primes below SIEVE_BOUND, built once by sieve_init
+static uint32_t sieve_primes[SIEVE_BOUND / 2];
+static uint32_t sieve_count = 0;
+static pthread_once_t sieve_once = PTHREAD_ONCE_INIT;
+
+// fills sieve_primes with the sieve of Eratosthenes
+static void sieve_init(void) {
+	uint8_t *composite = (uint8_t *) calloc(SIEVE_BOUND, 1);
+	for (uint32_t i = 3; i < SIEVE_BOUND; i += 2) {
+		if (composite[i]) {
+			continue;
+		}
+		sieve_primes[sieve_count] = i;
+		sieve_count += 1;
+		for (uint64_t j = (uint64_t) i * i; j < SIEVE_BOUND; j += 2 * i) {
+			composite[j] = 1;
+		}
+	}
+	free(composite);
+}
+
+// candidates (in steps of 2) in one chunk of the parallel search
+#define SIEVE_CHUNK 256
+
+// state shared by the workers of one parallel prime search
+// the candidates start, start+2, ... are cut into numbered chunks of SIEVE_CHUNK candidates
+// and the result is the first prime of the lowest numbered chunk that has one,
+// which does not depend on how many threads took part
+typedef struct {
+	pthread_mutex_t lock;
+	uint64_t bits;
+	uint64_t iters;
+	prime_test test;
+	mpz_t start;        // random odd start, read only while the workers run
+	uint32_t *residues; // residues of start modulo the sieve primes, read only
+	uint32_t count;     // sieve primes in use
+	rand_ctx rng;       // chunk k draws its Miller-Rabin bases from sub-stream k of rng
+	uint64_t next;      // next chunk to hand out
+	uint64_t end;       // chunks from here on lie past the top of the range
+	uint64_t best;      // lowest chunk known to hold a prime, UINT64_MAX if none yet
+	mpz_t prime;        // the prime found in chunk best
+	prime_stats stats;  // counters of every worker, added when the worker stops
+} prime_search;
+
+// returns true if a lower chunk than k already holds a prime, so k can be dropped
+static bool prime_search_beaten(prime_search *ps, uint64_t k) {
+	pthread_mutex_lock(&ps->lock);
+	bool beaten = ps->best < k;
+	pthread_mutex_unlock(&ps->lock);
+	return beaten;
+}
+
+// worker: takes chunks in order and tests their candidates until a lower chunk wins
+static void *prime_search_worker(void *arg) {
+	prime_search *ps = (prime_search *) arg;
+	uint32_t *r = (uint32_t *) malloc((ps->count + 1) * sizeof(uint32_t));
+	mpz_t candidate;
+	mpz_init2(candidate, ps->bits + 1);
+	// one workspace for every candidate this worker tests
+	prime_ws ws;
+	prime_ws_init(&ws, ps->bits);
+	uint64_t candidates = 0;
+	uint64_t sieved = 0;
+	uint64_t tested = 0;
+	while (1) {
+		pthread_mutex_lock(&ps->lock);
+		uint64_t k = ps->next;
+		ps->next += 1;
+		bool stop = k > ps->best || k >= ps->end;
+		pthread_mutex_unlock(&ps->lock);
+		if (stop) {
+			break;
+		}
+		// move the residues of start to the first candidate of chunk k
+		uint64_t offset = 2 * k * SIEVE_CHUNK;
+		for (uint32_t i = 0; i < ps->count; i += 1) {
+			r[i] = (ps->residues[i] + offset % sieve_primes[i]) % sieve_primes[i];
+		}
+		rand_ctx rs;
+		rand_ctx_sub(&rs, &ps->rng, k);
+		for (uint64_t step = 0; step < SIEVE_CHUNK; step += 1) {
+			uint32_t hit = 0;
+			for (uint32_t i = 0; i < ps->count; i += 1) {
+				uint32_t v = r[i];
+				hit |= v == 0;
+				v += 2;
+				r[i] = v >= sieve_primes[i] ? v - sieve_primes[i] : v;
+			}
+			if (hit) {
+				candidates += 1;
+				sieved += 1;
 				continue;
 			}
-			mpz_mod_ui(r,p,3); 
-			if (mpz_cmp_ui(r,0) == 0) {
-                                continue;
-                        }
-			mpz_mod_ui(r,p,7);
-                        if (mpz_cmp_ui(r,0) == 0) {
-                                continue;
-                        }
-			mpz_mod_ui(r,p,11);
-                        if (mpz_cmp_ui(r,0) == 0) {
-                                continue;
-                        }
-			// if number is prime, stop the loop
-			if (is_prime(p,iters) == true) {
+			mpz_add_ui(candidate, ps->start, offset + 2 * step);
+			// walked past the top of the range, so later chunks will not find anything either
+			if (mpz_sizeinbase(candidate, 2) != ps->bits) {
+				pthread_mutex_lock(&ps->lock);
+				if (k < ps->end) {
+					ps->end = k + 1;
+				}
+				pthread_mutex_unlock(&ps->lock);
 				break;
 			}
-
-		}      
-	mpz_clear(r);
+			// cancelled: a lower chunk already won
+			if (prime_search_beaten(ps, k)) {
+				break;
+			}
+			candidates += 1;
+			tested += 1;
+			if (is_prime_test(candidate, ps->test, ps->iters, &rs, &ws)) {
+				pthread_mutex_lock(&ps->lock);
+				if (k < ps->best) {
+					ps->best = k;
+					mpz_set(ps->prime, candidate);
+				}
+				pthread_mutex_unlock(&ps->lock);
+				break;
+			}
+		}
+		rand_ctx_clear(&rs);
+	}
+	pthread_mutex_lock(&ps->lock);
+	ps->stats.candidates += candidates;
+	ps->stats.sieved += sieved;
+	ps->stats.tested += tested;
+	ps->stats.rounds += ws.rounds;
+	ps->stats.lucas += ws.lucas;
+	pthread_mutex_unlock(&ps->lock);
+	prime_ws_clear(&ws);
+	mpz_clear(candidate);
+	free(r);
+	return NULL;
 }
 
+// generates random numbers and tests if they are prime
+// saves a prime of exactly /bits/ bits to p
+// one random odd start is walked upwards in steps of 2; its residues modulo the small primes
+// are computed once and then stepped along, so only candidates with no small factor reach the primality test
+// test picks Miller-Rabin (iters rounds, 0 to pick them from the size) or Baillie-PSW
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters, prime_test test, rand_ctx *rng) {
+	make_prime_mt(p, bits, iters, test, 1, rng, NULL);
+}
 
+// generates a prime of exactly /bits/ bits using threads concurrent workers
+// every random choice comes from rng and the sub-streams of contexts forked from it,
+// so the result never depends on the number of threads
+// if stats is not NULL, the counters of this search are added to it
+// (with several threads they include the chunks tested past the one that won)
+void make_prime_mt(mpz_t p, uint64_t bits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, prime_stats *stats) {
+	struct timespec begin;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	pthread_once(&sieve_once, sieve_init);
+	if (threads < 1) {
+		threads = 1;
+	}
+	prime_search ps;
+	pthread_mutex_init(&ps.lock, NULL);
+	ps.bits = bits;
+	ps.iters = iters;
+	ps.test = test;
+	memset(&ps.stats, 0, sizeof(ps.stats));
+	mpz_inits(ps.start, ps.prime, NULL);
+	// only sieve with primes below 2^(bits-1), so no candidate can be one of them
+	ps.count = 0;
+	while (ps.count < sieve_count && (bits > 17 || sieve_primes[ps.count] < ((uint64_t) 1 << (bits-1)))) {
+		ps.count += 1;
+	}
+	ps.residues = (uint32_t *) malloc((ps.count + 1) * sizeof(uint32_t));
+	pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	ps.best = UINT64_MAX;
+	// while no chunk held a prime, draw a new start
+	while (ps.best == UINT64_MAX) {
+		// range is from 2^(bits-1) to 2^bits-1, and candidates must be odd
+		mpz_rrandomb(ps.start, rng->state, bits);
+		mpz_setbit(ps.start, 0);
+		ps.stats.starts += 1;
+		// a fresh base per start, so two starts (or two searches on one rng) never share chunk sub-streams
+		// a sub-stream at a random index is as good as a fork and much cheaper to seed
+		rand_ctx_sub(&ps.rng, rng, rand_ctx_u64(rng));
+		ps.next = 0;
+		ps.end = SIEVE_SPAN / SIEVE_CHUNK;
+		for (uint32_t i = 0; i < ps.count; i += 1) {
+			ps.residues[i] = mpz_fdiv_ui(ps.start, sieve_primes[i]);
+		}
+		// the calling thread is one of the workers
+		for (uint32_t i = 1; i < threads; i += 1) {
+			pthread_create(&workers[i], NULL, prime_search_worker, &ps);
+		}
+		prime_search_worker(&ps);
+		for (uint32_t i = 1; i < threads; i += 1) {
+			pthread_join(workers[i], NULL);
+		}
+		rand_ctx_clear(&ps.rng);
+	}
+	mpz_set(p, ps.prime);
+	if (stats) {
+		struct timespec done;
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		stats->starts += ps.stats.starts;
+		stats->candidates += ps.stats.candidates;
+		stats->sieved += ps.stats.sieved;
+		stats->tested += ps.stats.tested;
+		stats->rounds += ps.stats.rounds;
+		stats->lucas += ps.stats.lucas;
+		stats->ns += (uint64_t) (done.tv_sec - begin.tv_sec) * 1000000000u + done.tv_nsec - begin.tv_nsec;
+	}
+	free(workers);
+	free(ps.residues);
+	mpz_clears(ps.start, ps.prime, NULL);
+	pthread_mutex_destroy(&ps.lock);
+}
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include "randstate.h"
+#include "montgomery.h"
 
 void gcd(mpz_t d, mpz_t a, mpz_t b);
 
@@ -11,6 +13,62 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n);
 
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 
-bool is_prime(mpz_t n, uint64_t iters);
+// the primality tests make_prime can run on its candidates
+// PRIME_TEST_MR runs Miller-Rabin rounds with random bases
+// PRIME_TEST_BPSW runs Baillie-PSW: a strong test to base 2 and a strong Lucas test
+typedef enum {
+	PRIME_TEST_MR,
+	PRIME_TEST_BPSW,
+} prime_test;
 
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+// reusable buffers for primality tests of candidates up to a given size
+// set up once with prime_ws_init and passed to every is_prime_ws call, so the tests do not allocate
+typedef struct {
+	uint64_t bits;        // largest candidate size the buffers hold
+	uint32_t window;      // sliding window width of the exponentiations
+	mont_ctx mont;        // switched to each candidate with mont_reinit
+	mp_limb_t *scratch;   // exponentiation scratch, also used by the squaring step
+	mp_limb_t *x;         // the value being squared, in Montgomery form
+	mp_limb_t *minus_one; // n-1 in Montgomery form
+	mpz_t n_minus_1;
+	mpz_t r;              // odd part of n-1
+	mpz_t a;              // base of the current round
+	mpz_t y;
+	mpz_t range;          // n-3, the number of possible bases
+	mpz_t lu;             // Lucas sequence U
+	mpz_t lv;             // Lucas sequence V
+	mpz_t lq;             // Q^k of the Lucas sequence
+	mpz_t lt;
+	mpz_t lk;             // odd part of n+1
+	uint64_t rounds;      // strong probable prime rounds run with this workspace
+	uint64_t lucas;       // strong Lucas tests run with this workspace
+} prime_ws;
+
+// counters of prime generation, added up by make_prime_mt when it is given a prime_stats
+typedef struct {
+	uint64_t starts;      // random starts drawn
+	uint64_t candidates;  // odd candidates walked over
+	uint64_t sieved;      // candidates rejected by trial division by the small primes
+	uint64_t tested;      // candidates that reached the primality test
+	uint64_t rounds;      // Miller-Rabin rounds run (Baillie-PSW runs one to base 2 per candidate)
+	uint64_t lucas;       // strong Lucas tests run by Baillie-PSW
+	uint64_t ns;          // wall time in nanoseconds
+} prime_stats;
+
+uint64_t prime_rounds(uint64_t bits);
+
+void prime_ws_init(prime_ws *ws, uint64_t bits);
+
+void prime_ws_clear(prime_ws *ws);
+
+bool is_prime_ws(mpz_t n, uint64_t iters, rand_ctx *rng, prime_ws *ws);
+
+bool is_prime_bpsw(mpz_t n, prime_ws *ws);
+
+bool is_prime_test(mpz_t n, prime_test test, uint64_t iters, rand_ctx *rng, prime_ws *ws);
+
+bool is_prime(mpz_t n, uint64_t iters, rand_ctx *rng);
+
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters, prime_test test, rand_ctx *rng);
+
+void make_prime_mt(mpz_t p, uint64_t bits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, prime_stats *stats);
@@ -0,0 +1,237 @@
+// implement primegen program: keeps a prime pool directory stocked so keygen -P does not have to search
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <gmp.h>
+#include "numtheory.h"
+#include "randstate.h"
+#include "primepool.h"
+#include "mempool.h"
+
+// most prime sizes one generator keeps stocked
+#define PRIMEGEN_MAX_SIZES 16
+
+// set by the signal handlers, read between two primes
+static volatile sig_atomic_t gen_stop = 0;
+
+static void on_stop(int sig) {
+	(void) sig;
+	gen_stop = 1;
+}
+
+void print_error(void) {
+	fprintf(stderr, "Usage: ./primegen [options]\n  ./primegen keeps a prime pool directory stocked with primes of the given sizes, for keygen -P.\n  Primes are taken out of the pool as keys are made, and the generator tops it up again.\n  Send SIGINT or SIGTERM to stop.\n    -d <pooldir>: Keep the pool in <pooldir>, created if missing. Default: primes\n    -b <bits>   : Comma-separated prime sizes, half the key size for two-prime keys. Default: 512,1024,1536,2048\n    -c <count>  : Keep <count> primes of every size. Default: 32\n    -i <iters>  : Run <iters> Miller-Rabin iterations for primality testing. Default: picked from the prime size\n    -p <test>   : Test primes with <test>: mr (Miller-Rabin) or bpsw (Baillie-PSW). Default: mr\n    -t <threads>: Search for each prime on <threads> threads. Default: 1\n    -w <ms>     : Check the pool every <ms> milliseconds once it is full. Default: 1000\n    -s <seed>   : Use <seed> as the random number seed. Default: read from /dev/urandom\n    -o          : Fill the pool once and exit instead of running in the background.\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
+}
+
+// a seed nobody else is using, so two generators never add the same primes
+// falls back to the time and process id if /dev/urandom cannot be read
+static uint64_t random_seed(void) {
+	uint64_t seed = 0;
+	FILE *urandom = fopen("/dev/urandom", "rb");
+	if (urandom == NULL || fread(&seed, sizeof(seed), 1, urandom) != 1) {
+		seed = ((uint64_t) time(NULL) << 20) ^ (uint64_t) getpid();
+	}
+	if (urandom != NULL) {
+		fclose(urandom);
+	}
+	return seed;
+}
+
+// sleeps for ms milliseconds, or until a signal arrives
+static void pause_ms(uint32_t ms) {
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long) (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv) {
+	int opt = 0; // used for getopt
+	// set default numbers
+	const char *pool_dir = "primes";
+	uint64_t sizes[PRIMEGEN_MAX_SIZES] = { 512, 1024, 1536, 2048 };
+	uint32_t size_count = 4;
+	uint64_t target = 32;
+	uint32_t iter = 0; // 0 picks the rounds from the size of each candidate
+	prime_test test = PRIME_TEST_MR;
+	uint32_t threads = 1;
+	uint32_t wait_ms = 1000;
+	uint64_t seed = 0;
+	bool seeded = false;
+	bool once = false;
+	uint32_t message = 0;
+	// GMP buffers come from per-thread pools, installed before the first number exists
+	mempool_install();
+
+	// gets user input and runs until processes all the commands
+	while ((opt = getopt(argc, argv, "d:b:c:i:p:t:w:s:ovh")) != -1) { //list of valid commands
+		// pool directory
+		if (opt == 'd') {
+			pool_dir = optarg;
+		}
+		// prime sizes
+		else if (opt == 'b') {
+			size_count = 0;
+			char *next = optarg;
+			while (*next != '\0') {
+				uint64_t bits = strtoull(next, &next, 10);
+				if (bits < PRIMEPOOL_MIN_BITS || bits > PRIMEPOOL_MAX_BITS || size_count == PRIMEGEN_MAX_SIZES || (*next != ',' && *next != '\0')) {
+					fprintf(stderr, "./primegen: Prime sizes must be up to %d comma-separated numbers of bits from %d to %d, not %s.\n", PRIMEGEN_MAX_SIZES, PRIMEPOOL_MIN_BITS, PRIMEPOOL_MAX_BITS, optarg);
+					print_error();
+					return 1;
+				}
+				sizes[size_count] = bits;
+				size_count += 1;
+				if (*next == ',') {
+					next += 1;
+				}
+			}
+			if (size_count == 0) {
+				print_error();
+				return 1;
+			}
+		}
+		// primes to keep of every size
+		else if (opt == 'c') {
+			target = strtoull(optarg, NULL, 10);
+			if (target < 1 || target > 1000000) {
+				fprintf(stderr, "./primegen: Number of primes must be 1-1000000, not %" PRIu64 ".\n", target);
+				print_error();
+				return 1;
+			}
+		}
+		// number of iterations for testing primes
+		else if (opt == 'i') {
+			iter = strtoul(optarg, NULL, 10);
+			if (iter < 1 || iter > 500) {
+				fprintf(stderr, "./primegen: Number of iterations must be 1-500, not %u.\n", iter);
+				print_error();
+				return 1;
+			}
+		}
+		// primality test
+		else if (opt == 'p') {
+			if (strcmp(optarg, "mr") == 0) {
+				test = PRIME_TEST_MR;
+			} else if (strcmp(optarg, "bpsw") == 0) {
+				test = PRIME_TEST_BPSW;
+			} else {
+				fprintf(stderr, "./primegen: Primality test must be mr or bpsw, not %s.\n", optarg);
+				print_error();
+				return 1;
+			}
+		}
+		// number of prime search threads
+		else if (opt == 't') {
+			threads = strtoul(optarg, NULL, 10);
+			if (threads < 1 || threads > 128) {
+				fprintf(stderr, "./primegen: Number of threads must be 1-128, not %u.\n", threads);
+				print_error();
+				return 1;
+			}
+		}
+		// polling interval
+		else if (opt == 'w') {
+			wait_ms = strtoul(optarg, NULL, 10);
+			if (wait_ms < 1 || wait_ms > 3600000) {
+				fprintf(stderr, "./primegen: Interval must be 1-3600000 milliseconds, not %u.\n", wait_ms);
+				print_error();
+				return 1;
+			}
+		}
+		// set seed
+		else if (opt == 's') {
+			seed = strtoull(optarg, NULL, 10);
+			seeded = true;
+		}
+		// fill once
+		else if (opt == 'o') {
+			once = true;
+		}
+		// enables verbose
+		else if (opt == 'v') {
+			message = 1;
+		}
+		// usage message
+		else if (opt == 'h') {
+			print_error();
+			return 0;
+		}
+		// if it's not in the above options, return an error number
+		else {
+			print_error();
+			return 1;
+		}
+	}
+
+	if (mkdir(pool_dir, 0700) != 0 && errno != EEXIST) {
+		fprintf(stderr, "./primegen: Couldn't create pool directory %s\n", pool_dir);
+		return 1;
+	}
+	// a seed shared with another generator would put the same primes in the pool twice
+	rand_ctx rng;
+	rand_ctx_init(&rng, seeded ? seed : random_seed());
+
+	// no SA_RESTART, so a signal cuts a pause short
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	mpz_t p;
+	mpz_init(p);
+	prime_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	uint64_t added = 0;
+	int status = 0;
+	while (!gen_stop) {
+		// tops up the size with the fewest primes first, so a burst on one size is refilled soonest
+		uint32_t low = 0;
+		int64_t low_count = INT64_MAX;
+		for (uint32_t i = 0; i < size_count; i += 1) {
+			int64_t have = primepool_count(pool_dir, sizes[i]);
+			if (have < low_count) {
+				low = i;
+				low_count = have;
+			}
+		}
+		if (low_count >= (int64_t) target) {
+			if (once) {
+				break;
+			}
+			pause_ms(wait_ms);
+			continue;
+		}
+		make_prime_mt(p, sizes[low], iter, test, threads, &rng, &stats);
+		if (!primepool_add(pool_dir, p, sizes[low])) {
+			fprintf(stderr, "./primegen: Couldn't add a prime to %s\n", pool_dir);
+			status = 1;
+			break;
+		}
+		added += 1;
+		if (message == 1) {
+			fprintf(stderr, "primegen: %" PRIu64 "-bit prime added, %" PRId64 " in the pool\n", sizes[low], low_count + 1);
+		}
+	}
+
+	// verbose
+	if (message == 1) {
+		fprintf(stderr, "primegen: %" PRIu64 " primes added, %" PRIu64 " candidates tested, %.3f ms searching\n", added, stats.tested, stats.ns / 1e6);
+		mempool_stats pool;
+		mempool_get_stats(&pool);
+		fprintf(stderr, "allocator: %" PRIu64 " allocations, %" PRIu64 " served from the pool, %" PRIu64 " grown in place, %" PRIu64 " frees, %" PRIu64 " returned to malloc\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+	}
+	mpz_clear(p);
+	rand_ctx_clear(&rng);
+	return status;
+}
@@ -0,0 +1,138 @@
+// implements a prime pool: a directory of ready-made primes per size, shared between processes
+#include "primepool.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+// bytes of one line: the hex digits of a prime of the given size and the newline
+static size_t primepool_width(uint64_t bits) {
+	return (bits + 3) / 4 + 1;
+}
+
+// opens the file of one prime size and locks it, exclusive to change it or shared to count
+// returns -1 if it cannot be opened, e.g. it does not exist and create is false
+static int primepool_open(const char *dir, uint64_t bits, int flags, int lock) {
+	if (bits < PRIMEPOOL_MIN_BITS || bits > PRIMEPOOL_MAX_BITS) {
+		return -1;
+	}
+	char path[4096];
+	int len = snprintf(path, sizeof(path), "%s/%" PRIu64 "%s", dir, bits, PRIMEPOOL_EXT);
+	if (len <= 0 || (size_t) len >= sizeof(path)) {
+		return -1;
+	}
+	int fd = open(path, flags, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	if (flock(fd, lock) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// returns the number of whole lines in a locked file, or -1 if it cannot be read
+// with trim, a line cut short by a writer that died is cut off
+static int64_t primepool_lines(int fd, uint64_t bits, bool trim) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+	size_t width = primepool_width(bits);
+	int64_t lines = st.st_size / width;
+	if (trim && (size_t) st.st_size % width != 0 && ftruncate(fd, lines * width) != 0) {
+		return -1;
+	}
+	return lines;
+}
+
+// unlocks and closes a file from primepool_open
+static void primepool_close(int fd) {
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+// Counts the primes of one size in a pool.
+//
+// dir: the pool directory.
+// bits: the size of the primes.
+// returns: the number of primes, 0 if the pool has no file for that size.
+int64_t primepool_count(const char *dir, uint64_t bits) {
+	int fd = primepool_open(dir, bits, O_RDONLY, LOCK_SH);
+	if (fd < 0) {
+		return 0;
+	}
+	int64_t lines = primepool_lines(fd, bits, false);
+	primepool_close(fd);
+	return lines < 0 ? 0 : lines;
+}
+
+// Adds a prime to a pool, creating the file for its size if needed.
+// The prime is not checked; callers add primes they just found with make_prime.
+//
+// dir: the pool directory, which must exist.
+// p: the prime, with exactly bits bits.
+// bits: the size of the prime.
+// returns: true if the prime was added, false if it has the wrong size or the file could not be written.
+bool primepool_add(const char *dir, mpz_t p, uint64_t bits) {
+	if (mpz_sgn(p) <= 0 || mpz_sizeinbase(p, 2) != bits) {
+		return false;
+	}
+	int fd = primepool_open(dir, bits, O_RDWR | O_CREAT, LOCK_EX);
+	if (fd < 0) {
+		return false;
+	}
+	size_t width = primepool_width(bits);
+	char *line = (char *) malloc(width + 1);
+	mpz_get_str(line, 16, p);
+	line[width-1] = '\n';
+	// written at the end of the whole lines, over any line a dead writer left unfinished
+	int64_t lines = primepool_lines(fd, bits, true);
+	bool ok = lines >= 0 && pwrite(fd, line, width, lines * width) == (ssize_t) width;
+	free(line);
+	primepool_close(fd);
+	return ok;
+}
+
+// Takes a prime out of a pool.
+// The prime is cut off the file and the file is synced before the lock is released,
+// so no two callers, in this process or any other, ever get the same prime, even across a crash.
+// Damaged lines are dropped and skipped.
+//
+// dir: the pool directory.
+// p: will store the prime.
+// bits: the size of the prime.
+// returns: true if p was set, false if the pool has no prime of that size.
+bool primepool_take(const char *dir, mpz_t p, uint64_t bits) {
+	int fd = primepool_open(dir, bits, O_RDWR, LOCK_EX);
+	if (fd < 0) {
+		return false;
+	}
+	size_t width = primepool_width(bits);
+	char *line = (char *) malloc(width + 1);
+	int64_t lines = primepool_lines(fd, bits, true);
+	bool found = false;
+	while (!found && lines > 0) {
+		lines -= 1;
+		if (pread(fd, line, width, lines * width) != (ssize_t) width) {
+			break;
+		}
+		// the line is gone from the pool whether it holds a good prime or not
+		if (ftruncate(fd, lines * width) != 0 || fdatasync(fd) != 0) {
+			break;
+		}
+		line[width-1] = '\0';
+		found = mpz_set_str(p, line, 16) == 0 && mpz_sizeinbase(p, 2) == bits && mpz_odd_p(p);
+	}
+	free(line);
+	primepool_close(fd);
+	return found;
+}
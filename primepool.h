@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// a pool directory holds one file per prime size, <bits>.primes, locked with flock while it is used
+// every prime is a line of exactly ceil(bits/4) hex digits, so the last one can be read and cut off in place
+#define PRIMEPOOL_EXT ".primes"
+
+// smallest and largest prime size a pool holds
+#define PRIMEPOOL_MIN_BITS 16
+#define PRIMEPOOL_MAX_BITS 8192
+
+//
+// Counts the primes of one size in a pool.
+//
+// dir: the pool directory.
+// bits: the size of the primes.
+// returns: the number of primes, 0 if the pool has no file for that size.
+//
+int64_t primepool_count(const char *dir, uint64_t bits);
+
+//
+// Adds a prime to a pool, creating the file for its size if needed.
+// The prime is not checked; callers add primes they just found with make_prime.
+//
+// dir: the pool directory, which must exist.
+// p: the prime, with exactly bits bits.
+// bits: the size of the prime.
+// returns: true if the prime was added, false if it has the wrong size or the file could not be written.
+//
+bool primepool_add(const char *dir, mpz_t p, uint64_t bits);
+
+//
+// Takes a prime out of a pool.
+// The prime is cut off the file and the file is synced before the lock is released,
+// so no two callers, in this process or any other, ever get the same prime, even across a crash.
+// Damaged lines are dropped and skipped.
+//
+// dir: the pool directory.
+// p: will store the prime.
+// bits: the size of the prime.
+// returns: true if p was set, false if the pool has no prime of that size.
+//
+bool primepool_take(const char *dir, mpz_t p, uint64_t bits);
@@ -22,3 +22,82 @@ void randstate_init(uint64_t seed) {
 void randstate_clear(void) {
 	gmp_randclear(state); // free all memory used by state
 }
+
+// scrambles a 64-bit value (SplitMix64 finalizer), used to spread sub-stream seeds
+static uint64_t rand_mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+// Initializes a context (Mersenne Twister) from a seed.
+//
+// rng: the context to initialize.
+// seed: the seed.
+void rand_ctx_init(rand_ctx *rng, uint64_t seed) {
+	gmp_randinit_mt(rng->state);
+	gmp_randseed_ui(rng->state, seed);
+	rng->seed = seed;
+}
+
+// Frees any memory used by an initialized context.
+//
+// rng: the context to free.
+void rand_ctx_clear(rand_ctx *rng) {
+	gmp_randclear(rng->state);
+}
+
+// Initializes child as a new independent context seeded from the next output of parent.
+// Advances parent, so forking twice gives two different children.
+//
+// child: the context to initialize.
+// parent: the context to draw the seed from.
+void rand_ctx_fork(rand_ctx *child, rand_ctx *parent) {
+	rand_ctx_init(child, rand_ctx_u64(parent));
+}
+
+// Initializes child as sub-stream number index of parent.
+// Depends only on the seed of parent and on index, never on how far parent has advanced.
+//
+// child: the context to initialize.
+// parent: the context to derive from.
+// index: the number of the sub-stream.
+void rand_ctx_sub(rand_ctx *child, const rand_ctx *parent, uint64_t index) {
+	// seeding a Mersenne Twister costs about half a millisecond, a 128-bit LC generator is nearly free
+	gmp_randinit_lc_2exp_size(child->state, 128);
+	child->seed = rand_mix(parent->seed ^ rand_mix(index + 1));
+	gmp_randseed_ui(child->state, child->seed);
+}
+
+// Returns 64 uniformly random bits.
+//
+// rng: the context to draw from.
+uint64_t rand_ctx_u64(rand_ctx *rng) {
+	// unsigned long may be 32 bits, so draw two halves
+	uint64_t hi = gmp_urandomb_ui(rng->state, 32);
+	uint64_t lo = gmp_urandomb_ui(rng->state, 32);
+	return (hi << 32) | lo;
+}
+
+// Returns a uniformly random number in the range [lo, hi].
+//
+// rng: the context to draw from.
+// lo: the smallest possible value.
+// hi: the largest possible value.
+uint64_t rand_ctx_range(rand_ctx *rng, uint64_t lo, uint64_t hi) {
+	uint64_t span = hi - lo + 1;
+	if (span == 0) {
+		// the full 64-bit range
+		return rand_ctx_u64(rng);
+	}
+	// reject the top partial copy of the range so every value is equally likely
+	uint64_t limit = UINT64_MAX - UINT64_MAX % span;
+	uint64_t r = rand_ctx_u64(rng);
+	while (r >= limit) {
+		r = rand_ctx_u64(rng);
+	}
+	return lo + r % span;
+}
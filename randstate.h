@@ -18,3 +18,70 @@ void randstate_init(uint64_t seed);
 // Must be called after all key generation or number theory operations are used.
 //
 void randstate_clear(void);
+
+//
+// An explicit random number generator context.
+// Key generation and primality testing take one of these instead of using the global state,
+// so several key generations can run in one process at the same time.
+// A context must only be used by one thread at a time; threads get their own through
+// rand_ctx_fork or rand_ctx_sub, which keeps results reproducible from the seed alone.
+//
+// state: the GMP random state.
+// seed: the seed the context was made from, used to derive sub-streams.
+//
+typedef struct {
+	gmp_randstate_t state;
+	uint64_t seed;
+} rand_ctx;
+
+//
+// Initializes a context (Mersenne Twister) from a seed.
+//
+// rng: the context to initialize.
+// seed: the seed.
+//
+void rand_ctx_init(rand_ctx *rng, uint64_t seed);
+
+//
+// Frees any memory used by an initialized context.
+//
+// rng: the context to free.
+//
+void rand_ctx_clear(rand_ctx *rng);
+
+//
+// Initializes child as a new independent context seeded from the next output of parent.
+// Advances parent, so forking twice gives two different children.
+//
+// child: the context to initialize.
+// parent: the context to draw the seed from.
+//
+void rand_ctx_fork(rand_ctx *child, rand_ctx *parent);
+
+//
+// Initializes child as sub-stream number index of parent.
+// Depends only on the seed of parent and on index, never on how far parent has advanced,
+// so work item index gets the same numbers whichever thread runs it.
+// Sub-streams are cheap to make (linear congruential) and meant for short-lived work items.
+//
+// child: the context to initialize.
+// parent: the context to derive from.
+// index: the number of the sub-stream.
+//
+void rand_ctx_sub(rand_ctx *child, const rand_ctx *parent, uint64_t index);
+
+//
+// Returns 64 uniformly random bits.
+//
+// rng: the context to draw from.
+//
+uint64_t rand_ctx_u64(rand_ctx *rng);
+
+//
+// Returns a uniformly random number in the range [lo, hi].
+//
+// rng: the context to draw from.
+// lo: the smallest possible value.
+// hi: the largest possible value.
+//
+uint64_t rand_ctx_range(rand_ctx *rng, uint64_t lo, uint64_t hi);
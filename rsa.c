@@ -5,13 +5,23 @@
 #include <stdio.h>
 #include <gmp.h>
 #include "numtheory.h"
+#include "montgomery.h"
+#include "montsimd.h"
+#include "chacha.h"
 #include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Generates the components for a new public RSA key.
 // p and q will be large primes with n their product.
 // The product n will be of a specified minimum number of bits.
-// The primality is tested using Miller-Rabin.
+// The primality is tested using Miller-Rabin or Baillie-PSW.
 // The public exponent e will have around the same number of bits as n.
 // All mpz_t arguments are expected to be initialized.
 //
@@ -19,60 +29,277 @@
 // q: will store the second large prime.
 // n: will store the product of p and q.
 // e: will store the public exponent.
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
-	extern gmp_randstate_t state; // gets the random state
-	// assigns a specific number of bits to p and q
-	mpz_t p_bits;
-       	mpz_init(p_bits);
-	mpz_t n_bits;
-        mpz_init(n_bits);
-        mpz_t q_bits;
-        mpz_init(q_bits);
-	uint64_t size = mpz_sizeinbase(n,2);
-	while (size < nbits) { // log2(n) needs to >= than nbits
-		// generate a random number in the range (nbits/4 to 3nbits/4)
-		uint64_t rand = (random() % (3*nbits/4 + 1 - (nbits/4))) + (nbits/4);
-		mpz_set_ui(p_bits, rand);
-		mpz_set_ui(n_bits, nbits);
-		mpz_sub(q_bits, n_bits, p_bits);
-		// create two prime numbers p and q
-		make_prime(p, mpz_get_ui(p_bits), iters);
-		make_prime(q, mpz_get_ui(q_bits), iters);
-		mpz_mul(n,p,q); // calculates n
-		size = mpz_sizeinbase(n,2); // find log2(n)
-	}
-	// step 2: find the totient number of p and q
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// rng: the random context every random choice is drawn from.
+void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, rand_ctx *rng) {
+	rsa_make_pub_mt(p, q, n, e, nbits, iters, test, 1, rng, NULL);
+}
+
+// monotonic clock in nanoseconds, for the key generation timings
+static uint64_t rsa_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// arguments of a prime search run on its own thread
+typedef struct {
+	mpz_ptr p;
+	uint64_t bits;
+	uint64_t iters;
+	prime_test test;
+	uint32_t threads;
+	rand_ctx rng;
+	prime_stats *stats;
+} rsa_prime_job;
+
+// thread entry: runs one prime search on the job's own context
+static void *rsa_prime_job_run(void *arg) {
+	rsa_prime_job *job = (rsa_prime_job *) arg;
+	make_prime_mt(job->p, job->bits, job->iters, job->test, job->threads, &job->rng, job->stats);
+	return NULL;
+}
+
+// finds every prime at the same time, splitting the worker threads between the searches
+// all contexts are forked up front so the primes do not depend on which search finishes first
+// the counters of search i are added to stats[i] if it is not NULL
+static void rsa_make_primes_mt(mpz_ptr primes[], const uint64_t bits[], uint32_t count, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, prime_stats *stats[]) {
+	rsa_prime_job jobs[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		jobs[i].p = primes[i];
+		jobs[i].bits = bits[i];
+		jobs[i].iters = iters;
+		jobs[i].test = test;
+		// the first searches get the threads left over, and every search gets at least one
+		jobs[i].threads = threads / count + (i < threads % count ? 1 : 0);
+		if (jobs[i].threads < 1) {
+			jobs[i].threads = 1;
+		}
+		jobs[i].stats = stats[i];
+		rand_ctx_fork(&jobs[i].rng, rng);
+	}
+	if (threads < 2) {
+		for (uint32_t i = 0; i < count; i += 1) {
+			rsa_prime_job_run(&jobs[i]);
+		}
+	} else {
+		pthread_t others[RSA_MAX_PRIMES];
+		for (uint32_t i = 1; i < count; i += 1) {
+			pthread_create(&others[i], NULL, rsa_prime_job_run, &jobs[i]);
+		}
+		rsa_prime_job_run(&jobs[0]);
+		for (uint32_t i = 1; i < count; i += 1) {
+			pthread_join(others[i], NULL);
+		}
+	}
+	for (uint32_t i = 0; i < count; i += 1) {
+		rand_ctx_clear(&jobs[i].rng);
+	}
+}
+
+// makes the primes, n and e of a key with count prime factors, see rsa_make_pub_source
+static void rsa_make_pub_primes(mpz_ptr primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats, rsa_prime_source source, void *arg) {
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+	}
+	uint64_t begin = rsa_now_ns();
+	prime_stats *ps[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		ps[i] = stats == NULL ? NULL : i == 0 ? &stats->p : i == 1 ? &stats->q : &stats->r[i-2];
+	}
+	// assigns a specific number of bits to every prime
+	uint64_t bits[RSA_MAX_PRIMES];
+	// primes kept from the last attempt, so a retry does not throw away (or take from the source) every prime again
+	bool keep[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		keep[i] = false;
+	}
+	while (1) {
+		if (count == 2 && source == NULL) {
+			// p gets a random number of bits in the range (nbits/4 to 3nbits/4), q the rest
+			// the sizes change, so both primes are made again
+			bits[0] = rand_ctx_range(rng, nbits/4, 3*nbits/4);
+			bits[1] = nbits - bits[0];
+			keep[0] = false;
+			keep[1] = false;
+		} else {
+			// equal shares, the search starts have long runs of ones so n is rarely a bit short
+			for (uint32_t i = 0; i < count; i += 1) {
+				bits[i] = nbits / count + (i < nbits % count ? 1 : 0);
+			}
+		}
+		// the source goes first, every prime it cannot supply is searched for
+		mpz_ptr wanted[RSA_MAX_PRIMES];
+		uint64_t wanted_bits[RSA_MAX_PRIMES];
+		prime_stats *wanted_stats[RSA_MAX_PRIMES];
+		uint32_t missing = 0;
+		for (uint32_t i = 0; i < count; i += 1) {
+			if (keep[i]) {
+				continue;
+			}
+			if (source != NULL && source(primes[i], bits[i], arg)) {
+				if (stats) {
+					stats->sourced += 1;
+				}
+				continue;
+			}
+			wanted[missing] = primes[i];
+			wanted_bits[missing] = bits[i];
+			wanted_stats[missing] = ps[i];
+			missing += 1;
+		}
+		if (missing > 0) {
+			rsa_make_primes_mt(wanted, wanted_bits, missing, iters, test, threads, rng, wanted_stats);
+		}
+		// calculates n, the primes must all be different
+		bool distinct = true;
+		mpz_set(n, primes[0]);
+		for (uint32_t i = 1; i < count; i += 1) {
+			for (uint32_t j = 0; j < i; j += 1) {
+				distinct = distinct && mpz_cmp(primes[i], primes[j]) != 0;
+			}
+			mpz_mul(n, n, primes[i]);
+		}
+		if (distinct && mpz_sizeinbase(n,2) >= nbits) { // log2(n) needs to >= than nbits
+			break;
+		}
+		if (stats) {
+			stats->retries += 1;
+		}
+		// only one prime is made again: the later of two equal ones, or the smallest one when n is short
+		uint32_t redo = 0;
+		for (uint32_t i = 1; i < count; i += 1) {
+			bool repeated = false;
+			for (uint32_t j = 0; j < i; j += 1) {
+				repeated = repeated || mpz_cmp(primes[i], primes[j]) == 0;
+			}
+			if (repeated || (distinct && mpz_cmp(primes[i], primes[redo]) < 0)) {
+				redo = i;
+			}
+			if (repeated) {
+				break;
+			}
+		}
+		for (uint32_t i = 0; i < count; i += 1) {
+			keep[i] = i != redo;
+		}
+	}
+	uint64_t primes_done = rsa_now_ns();
+	// step 2: find lambda(n), the lcm of every prime minus one
 	mpz_t g;
 	mpz_init(g);
 	mpz_t p_1;
-        mpz_init(p_1);
-	mpz_sub_ui(p_1, p, 1); // p-1
-	mpz_t q_1;
-        mpz_init(q_1);
-        mpz_sub_ui(q_1, q, 1); // q-1
-	gcd(g, p_1, q_1); //gcd(p-1,q-1)
+	mpz_init(p_1);
 	mpz_t t;
 	mpz_init(t);
-	mpz_sub_ui(q_1, q, 1);
-	mpz_sub_ui(p_1, p, 1);
-	mpz_mul(t, p_1, q_1); // t(p-1,q-1) = (p-2)(q-2)
-	// computes lcm
-	mpz_div(t, t, g); // lcm(p-1, q-1)
+	mpz_sub_ui(t, primes[0], 1);
+	for (uint32_t i = 1; i < count; i += 1) {
+		mpz_sub_ui(p_1, primes[i], 1);
+		gcd(g, t, p_1);
+		// lcm(t, p-1) = t(p-1) / gcd(t, p-1)
+		mpz_mul(t, t, p_1);
+		mpz_divexact(t, t, g);
+	}
 
 	//part 3: find the public exponent.
-	// the public componenet needs to be coprime with the lcm of p-1 and q-1.
+	// the public componenet needs to be coprime with the lcm of the primes minus one.
 	// this means that the gcd of the public componenet and lcm needs to be equal to 1.
 	mpz_t gc;
         mpz_init(gc);
+	uint64_t attempts = 0;
 	while (1) { // while the gcd of public exponent and the totient(n) is not 1
-		mpz_urandomb(e, state, nbits); // get a random number for e
+		mpz_urandomb(e, rng->state, nbits); // get a random number for e
+		attempts += 1;
 		gcd(gc, e, t); // find the gcd
 		// e needs to be in the range (2, n)
 		if  (mpz_cmp_ui(e, 2) > 0 && (mpz_cmp(e, n) < 0) && mpz_cmp_ui(gc, 1) == 0) {
 			break;
 		}
 	}
-	mpz_clears(p_bits,q_bits,n_bits,p_1,q_1,g,t,gc,NULL);
+	if (stats) {
+		stats->e_attempts = attempts;
+		stats->primes_ns = primes_done - begin;
+		stats->e_ns = rsa_now_ns() - primes_done;
+	}
+	mpz_clears(p_1,g,t,gc,NULL);
+}
+
+//
+// Generates the components for a new public RSA key using several threads.
+// p and q are searched for at the same time, and each search tests candidates on several threads.
+// Same as rsa_make_pub otherwise; the key only depends on rng, not on the number of threads.
+//
+// p: will store the first large prime.
+// q: will store the second large prime.
+// n: will store the product of p and q.
+// e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// threads: the number of worker threads.
+// rng: the random context every random choice is drawn from.
+// stats: if not NULL, will store the counters and timings of this key generation.
+//
+void rsa_make_pub_mt(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats) {
+	mpz_ptr primes[2] = { p, q };
+	rsa_make_pub_primes(primes, 2, n, e, nbits, iters, test, threads, rng, stats, NULL, NULL);
+}
+
+//
+// Generates the components for a new public RSA key whose modulus has several prime factors.
+// The primes all have about nbits/count bits, so each search is much cheaper than for a two-prime key,
+// and they are searched for at the same time like p and q are by rsa_make_pub_mt.
+// n has exactly nbits bits: like p and q, the primes are drawn again in the rare case it comes out short.
+// With count 2 the key is the one rsa_make_pub_mt makes from the same rng.
+// All mpz_t arguments are expected to be initialized.
+//
+// primes: will store the count distinct primes, primes[0] and primes[1] being p and q.
+// count: the number of primes, 2 to RSA_MAX_PRIMES.
+// n: will store the product of the primes.
+// e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// threads: the number of worker threads.
+// rng: the random context every random choice is drawn from.
+// stats: if not NULL, will store the counters and timings of this key generation.
+//
+void rsa_make_pub_multi(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats) {
+	mpz_ptr ptrs[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		ptrs[i] = primes[i];
+	}
+	rsa_make_pub_primes(ptrs, count, n, e, nbits, iters, test, threads, rng, stats, NULL, NULL);
+}
+
+//
+// Generates the components for a new public RSA key, asking a prime source for each prime first.
+// Only the primes the source cannot supply are searched for, at the same time like rsa_make_pub_multi does.
+// Every prime gets an equal share of the bits, so a source only needs one prime size per key size.
+// When n comes out short or two primes are equal, only one prime is replaced, so a retry takes a single prime.
+// Same as rsa_make_pub_multi otherwise; with a NULL source it is rsa_make_pub_multi.
+// All mpz_t arguments are expected to be initialized.
+//
+// primes: will store the count distinct primes, primes[0] and primes[1] being p and q.
+// count: the number of primes, 2 to RSA_MAX_PRIMES.
+// n: will store the product of the primes.
+// e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// threads: the number of worker threads.
+// rng: the random context every random choice is drawn from.
+// stats: if not NULL, will store the counters and timings of this key generation.
+// source: the prime source, or NULL.
+// arg: passed on to source.
+//
+void rsa_make_pub_source(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats, rsa_prime_source source, void *arg) {
+	mpz_ptr ptrs[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		ptrs[i] = primes[i];
+	}
+	rsa_make_pub_primes(ptrs, count, n, e, nbits, iters, test, threads, rng, stats, source, arg);
 }
 
 //
@@ -167,6 +394,183 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
 	gmp_fscanf(pvfile, "%Zx\n%Zx\n", n,d);
 }
 
+//
+// Initializes every component of a private key (crt is set to false).
+//
+// key: the key to initialize.
+//
+void rsa_priv_key_init(rsa_priv_key *key) {
+	mpz_inits(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+	for (uint32_t i = 0; i < RSA_MAX_PRIMES-2; i += 1) {
+		mpz_inits(key->r[i], key->dr[i], key->tr[i], key->rprod[i], NULL);
+	}
+	key->crt = false;
+	key->primes = 2;
+}
+
+//
+// Frees any memory used by an initialized private key.
+//
+// key: the key to free.
+//
+void rsa_priv_key_clear(rsa_priv_key *key) {
+	mpz_clears(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+	for (uint32_t i = 0; i < RSA_MAX_PRIMES-2; i += 1) {
+		mpz_clears(key->r[i], key->dr[i], key->tr[i], key->rprod[i], NULL);
+	}
+	key->crt = false;
+	key->primes = 2;
+}
+
+// sets rprod from the primes of a multi-prime key: p*q, then p*q*r[0], ...
+static void rsa_priv_key_products(rsa_priv_key *key) {
+	for (uint32_t i = 0; i + 2 < key->primes; i += 1) {
+		if (i == 0) {
+			mpz_mul(key->rprod[i], key->p, key->q);
+		} else {
+			mpz_mul(key->rprod[i], key->rprod[i-1], key->r[i-1]);
+		}
+	}
+}
+
+// fills key from n, e and count distinct primes, primes[0] and primes[1] becoming p and q
+static void rsa_make_priv_primes(rsa_priv_key *key, mpz_t n, mpz_t e, mpz_srcptr primes[], uint32_t count) {
+	mpz_set(key->n, n);
+	mpz_set(key->p, primes[0]);
+	mpz_set(key->q, primes[1]);
+	key->primes = count;
+	// d = e^-1 mod phi(n), where phi(n) is the product of every prime minus one
+	mpz_t t;
+	mpz_init(t);
+	mpz_t p_1;
+	mpz_init(p_1);
+	mpz_sub_ui(t, primes[0], 1);
+	for (uint32_t i = 1; i < count; i += 1) {
+		mpz_sub_ui(p_1, primes[i], 1);
+		mpz_mul(t, t, p_1);
+	}
+	mod_inverse(key->d, e, t);
+	// dp = d mod (p-1), dq = d mod (q-1)
+	mpz_sub_ui(key->dp, key->p, 1);
+	mpz_mod(key->dp, key->d, key->dp);
+	mpz_sub_ui(key->dq, key->q, 1);
+	mpz_mod(key->dq, key->d, key->dq);
+	// qinv = q^-1 mod p
+	mod_inverse(key->qinv, key->q, key->p);
+	// every further prime r: dr = d mod (r-1), tr = (product of the primes before r)^-1 mod r
+	for (uint32_t i = 2; i < count; i += 1) {
+		mpz_set(key->r[i-2], primes[i]);
+	}
+	rsa_priv_key_products(key);
+	for (uint32_t i = 0; i + 2 < count; i += 1) {
+		mpz_sub_ui(key->dr[i], key->r[i], 1);
+		mpz_mod(key->dr[i], key->d, key->dr[i]);
+		mod_inverse(key->tr[i], key->rprod[i], key->r[i]);
+	}
+	key->crt = true;
+	mpz_clears(t, p_1, NULL);
+}
+
+//
+// Generates a full private key, including the CRT components.
+// All mpz_t arguments are expected to be initialized.
+//
+// key: will store the private key.
+// n: the public modulus.
+// e: the precomputed public exponent.
+// p: the first large prime from the public key generation.
+// q: the second large prime from the public key generation.
+//
+void rsa_make_priv_key(rsa_priv_key *key, mpz_t n, mpz_t e, mpz_t p, mpz_t q) {
+	mpz_srcptr primes[2] = { p, q };
+	rsa_make_priv_primes(key, n, e, primes, 2);
+}
+
+//
+// Generates a full private key for a multi-prime modulus, including the components of every prime.
+// All mpz_t arguments are expected to be initialized.
+//
+// key: will store the private key.
+// n: the public modulus.
+// e: the precomputed public exponent.
+// primes: the primes from rsa_make_pub_multi.
+// count: the number of primes, 2 to RSA_MAX_PRIMES.
+//
+void rsa_make_priv_key_multi(rsa_priv_key *key, mpz_t n, mpz_t e, mpz_t primes[], uint32_t count) {
+	mpz_srcptr ptrs[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		ptrs[i] = primes[i];
+	}
+	rsa_make_priv_primes(key, n, e, ptrs, count);
+}
+
+//
+// Writes a private key to a file.
+// Private key contents: n, d, and when the key has them p, q, dp, dq, qinv,
+// followed by r, dr, tr for every further prime of a multi-prime key.
+// The first two lines are the legacy format, so older readers still find n and d,
+// and readers that only know two primes fall back to d since p*q is not n.
+//
+// key: the private key.
+// pvfile: the file to write the private key to.
+//
+void rsa_write_priv_key(rsa_priv_key *key, FILE *pvfile) {
+	if (!key->crt) {
+		rsa_write_priv(key->n, key->d, pvfile);
+		return;
+	}
+	// ensure we are at the beginning of the file
+	fseek(pvfile,0,SEEK_SET);
+	gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv);
+	for (uint32_t i = 0; i + 2 < key->primes; i += 1) {
+		gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n", key->r[i], key->dr[i], key->tr[i]);
+	}
+}
+
+//
+// Reads a private key from a file.
+// Accepts the legacy (n, d), the extended CRT and the multi-prime format.
+// The CRT components are only used if the primes multiply to n.
+//
+// key: an initialized key that will store the private key.
+// pvfile: the file containing the private key.
+//
+void rsa_read_priv_key(rsa_priv_key *key, FILE *pvfile) {
+	rsa_read_priv(key->n, key->d, pvfile);
+	// legacy files end here
+	key->crt = false;
+	key->primes = 2;
+	if (gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", key->p, key->q, key->dp, key->dq, key->qinv) != 5) {
+		return;
+	}
+	// two-prime files end here, multi-prime ones go on with r, dr, tr per further prime
+	while (key->primes < RSA_MAX_PRIMES) {
+		uint32_t i = key->primes - 2;
+		if (gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", key->r[i], key->dr[i], key->tr[i]) != 3) {
+			break;
+		}
+		key->primes += 1;
+	}
+	// only trust the CRT components if the primes multiply to n and are all odd
+	bool ok = mpz_odd_p(key->p) && mpz_odd_p(key->q) && mpz_cmp_ui(key->p, 1) > 0 && mpz_cmp_ui(key->q, 1) > 0;
+	for (uint32_t i = 0; i + 2 < key->primes; i += 1) {
+		ok = ok && mpz_odd_p(key->r[i]) && mpz_cmp_ui(key->r[i], 1) > 0;
+	}
+	mpz_t t;
+	mpz_init(t);
+	mpz_mul(t, key->p, key->q);
+	for (uint32_t i = 0; i + 2 < key->primes; i += 1) {
+		mpz_mul(t, t, key->r[i]);
+	}
+	if (ok && mpz_cmp(t, key->n) == 0) {
+		rsa_priv_key_products(key);
+		key->crt = true;
+	} else {
+		key->primes = 2;
+	}
+	mpz_clear(t);
+}
+
 //
 // Encrypts a message given an RSA public exponent and modulus.
 // All mpz_t arguments are expected to be initialized.
@@ -180,44 +584,783 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
 	// c = m^e (mod n)
 	pow_mod(c,m, e,n);
 }
+// writes v to p as a big-endian number of the given width in bytes
+static void rsa_put_be(uint8_t *p, uint64_t v, uint32_t width) {
+	for (uint32_t i = width; i-- > 0;) {
+		p[i] = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+// reads a big-endian number of the given width in bytes from p
+static uint64_t rsa_get_be(const uint8_t *p, uint32_t width) {
+	uint64_t v = 0;
+	for (uint32_t i = 0; i < width; i += 1) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+// a file mapped into memory
+typedef struct {
+	uint8_t *data; // NULL if the file is not mapped
+	size_t len;
+} rsa_map;
+
+// maps a regular, non-empty input file for reading and hints that it will be read front to back
+// returns false for pipes, terminals, memory streams and empty files, which are read with stdio instead
+static bool rsa_map_input(rsa_map *m, FILE *f) {
+	m->data = NULL;
+	m->len = 0;
+	int fd = fileno(f);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return false;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	m->data = (uint8_t *) p;
+	m->len = st.st_size;
+	return true;
+}
+
+// sizes a regular output file to exactly len bytes and maps it for writing
+// returns false (with the file left as it was) if it cannot be mapped, e.g. a pipe or a file opened write-only
+static bool rsa_map_output(rsa_map *m, FILE *f, size_t len) {
+	m->data = NULL;
+	m->len = 0;
+	int fd = fileno(f);
+	struct stat st;
+	if (len == 0 || fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	fflush(f);
+	if (ftruncate(fd, len) != 0) {
+		return false;
+	}
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		if (ftruncate(fd, st.st_size) != 0) {
+			fprintf(stderr, "Couldn't restore the size of the output file\n");
+		}
+		return false;
+	}
+	madvise(p, len, MADV_SEQUENTIAL);
+	m->data = (uint8_t *) p;
+	m->len = len;
+	return true;
+}
+
+// unmaps a file; for an output mapping, out moves the stream position to the end of what was written
+static void rsa_unmap(rsa_map *m, FILE *out) {
+	if (m->data) {
+		munmap(m->data, m->len);
+		if (out) {
+			fseek(out, m->len, SEEK_SET);
+		}
+	}
+}
+
+// sends n bytes to the output: into the mapping at *pos if there is one, through stdio otherwise
+static void rsa_out_put(rsa_map *out, size_t *pos, FILE *f, const void *src, size_t n) {
+	if (out->data) {
+		memcpy(out->data + *pos, src, n);
+	} else {
+		fwrite(src, 1, n, f);
+	}
+	*pos += n;
+}
+
+// writes c as a hex line through a buffer of at least 2*width+2 characters
+// unlike gmp_fprintf this does not allocate the digits for every block
+static void rsa_put_hex(FILE *outfile, mpz_t c, char *hex) {
+	mpz_get_str(hex, 16, c);
+	size_t len = strlen(hex);
+	hex[len] = '\n';
+	fwrite(hex, 1, len+1, outfile);
+}
+
+// rsa_encrypt_file_ctx for an input mapped into memory
+// blocks are imported straight from the mapping, and the binary container is written
+// straight into a mapping of outfile when it is a regular file (its size is known up front)
+static void rsa_encrypt_mapped(const uint8_t *in, size_t len, FILE *outfile, mpz_t e, const mont_batch_ctx *ctx, bool binary) {
+	uint64_t bits = mpz_sizeinbase(ctx->scalar.modulus,2);
+	uint64_t k = (bits-1)/8;
+	uint64_t width = (bits+7)/8;
+	// like the stdio path, an input that ends on a block boundary is followed by one empty block
+	uint64_t blocks = len / (k-1) + 1;
+	rsa_map out;
+	if (!binary || !rsa_map_output(&out, outfile, RSA_BIN_HEADER + blocks * width)) {
+		out.data = NULL;
+	}
+	size_t pos = 0;
+	uint8_t *arr = (uint8_t *) malloc(width > RSA_BIN_HEADER ? width : RSA_BIN_HEADER);
+	if (binary) {
+		// the block count is known, so it goes in right away
+		memcpy(arr, RSA_BIN_MAGIC, 4);
+		arr[4] = RSA_BIN_VERSION;
+		arr[5] = arr[6] = arr[7] = 0;
+		rsa_put_be(arr+8, bits, 4);
+		rsa_put_be(arr+12, blocks, 8);
+		rsa_out_put(&out, &pos, outfile, arr, RSA_BIN_HEADER);
+	}
+	// the blocks and the exponentiation scratch are sized once, nothing is allocated per block
+	mont_batch_ws ws;
+	mont_batch_ws_init(&ws, ctx);
+	char *hex = binary ? NULL : (char *) malloc(2*width+2);
+	mpz_t m[MONT_BATCH_LANES];
+	mpz_ptr mp[MONT_BATCH_LANES];
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_init2(m[i], bits);
+		mp[i] = m[i];
+	}
+	for (uint64_t b = 0; b < blocks; b += MONT_BATCH_LANES) {
+		uint32_t count = blocks - b < MONT_BATCH_LANES ? blocks - b : MONT_BATCH_LANES;
+		for (uint32_t i = 0; i < count; i += 1) {
+			// up to k-1 bytes of the mapping with 0xFF put in front of them
+			uint64_t off = (b + i) * (k-1);
+			uint64_t j = len - off < k-1 ? len - off : k-1;
+			mpz_import(m[i], j, 1, 1, 1, 0, in + off);
+			for (uint32_t t = 0; t < 8; t += 1) {
+				mpz_setbit(m[i], 8*j + t);
+			}
+		}
+		// encrypt the blocks in place: c = m^e (mod n)
+		mont_batch_pow_mod_ws(mp, mp, count, e, ctx, &ws);
+		for (uint32_t i = 0; i < count; i += 1) {
+			if (!binary) {
+				rsa_put_hex(outfile, m[i], hex);
+				continue;
+			}
+			// right-align the bytes of c in a zeroed block, in place when the output is mapped
+			uint8_t *dst = out.data ? out.data + pos : arr;
+			size_t j = (mpz_sizeinbase(m[i],2)+7)/8;
+			memset(dst, 0, width);
+			if (mpz_sgn(m[i]) != 0) {
+				mpz_export(dst+width-j, &j, 1, 1, 1, 0, m[i]);
+			}
+			if (out.data) {
+				pos += width;
+			} else {
+				rsa_out_put(&out, &pos, outfile, arr, width);
+			}
+		}
+	}
+	rsa_unmap(&out, outfile);
+	free(arr);
+	mont_batch_ws_clear(&ws);
+	free(hex);
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_clear(m[i]);
+	}
+}
+
+// encrypts infile block by block, writing hex lines or the binary container
+static void rsa_encrypt_stream(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, bool binary) {
+	// the modulus is the same for every block, so precompute its Montgomery context once
+	mont_batch_ctx ctx;
+	mont_batch_init(&ctx, n);
+	rsa_encrypt_file_ctx(infile, outfile, e, &ctx, binary);
+	mont_batch_clear(&ctx);
+}
+
 //
-// Encrypts an entire file given an RSA public modulus and exponent.
+// Encrypts an entire file under a public key whose Montgomery context is already built.
+// Lets callers that encrypt many files under one key build the context once.
+// A regular input file is memory-mapped and its blocks are imported in place; with the binary
+// container a regular output file (opened for reading and writing) is mapped too. Pipes use stdio.
 // All mpz_t arguments are expected to be initialized.
 // All FILE * arguments are expected to be properly opened.
 //
 // infile: the input file to encrypt.
 // outfile: the output file to write the encrypted input to.
-// n: the public modulus.
 // e: the public exponent.
+// ctx: the batched Montgomery context of the public modulus.
+// binary: true to write the binary container (see RSA_BIN_MAGIC), false for hex text.
 //
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+void rsa_encrypt_file_ctx(FILE *infile, FILE *outfile, mpz_t e, const mont_batch_ctx *ctx, bool binary) {
 	//reset files
 	fseek(infile,0,SEEK_SET);
 	fseek(outfile,0,SEEK_SET);
+	// regular files are read through a memory mapping, pipes and streams through stdio
+	rsa_map in;
+	if (rsa_map_input(&in, infile)) {
+		rsa_encrypt_mapped(in.data, in.len, outfile, e, ctx, binary);
+		rsa_unmap(&in, NULL);
+		return;
+	}
 	// calculating the size of a block
-	uint64_t k = (mpz_sizeinbase(n,2)-1)/8;
+	uint64_t bits = mpz_sizeinbase(ctx->scalar.modulus,2);
+	uint64_t k = (bits-1)/8;
+	// binary blocks are wide enough for any value below n
+	uint64_t width = (bits+7)/8;
 	// dynamically allocate an array with the size of the block
-	uint8_t * arr = (uint8_t *) malloc(k);
+	uint8_t * arr = (uint8_t *) malloc(width > RSA_BIN_HEADER ? width : RSA_BIN_HEADER);
+	if (binary) {
+		// the block count is filled in at the end if outfile can seek back to it
+		memcpy(arr, RSA_BIN_MAGIC, 4);
+		arr[4] = RSA_BIN_VERSION;
+		arr[5] = arr[6] = arr[7] = 0;
+		rsa_put_be(arr+8, bits, 4);
+		rsa_put_be(arr+12, 0, 8);
+		fwrite(arr, 1, RSA_BIN_HEADER, outfile);
+	}
 	arr[0] = 0xFF;
 	//last step
-	mpz_t m;
-	mpz_init(m);
-	mpz_t c;
-	mpz_init(c);
+	// blocks are encrypted MONT_BATCH_LANES at a time, all under the same e and n
+	// the blocks and the exponentiation scratch are sized once, nothing is allocated per block
+	mont_batch_ws ws;
+	mont_batch_ws_init(&ws, ctx);
+	char *hex = binary ? NULL : (char *) malloc(2*width+2);
+	mpz_t m[MONT_BATCH_LANES];
+	mpz_ptr mp[MONT_BATCH_LANES];
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_init2(m[i], bits);
+		mp[i] = m[i];
+	}
+	uint64_t blocks = 0;
 	while (!feof(infile)) { // while there are more bytes in infile
-		// save to arr, k-1 bytes from infile, each element with size 1
-		uint64_t j  =  fread(arr+1, sizeof(arr[0]), k-1, infile);  //part 1
-		// convert the message from bytes to mpz 
-		mpz_import(m, j+1, 1, 1, 1, 0, arr); 
-		// encrypt the block
-		rsa_encrypt(c, m, e, n);
-		// write the encrypted message to outfile
-		gmp_fprintf(outfile, "%Zx\n", c);
+		uint32_t count = 0;
+		while (count < MONT_BATCH_LANES && !feof(infile)) {
+			// save to arr, k-1 bytes from infile, each element with size 1
+			arr[0] = 0xFF;
+			uint64_t j  =  fread(arr+1, sizeof(arr[0]), k-1, infile);  //part 1
+			// convert the message from bytes to mpz 
+			mpz_import(m[count], j+1, 1, 1, 1, 0, arr); 
+			count += 1;
+		}
+		// encrypt the blocks in place: c = m^e (mod n)
+		mont_batch_pow_mod_ws(mp, mp, count, e, ctx, &ws);
+		// write the encrypted messages to outfile
+		for (uint32_t i = 0; i < count; i += 1) {
+			if (binary) {
+				// right-align the bytes of c in a zeroed block
+				size_t j = (mpz_sizeinbase(m[i],2)+7)/8;
+				memset(arr, 0, width);
+				if (mpz_sgn(m[i]) != 0) {
+					mpz_export(arr+width-j, &j, 1, 1, 1, 0, m[i]);
+				}
+				fwrite(arr, 1, width, outfile);
+			} else {
+				rsa_put_hex(outfile, m[i], hex);
+			}
+		}
+		blocks += count;
+	}
+	// record the block count when the output is a regular file
+	// then return to the saved end, memory streams take their size from the position
+	long end = ftell(outfile);
+	if (binary && end >= 0 && fseek(outfile, 12, SEEK_SET) == 0) {
+		rsa_put_be(arr, blocks, 8);
+		fwrite(arr, 1, 8, outfile);
+		fseek(outfile, end, SEEK_SET);
 	}
 	// clear all variables
 	free(arr);
+	mont_batch_ws_clear(&ws);
+	free(hex);
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_clear(m[i]);
+	}
+}
+
+//
+// Encrypts an entire file given an RSA public modulus and exponent.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+//
+void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+	rsa_encrypt_stream(infile, outfile, n, e, false);
+}
+
+//
+// Encrypts an entire file given an RSA public modulus and exponent,
+// writing the compact binary container (see RSA_BIN_MAGIC) instead of hex text.
+// The decrypt functions detect this format on their own.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+//
+void rsa_encrypt_file_bin(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+	rsa_encrypt_stream(infile, outfile, n, e, true);
+}
+
+// fills buf with len bytes from the system random source
+static bool rsa_random_bytes(uint8_t *buf, size_t len) {
+	FILE *urandom = fopen("/dev/urandom", "rb");
+	if (!urandom) {
+		return false;
+	}
+	bool ok = fread(buf, 1, len, urandom) == len;
+	fclose(urandom);
+	return ok;
+}
+
+// nonce of hybrid record seq: 4 zero bytes and seq as 8 big-endian bytes
+static void rsa_hybrid_nonce(uint8_t nonce[CHACHA_NONCE_BYTES], uint64_t seq) {
+	memset(nonce, 0, 4);
+	rsa_put_be(nonce+4, seq, 8);
+}
+
+//
+// Encrypts an entire file in the hybrid container (see RSA_HYBRID_MAGIC).
+// A fresh random key is wrapped with RSA and the payload is encrypted and authenticated
+// with ChaCha20-Poly1305, so large files need a handful of exponentiations instead of one per block.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+// returns: false if no random key could be read from the system, true otherwise.
+//
+bool rsa_encrypt_file_hybrid(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+	uint8_t key[CHACHA_KEY_BYTES];
+	if (!rsa_random_bytes(key, sizeof(key))) {
+		fprintf(stderr, "Couldn't read a random key from /dev/urandom\n");
+		return false;
+	}
+	//reset files
+	fseek(infile,0,SEEK_SET);
+	fseek(outfile,0,SEEK_SET);
+	// the key is wrapped like plaintext: k-1 bytes after a 0xFF byte per block
+	uint64_t bits = mpz_sizeinbase(n,2);
+	uint64_t k = (bits-1)/8;
+	uint64_t width = (bits+7)/8;
+	uint64_t key_blocks = (sizeof(key) + k-2) / (k-1);
+	// a mapped input fixes the output size, so a regular output file is mapped as well
+	rsa_map in;
+	rsa_map out;
+	out.data = NULL;
+	if (rsa_map_input(&in, infile)) {
+		uint64_t records = (in.len + RSA_HYBRID_RECORD-1) / RSA_HYBRID_RECORD;
+		uint64_t total = RSA_BIN_HEADER + key_blocks * width + records * (4 + CHACHA_TAG_BYTES) + in.len;
+		if (!rsa_map_output(&out, outfile, total)) {
+			out.data = NULL;
+		}
+	}
+	size_t pos = 0;
+	uint8_t *arr = (uint8_t *) malloc(width > RSA_BIN_HEADER ? width : RSA_BIN_HEADER);
+	memcpy(arr, RSA_HYBRID_MAGIC, 4);
+	arr[4] = RSA_HYBRID_VERSION;
+	arr[5] = arr[6] = arr[7] = 0;
+	rsa_put_be(arr+8, bits, 4);
+	rsa_put_be(arr+12, key_blocks, 4);
+	rsa_put_be(arr+16, 0, 4);
+	rsa_out_put(&out, &pos, outfile, arr, RSA_BIN_HEADER);
+	mpz_t m;
+	mpz_init(m);
+	for (uint64_t i = 0; i < key_blocks; i += 1) {
+		uint64_t off = i * (k-1);
+		uint64_t len = sizeof(key) - off < k-1 ? sizeof(key) - off : k-1;
+		arr[0] = 0xFF;
+		memcpy(arr+1, key+off, len);
+		mpz_import(m, len+1, 1, 1, 1, 0, arr);
+		// c = m^e (mod n), right-aligned in a zeroed block
+		rsa_encrypt(m, m, e, n);
+		size_t j = (mpz_sizeinbase(m,2)+7)/8;
+		memset(arr, 0, width);
+		if (mpz_sgn(m) != 0) {
+			mpz_export(arr+width-j, &j, 1, 1, 1, 0, m);
+		}
+		rsa_out_put(&out, &pos, outfile, arr, width);
+	}
 	mpz_clear(m);
-	mpz_clear(c);
+	// the records: sealed from the input mapping into the output mapping when there are both,
+	// otherwise through one record buffer
+	uint8_t *buf = (uint8_t *) malloc(RSA_HYBRID_RECORD);
+	uint8_t head[4];
+	uint8_t nonce[CHACHA_NONCE_BYTES];
+	uint8_t tag[CHACHA_TAG_BYTES];
+	for (uint64_t seq = 0; ; seq += 1) {
+		size_t len;
+		bool last;
+		const uint8_t *src = buf;
+		if (in.data) {
+			size_t off = seq * RSA_HYBRID_RECORD;
+			len = in.len - off < RSA_HYBRID_RECORD ? in.len - off : RSA_HYBRID_RECORD;
+			last = off + len == in.len;
+			src = in.data + off;
+		} else {
+			len = fread(buf, 1, RSA_HYBRID_RECORD, infile);
+			// a full record is the last one only if nothing follows it
+			last = len < RSA_HYBRID_RECORD;
+			if (!last) {
+				int ch = getc(infile);
+				if (ch == EOF) {
+					last = true;
+				} else {
+					ungetc(ch, infile);
+				}
+			}
+		}
+		rsa_put_be(head, len | (last ? 0x80000000u : 0), 4);
+		rsa_hybrid_nonce(nonce, seq);
+		rsa_out_put(&out, &pos, outfile, head, sizeof(head));
+		if (out.data) {
+			chacha20_poly1305_seal(out.data+pos, out.data+pos+len, src, len, head, sizeof(head), key, nonce);
+			pos += len + CHACHA_TAG_BYTES;
+		} else {
+			chacha20_poly1305_seal(buf, tag, src, len, head, sizeof(head), key, nonce);
+			rsa_out_put(&out, &pos, outfile, buf, len);
+			rsa_out_put(&out, &pos, outfile, tag, sizeof(tag));
+		}
+		if (last) {
+			break;
+		}
+	}
+	rsa_unmap(&out, outfile);
+	rsa_unmap(&in, NULL);
+	memset(key, 0, sizeof(key));
+	free(buf);
+	free(arr);
+	return true;
+}
+
+// reads the ciphertext blocks of a file in either format
+typedef struct {
+	bool binary;        // the file is the binary container
+	bool hybrid;        // the file is the hybrid container, read with rsa_decrypt_hybrid instead
+	uint64_t width;     // bytes per binary block
+	uint64_t remaining; // binary blocks left, UINT64_MAX if the header has no count
+	uint8_t *buf;       // one binary block
+	rsa_map map;        // the whole file when it is a regular file, read in place instead of through stdio
+	size_t pos;         // read position in map
+	uint8_t *hex;       // bytes of the hex line being parsed from map
+	size_t hex_cap;
+} rsa_cipher_reader;
+
+// returns the next len bytes of infile: straight from the mapping, or read into buf
+// returns NULL if the file ends first
+static const uint8_t *rsa_cipher_take(rsa_cipher_reader *r, FILE *infile, uint8_t *buf, size_t len) {
+	if (r->map.data) {
+		if (r->map.len - r->pos < len) {
+			r->pos = r->map.len;
+			return NULL;
+		}
+		const uint8_t *p = r->map.data + r->pos;
+		r->pos += len;
+		return p;
+	}
+	return fread(buf, 1, len, infile) == len ? buf : NULL;
+}
+
+// value of a hex digit
+static uint8_t rsa_hex_value(uint8_t ch) {
+	if (ch <= '9') {
+		return ch - '0';
+	}
+	return (ch | 0x20) - 'a' + 10;
+}
+
+// parses the next hex line of a mapped file into c, returns false at the end of the ciphertext
+static bool rsa_cipher_hex(rsa_cipher_reader *r, mpz_t c) {
+	const uint8_t *p = r->map.data;
+	size_t i = r->pos;
+	while (i < r->map.len && isspace(p[i])) {
+		i += 1;
+	}
+	size_t start = i;
+	while (i < r->map.len && isxdigit(p[i])) {
+		i += 1;
+	}
+	r->pos = i;
+	size_t digits = i - start;
+	if (digits == 0) {
+		return false;
+	}
+	// two digits per byte, the first byte takes a single digit when the count is odd
+	size_t bytes = (digits+1)/2;
+	if (bytes > r->hex_cap) {
+		r->hex = (uint8_t *) realloc(r->hex, bytes);
+		r->hex_cap = bytes;
+	}
+	size_t d = start;
+	for (size_t b = 0; b < bytes; b += 1) {
+		uint8_t v = 0;
+		if (b > 0 || digits % 2 == 0) {
+			v = rsa_hex_value(p[d]) << 4;
+			d += 1;
+		}
+		r->hex[b] = v | rsa_hex_value(p[d]);
+		d += 1;
+	}
+	mpz_import(c, bytes, 1, 1, 1, 0, r->hex);
+	return true;
+}
+
+// detects the format of infile and reads the binary header if there is one
+// returns false (and prints why) if the header does not belong to the key modulus n
+static bool rsa_cipher_open(rsa_cipher_reader *r, FILE *infile, mpz_t n) {
+	uint64_t bits = mpz_sizeinbase(n,2);
+	r->binary = false;
+	r->hybrid = false;
+	r->width = (bits+7)/8;
+	r->remaining = UINT64_MAX;
+	r->buf = (uint8_t *) malloc(r->width > RSA_BIN_HEADER ? r->width : RSA_BIN_HEADER);
+	r->pos = 0;
+	r->hex = NULL;
+	r->hex_cap = 0;
+	// regular files are read in place through a memory mapping, pipes and streams through stdio
+	int ch = EOF;
+	if (rsa_map_input(&r->map, infile)) {
+		ch = r->map.data[0];
+	} else {
+		ch = getc(infile);
+		if (ch != EOF) {
+			ungetc(ch, infile);
+		}
+	}
+	// hex text starts with a hex digit, the container starts with the magic
+	if (ch == EOF || ch != RSA_BIN_MAGIC[0]) {
+		return true;
+	}
+	r->binary = true;
+	const uint8_t *head = rsa_cipher_take(r, infile, r->buf, RSA_BIN_HEADER);
+	if (head == NULL) {
+		fprintf(stderr, "Unsupported ciphertext format\n");
+		return false;
+	}
+	if (head != r->buf) {
+		memcpy(r->buf, head, RSA_BIN_HEADER);
+	}
+	// both containers share the header layout up to the modulus bits
+	r->hybrid = memcmp(r->buf, RSA_HYBRID_MAGIC, 4) == 0 && r->buf[4] == RSA_HYBRID_VERSION;
+	if (!r->hybrid && (memcmp(r->buf, RSA_BIN_MAGIC, 4) != 0 || r->buf[4] != RSA_BIN_VERSION)) {
+		fprintf(stderr, "Unsupported ciphertext format\n");
+		return false;
+	}
+	if (rsa_get_be(r->buf+8, 4) != bits) {
+		fprintf(stderr, "Ciphertext is for a %" PRIu64 "-bit modulus, the key has %" PRIu64 " bits\n", rsa_get_be(r->buf+8, 4), bits);
+		return false;
+	}
+	// for the hybrid container this is the number of wrapped key blocks
+	uint64_t count = r->hybrid ? rsa_get_be(r->buf+12, 4) : rsa_get_be(r->buf+12, 8);
+	if (count != 0) {
+		r->remaining = count;
+	}
+	return true;
+}
+
+// reads the next block into c, returns false at the end of the ciphertext
+static bool rsa_cipher_next(rsa_cipher_reader *r, FILE *infile, mpz_t c) {
+	if (!r->binary) {
+		if (r->map.data) {
+			return rsa_cipher_hex(r, c);
+		}
+		return gmp_fscanf(infile, "%Zx\n", c) != EOF;
+	}
+	const uint8_t *block = r->remaining == 0 ? NULL : rsa_cipher_take(r, infile, r->buf, r->width);
+	if (block == NULL) {
+		return false;
+	}
+	r->remaining -= 1;
+	mpz_import(c, r->width, 1, 1, 1, 0, block);
+	return true;
+}
+
+// frees the buffers of a reader and unmaps its file
+static void rsa_cipher_close(rsa_cipher_reader *r) {
+	rsa_unmap(&r->map, NULL);
+	free(r->hex);
+	free(r->buf);
+}
+
+// checks that a ciphertext block is a number below the modulus, like every block rsa_encrypt_file makes
+static bool rsa_cipher_valid(mpz_t c, mpz_t n) {
+	return mpz_sgn(c) >= 0 && mpz_cmp(c, n) < 0;
+}
+
+// writes the message bytes of a decrypted block, the up to k-1 bytes after the 0xFF byte in front of them
+// arr must hold (bits+7)/8 bytes, as much as any number below n takes
+// returns false if the block is not one rsa_encrypt_file made under this key
+static bool rsa_put_block(FILE *outfile, uint8_t *arr, uint64_t k, mpz_t m) {
+	size_t j = 0;
+	mpz_export(arr, &j, 1, 1, 1, 0, m);
+	// a lone 0xFF is the empty block that follows an input ending on a block boundary
+	if (j == 0 || arr[0] != 0xFF || j-1 > k-1) {
+		return false;
+	}
+	fwrite(arr+1, 1, j-1, outfile);
+	return true;
+}
+
+// returns prime i of a CRT key: p, q, then r[0], r[1]...
+static mpz_ptr rsa_key_prime(rsa_priv_key *key, uint32_t i) {
+	return i == 0 ? key->p : i == 1 ? key->q : key->r[i-2];
+}
+
+// one Garner recombination step: given acc = m mod prod and h = m mod prime,
+// sets out = m mod prod*prime, where coef = prod^-1 mod prime; h is overwritten
+static void rsa_garner_step(mpz_t out, mpz_t acc, mpz_t h, mpz_srcptr prime, mpz_srcptr coef, mpz_srcptr prod) {
+	// h = coef*(h-acc) (mod prime), out = acc + h*prod
+	mpz_sub(h, h, acc);
+	mpz_mul(h, h, coef);
+	mpz_mod(h, h, prime);
+	mpz_mul(h, h, prod);
+	mpz_add(out, acc, h);
+}
+
+// computes m = c^d (mod n) with the CRT components of key
+// ctx[i] is the Montgomery context of prime i, m1 and m2 are scratch values
+static void rsa_crt_pow(mpz_t m, mpz_t c, rsa_priv_key *key, const mont_ctx *ctx[], mpz_t m1, mpz_t m2) {
+	uint32_t extra = key->primes - 2;
+	// one small exponentiation per prime: m1 = c^dp (mod p), m2 = c^dq (mod q)
+	mont_pow_mod(m1, c, key->dp, ctx[0]);
+	mont_pow_mod(m2, c, key->dq, ctx[1]);
+	// Garner recombination: h = qinv*(m1-m2) (mod p), m = m2 + h*q
+	rsa_garner_step(extra == 0 ? m : m2, m2, m1, key->p, key->qinv, key->q);
+	// then every further prime r moves m2 from mod rprod to mod rprod*r
+	for (uint32_t i = 0; i < extra; i += 1) {
+		mont_pow_mod(m1, c, key->dr[i], ctx[i+2]);
+		rsa_garner_step(i+1 == extra ? m : m2, m2, m1, key->r[i], key->tr[i], key->rprod[i]);
+	}
+}
+
+// computes m = c^d (mod n) with whichever form of key is available
+static void rsa_priv_pow(mpz_t m, mpz_t c, rsa_priv_key *key) {
+	if (!key->crt) {
+		pow_mod(m, c, key->d, key->n);
+		return;
+	}
+	mont_ctx ctx[RSA_MAX_PRIMES];
+	const mont_ctx *cp[RSA_MAX_PRIMES];
+	for (uint32_t i = 0; i < key->primes; i += 1) {
+		mont_init(&ctx[i], rsa_key_prime(key, i));
+		cp[i] = &ctx[i];
+	}
+	mpz_t m1;
+	mpz_init(m1);
+	mpz_t m2;
+	mpz_init(m2);
+	rsa_crt_pow(m, c, key, cp, m1, m2);
+	mpz_clears(m1, m2, NULL);
+	for (uint32_t i = 0; i < key->primes; i += 1) {
+		mont_clear(&ctx[i]);
+	}
+}
+
+// scratch of the private key exponentiations, sized once per key and used by one thread at a time
+typedef struct {
+	mont_batch_ws wp;                    // for the context of p, or of n
+	mont_batch_ws wq[RSA_MAX_PRIMES-1];  // for the contexts of q and the further primes
+	mpz_t m1[MONT_BATCH_LANES];          // the residues mod p, then mod each further prime
+	mpz_t m2[MONT_BATCH_LANES];          // the residues mod q, then the recombined values
+	bool crt;
+	uint32_t primes;
+} rsa_priv_ws;
+
+// sizes the scratch for the contexts made by rsa_priv_batch_init
+static void rsa_priv_ws_init(rsa_priv_ws *ws, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq) {
+	ws->crt = key->crt;
+	ws->primes = key->primes;
+	mont_batch_ws_init(&ws->wp, cp);
+	if (!ws->crt) {
+		return;
+	}
+	for (uint32_t i = 0; i + 1 < ws->primes; i += 1) {
+		mont_batch_ws_init(&ws->wq[i], &cq[i]);
+	}
+	// room for the Garner products, which reach the size of n before the last reduction
+	uint64_t bits = mpz_sizeinbase(key->n, 2) + 2 * GMP_NUMB_BITS;
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_init2(ws->m1[i], bits);
+		mpz_init2(ws->m2[i], bits);
+	}
+}
+
+// frees the scratch made by rsa_priv_ws_init
+static void rsa_priv_ws_clear(rsa_priv_ws *ws) {
+	mont_batch_ws_clear(&ws->wp);
+	if (!ws->crt) {
+		return;
+	}
+	for (uint32_t i = 0; i + 1 < ws->primes; i += 1) {
+		mont_batch_ws_clear(&ws->wq[i]);
+	}
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_clears(ws->m1[i], ws->m2[i], NULL);
+	}
+}
+
+// computes m[i] = c[i]^d (mod n) for up to MONT_BATCH_LANES blocks in lockstep
+// with a CRT key cp is the context of p and cq those of q and the further primes, otherwise cp is the context of n
+// m[i] may alias c[i], and nothing is allocated as long as they have room for a number as long as n
+static void rsa_priv_pow_batch(mpz_ptr m[], mpz_ptr c[], uint32_t count, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq, rsa_priv_ws *ws) {
+	if (!key->crt) {
+		mont_batch_pow_mod_ws(m, c, count, key->d, cp, &ws->wp);
+		return;
+	}
+	uint32_t extra = key->primes - 2;
+	mpz_ptr m1p[MONT_BATCH_LANES];
+	mpz_ptr m2p[MONT_BATCH_LANES];
+	for (uint32_t i = 0; i < count; i += 1) {
+		m1p[i] = ws->m1[i];
+		m2p[i] = ws->m2[i];
+	}
+	// one small exponentiation per prime and block: m1 = c^dp (mod p), m2 = c^dq (mod q)
+	mont_batch_pow_mod_ws(m1p, c, count, key->dp, cp, &ws->wp);
+	mont_batch_pow_mod_ws(m2p, c, count, key->dq, &cq[0], &ws->wq[0]);
+	// Garner recombination: h = qinv*(m1-m2) (mod p), m = m2 + h*q
+	// c is still needed by the further primes, so m is only written by the last step
+	for (uint32_t i = 0; i < count; i += 1) {
+		rsa_garner_step(extra == 0 ? m[i] : m2p[i], m2p[i], m1p[i], key->p, key->qinv, key->q);
+	}
+	for (uint32_t j = 0; j < extra; j += 1) {
+		mont_batch_pow_mod_ws(m1p, c, count, key->dr[j], &cq[j+1], &ws->wq[j+1]);
+		for (uint32_t i = 0; i < count; i += 1) {
+			rsa_garner_step(j+1 == extra ? m[i] : m2p[i], m2p[i], m1p[i], key->r[j], key->tr[j], key->rprod[j]);
+		}
+	}
+}
+
+//
+// Initializes the batched Montgomery contexts decryption with key needs.
+// A CRT key gets contexts for p in cp and for q and the further primes in cq,
+// any other key one for n in cp (cq is then unused).
+//
+// key: the private key.
+// cp: the context of p, or of n.
+// cq: room for RSA_MAX_PRIMES-1 contexts, of q and then of r[0], r[1]...
+//
+void rsa_priv_batch_init(rsa_priv_key *key, mont_batch_ctx *cp, mont_batch_ctx *cq) {
+	if (key->crt) {
+		mont_batch_init(cp, key->p);
+		for (uint32_t i = 1; i < key->primes; i += 1) {
+			mont_batch_init(&cq[i-1], rsa_key_prime(key, i));
+		}
+	} else {
+		mont_batch_init(cp, key->n);
+	}
+}
+
+//
+// Frees the contexts made by rsa_priv_batch_init.
+//
+// key: the private key the contexts were made for.
+// cp: the context of p, or of n.
+// cq: the contexts of q and of the further primes.
+//
+void rsa_priv_batch_clear(rsa_priv_key *key, mont_batch_ctx *cp, mont_batch_ctx *cq) {
+	mont_batch_clear(cp);
+	if (key->crt) {
+		for (uint32_t i = 1; i < key->primes; i += 1) {
+			mont_batch_clear(&cq[i-1]);
+		}
+	}
 }
 
 //
@@ -233,6 +1376,21 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
 	// m = c^d (mod n)
 	pow_mod(m,c,d,n);
 }
+
+//
+// Decrypts some ciphertext given an RSA private key.
+// Uses CRT recombination when the key has the CRT components.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: will store the decrypted message.
+// c: the ciphertext to decrypt.
+// key: the private key.
+//
+void rsa_decrypt_key(mpz_t m, mpz_t c, rsa_priv_key *key) {
+	// m = c^d (mod n)
+	rsa_priv_pow(m, c, key);
+}
+
 //
 // Decrypts an entire file given an RSA public modulus and private key.
 // All mpz_t arguments are expected to be initialized.
@@ -242,39 +1400,413 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
 // outfile: the output file to write the decrypted input to.
 // n: the public modulus.
 // d: the private key.
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+	// a key without CRT components decrypts with the full-size exponent
+	rsa_priv_key key;
+	rsa_priv_key_init(&key);
+	mpz_set(key.n, n);
+	mpz_set(key.d, d);
+	bool ok = rsa_decrypt_file_key(infile, outfile, &key);
+	rsa_priv_key_clear(&key);
+	return ok;
+}
+
+//
+// Decrypts an entire file given an RSA private key.
+// Uses CRT recombination when the key has the CRT components.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file_key(FILE *infile, FILE *outfile, rsa_priv_key *key) {
+	// the moduli are the same for every block, so precompute their Montgomery contexts once
+	// a CRT key needs contexts for each of its primes, otherwise one for n
+	mont_batch_ctx cp;
+	mont_batch_ctx cq[RSA_MAX_PRIMES-1];
+	rsa_priv_batch_init(key, &cp, cq);
+	bool ok = rsa_decrypt_file_ctx(infile, outfile, key, &cp, cq);
+	rsa_priv_batch_clear(key, &cp, cq);
+	return ok;
+}
+
+// decrypts the rest of a hybrid container after rsa_cipher_open read its header:
+// unwraps the key from the RSA blocks, then checks and decrypts the records one at a time
+// returns false (and prints why) if the key or a record is damaged; records before it were already written
+static bool rsa_decrypt_hybrid(rsa_cipher_reader *r, FILE *infile, FILE *outfile, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq) {
+	uint8_t file_key[CHACHA_KEY_BYTES];
+	size_t have = 0;
+	bool ok = r->remaining != UINT64_MAX && r->remaining <= CHACHA_KEY_BYTES;
+	mpz_t c;
+	mpz_init(c);
+	mpz_ptr cb[1] = { c };
+	uint8_t *arr = (uint8_t *) malloc(r->width);
+	rsa_priv_ws ws;
+	rsa_priv_ws_init(&ws, key, cp, cq);
+	while (ok && r->remaining > 0 && rsa_cipher_next(r, infile, c)) {
+		ok = rsa_cipher_valid(c, key->n);
+		if (!ok) {
+			break;
+		}
+		// m = c^d (mod n), then drop the 0xFF byte in front of the key bytes
+		rsa_priv_pow_batch(cb, cb, 1, key, cp, cq, &ws);
+		size_t j = 0;
+		mpz_export(arr, &j, 1, 1, 1, 0, c);
+		ok = j >= 2 && arr[0] == 0xFF && have + j-1 <= sizeof(file_key);
+		if (ok) {
+			memcpy(file_key+have, arr+1, j-1);
+			have += j-1;
+		}
+	}
+	mpz_clear(c);
+	free(arr);
+	rsa_priv_ws_clear(&ws);
+	if (!ok || r->remaining != 0 || have != sizeof(file_key)) {
+		fprintf(stderr, "Couldn't unwrap the file key: the ciphertext is damaged or for another key\n");
+		return false;
+	}
+	uint8_t *buf = (uint8_t *) malloc(RSA_HYBRID_RECORD + CHACHA_TAG_BYTES);
+	uint8_t head[4];
+	uint8_t nonce[CHACHA_NONCE_BYTES];
+	for (uint64_t seq = 0; ; seq += 1) {
+		const uint8_t *field_bytes = rsa_cipher_take(r, infile, head, sizeof(head));
+		if (field_bytes == NULL) {
+			fprintf(stderr, "Ciphertext is cut off after %" PRIu64 " records\n", seq);
+			ok = false;
+			break;
+		}
+		// the stdio path already read it into head, and memcpy must not copy onto itself
+		if (field_bytes != head) {
+			memcpy(head, field_bytes, sizeof(head));
+		}
+		uint64_t field = rsa_get_be(head, 4);
+		bool last = (field & 0x80000000u) != 0;
+		size_t len = field & 0x7FFFFFFFu;
+		// straight from the mapping when there is one, decrypted into buf either way
+		const uint8_t *rec = len > RSA_HYBRID_RECORD ? NULL : rsa_cipher_take(r, infile, buf, len + CHACHA_TAG_BYTES);
+		if (rec == NULL) {
+			fprintf(stderr, "Ciphertext is cut off after %" PRIu64 " records\n", seq);
+			ok = false;
+			break;
+		}
+		rsa_hybrid_nonce(nonce, seq);
+		if (!chacha20_poly1305_open(buf, rec, len, rec+len, head, sizeof(head), file_key, nonce)) {
+			fprintf(stderr, "Ciphertext record %" PRIu64 " failed authentication\n", seq);
+			ok = false;
+			break;
+		}
+		fwrite(buf, 1, len, outfile);
+		if (last) {
+			break;
+		}
+	}
+	memset(file_key, 0, sizeof(file_key));
+	free(buf);
+	return ok;
+}
+
 //
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+// Decrypts an entire file given an RSA private key whose Montgomery contexts are already built
+// with rsa_priv_batch_init. Lets callers that decrypt many files under one key build them once.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// cp: the context of p, or of n for a key without CRT components.
+// cq: the contexts of q and of the further primes.
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file_ctx(FILE *infile, FILE *outfile, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq) {
 	//reset files
         fseek(infile,0,SEEK_SET);
         fseek(outfile,0,SEEK_SET);
 	// calculating the size of a block
-        uint64_t k = mpz_sizeinbase(n,2);
-        k = (k-1)/8;
-  	// dynamically allocate an array
-        uint8_t * arr = (uint8_t *) malloc(k);
-        //last step
-        mpz_t m;
-        mpz_init(m);
-        mpz_t c;
-        mpz_init(c);
-        while (gmp_fscanf(infile, "%Zx\n", c) != EOF) { // while there are more bytes in infile
-		// decrypt the message
-		rsa_decrypt(m, c, d, n);
-		// store the decrypted message in the array
-		size_t j = 0;
-		mpz_export(arr, &j, 1, 1, 1, 0, m);
-		// write j-1 of the bytes to outfile
-		fwrite(arr+1, 1, j-1, outfile);
-        }
+        uint64_t bits = mpz_sizeinbase(key->n,2);
+        uint64_t k = (bits-1)/8;
+  	// dynamically allocate an array, big enough for any number below n
+        uint8_t * arr = (uint8_t *) malloc((bits+7)/8);
+	// blocks are decrypted MONT_BATCH_LANES at a time, all under the same key
+	// the blocks and the exponentiation scratch are sized once, nothing is allocated per block
+	rsa_priv_ws ws;
+	rsa_priv_ws_init(&ws, key, cp, cq);
+	mpz_t c[MONT_BATCH_LANES];
+	mpz_ptr blocks[MONT_BATCH_LANES];
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_init2(c[i], mpz_sizeinbase(key->n,2));
+		blocks[i] = c[i];
+	}
+	// the blocks are hex lines or the binary container
+	rsa_cipher_reader reader;
+	bool ok = rsa_cipher_open(&reader, infile, key->n);
+	uint32_t count = ok ? 1 : 0;
+	// a hybrid container holds a wrapped key and records instead of RSA blocks
+	if (count > 0 && reader.hybrid) {
+		ok = rsa_decrypt_hybrid(&reader, infile, outfile, key, cp, cq);
+		count = 0;
+	}
+	uint64_t seq = 0;
+	while (count > 0) {
+		count = 0;
+		bool valid = true;
+		while (count < MONT_BATCH_LANES && rsa_cipher_next(&reader, infile, c[count])) { // while there are more bytes in infile
+			valid = rsa_cipher_valid(c[count], key->n);
+			if (!valid) {
+				break;
+			}
+			count += 1;
+		}
+		// decrypt the messages in place: m = c^d (mod n)
+		if (count > 0) {
+			rsa_priv_pow_batch(blocks, blocks, count, key, cp, cq, &ws);
+		}
+		for (uint32_t i = 0; ok && i < count; i += 1) {
+			// write the message bytes of the block to outfile
+			ok = rsa_put_block(outfile, arr, k, c[i]);
+			seq += ok ? 1 : 0;
+		}
+		ok = ok && valid;
+		if (!ok) {
+			fprintf(stderr, "Ciphertext block %" PRIu64 " is damaged or for another key\n", seq);
+			break;
+		}
+	}
 	
+	rsa_cipher_close(&reader);
         free(arr);
-	mpz_clear(m);
-	mpz_clear(c);
+	rsa_priv_ws_clear(&ws);
+	for (uint32_t i = 0; i < MONT_BATCH_LANES; i += 1) {
+		mpz_clear(c[i]);
+	}
+	return ok;
 }
 
+// one ciphertext block moving through the multi-threaded decrypt
+typedef struct {
+	mpz_t c;
+	mpz_t m;
+	bool done; // set by a worker once m holds the plaintext
+} rsa_mt_block;
+
+// state shared by the reader, the workers and the writer of rsa_decrypt_file_mt
+// blocks are numbered in file order and live in ring[seq % RSA_MT_WINDOW]
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	rsa_mt_block ring[RSA_MT_WINDOW];
+	uint64_t read;    // blocks parsed by the reader
+	uint64_t claimed; // blocks handed to workers
+	uint64_t written; // blocks written out
+	bool eof;         // the reader has reached the end of infile
+	bool failed;      // a block is damaged or for another key, everyone stops
+	uint64_t bad;     // the number of that block
+	FILE *infile;
+	rsa_cipher_reader reader;
+	rsa_priv_key *key;
+	mont_batch_ctx cp;
+	mont_batch_ctx cq[RSA_MAX_PRIMES-1];
+} rsa_mt_state;
+
+// reader thread: parses blocks into free ring slots, stalling while the ring is full
+static void *rsa_mt_reader(void *arg) {
+	rsa_mt_state *st = (rsa_mt_state *) arg;
+	uint64_t seq = 0;
+	// set before the thread started when the header was rejected
+	if (st->eof) {
+		return NULL;
+	}
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		while (seq - st->written >= RSA_MT_WINDOW && !st->failed) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+		if (st->failed) {
+			pthread_mutex_unlock(&st->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&st->lock);
+		// the slot is free, so only the reader touches it until read is bumped
+		rsa_mt_block *b = &st->ring[seq % RSA_MT_WINDOW];
+		bool more = rsa_cipher_next(&st->reader, st->infile, b->c);
+		bool valid = !more || rsa_cipher_valid(b->c, st->key->n);
+		pthread_mutex_lock(&st->lock);
+		if (!valid) {
+			// blocks already read are not written either, the first bad one is the one reported
+			if (!st->failed || seq < st->bad) {
+				st->bad = seq;
+			}
+			st->failed = true;
+			more = false;
+		} else if (more) {
+			b->done = false;
+			seq += 1;
+			st->read = seq;
+		} else {
+			st->eof = true;
+		}
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		if (!more) {
+			return NULL;
+		}
+	}
+}
+
+// worker thread: decrypts the oldest unclaimed blocks, up to MONT_BATCH_LANES at a time, until the reader is done
+static void *rsa_mt_worker(void *arg) {
+	rsa_mt_state *st = (rsa_mt_state *) arg;
+	// every worker sizes its own scratch once, the contexts themselves are shared
+	rsa_priv_ws ws;
+	rsa_priv_ws_init(&ws, st->key, &st->cp, st->cq);
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		while (st->claimed == st->read && !st->eof && !st->failed) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+		if (st->claimed == st->read || st->failed) {
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		// take every parsed block up to a full batch, they may wrap around the ring
+		rsa_mt_block *batch[MONT_BATCH_LANES];
+		mpz_ptr c[MONT_BATCH_LANES];
+		mpz_ptr m[MONT_BATCH_LANES];
+		uint32_t count = 0;
+		while (count < MONT_BATCH_LANES && st->claimed < st->read) {
+			batch[count] = &st->ring[st->claimed % RSA_MT_WINDOW];
+			c[count] = batch[count]->c;
+			m[count] = batch[count]->m;
+			st->claimed += 1;
+			count += 1;
+		}
+		pthread_mutex_unlock(&st->lock);
+		// m = c^d (mod n), the Montgomery contexts are only read so they are shared
+		rsa_priv_pow_batch(m, c, count, st->key, &st->cp, st->cq, &ws);
+		pthread_mutex_lock(&st->lock);
+		for (uint32_t i = 0; i < count; i += 1) {
+			batch[i]->done = true;
+		}
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+	}
+	rsa_priv_ws_clear(&ws);
+	return NULL;
+}
+
+//
+// Decrypts an entire file given an RSA private key, using a pool of worker threads.
+// One reader thread parses blocks, the workers decrypt them in any order,
+// and the calling thread writes them back out in their original order.
+// At most RSA_MT_WINDOW blocks are held in memory at a time.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// threads: the number of worker threads (1 falls back to rsa_decrypt_file_key).
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file_mt(FILE *infile, FILE *outfile, rsa_priv_key *key, uint32_t threads) {
+	if (threads <= 1) {
+		return rsa_decrypt_file_key(infile, outfile, key);
+	}
+	//reset files
+	fseek(infile,0,SEEK_SET);
+	fseek(outfile,0,SEEK_SET);
+	// calculating the size of a block, the array holds any number below n
+	uint64_t bits = mpz_sizeinbase(key->n,2);
+	uint64_t k = (bits-1)/8;
+	uint8_t * arr = (uint8_t *) malloc((bits+7)/8);
+
+	rsa_mt_state *st = (rsa_mt_state *) malloc(sizeof(rsa_mt_state));
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+	for (uint32_t i = 0; i < RSA_MT_WINDOW; i += 1) {
+		mpz_init2(st->ring[i].c, mpz_sizeinbase(key->n,2));
+		mpz_init2(st->ring[i].m, mpz_sizeinbase(key->n,2));
+		st->ring[i].done = false;
+	}
+	st->read = 0;
+	st->claimed = 0;
+	st->written = 0;
+	st->failed = false;
+	st->bad = 0;
+	st->infile = infile;
+	st->key = key;
+	// the blocks are hex lines or the binary container, a bad header leaves nothing to read
+	bool ok = rsa_cipher_open(&st->reader, infile, key->n);
+	st->eof = !ok;
+	// the moduli are the same for every block, so precompute their Montgomery contexts once
+	rsa_priv_batch_init(key, &st->cp, st->cq);
+	// a hybrid container is decrypted right here, it only has a few RSA blocks to spread out
+	if (!st->eof && st->reader.hybrid) {
+		ok = rsa_decrypt_hybrid(&st->reader, infile, outfile, key, &st->cp, st->cq);
+		st->eof = true;
+	}
+
+	pthread_t reader;
+	pthread_create(&reader, NULL, rsa_mt_reader, st);
+	pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	for (uint32_t i = 0; i < threads; i += 1) {
+		pthread_create(&workers[i], NULL, rsa_mt_worker, st);
+	}
+
+	// writer: wait for the next block in file order, then write it out
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		rsa_mt_block *b = &st->ring[st->written % RSA_MT_WINDOW];
+		while (!(st->written < st->read && b->done) && !(st->eof && st->written == st->read) && !st->failed) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+		if (st->written == st->read || st->failed) {
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		pthread_mutex_unlock(&st->lock);
+		// write the message bytes of the block to outfile
+		bool valid = rsa_put_block(outfile, arr, k, b->m);
+		pthread_mutex_lock(&st->lock);
+		if (!valid) {
+			st->bad = st->written;
+			st->failed = true;
+			pthread_cond_broadcast(&st->cond);
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		b->done = false;
+		st->written += 1;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	pthread_join(reader, NULL);
+	for (uint32_t i = 0; i < threads; i += 1) {
+		pthread_join(workers[i], NULL);
+	}
+	if (st->failed) {
+		fprintf(stderr, "Ciphertext block %" PRIu64 " is damaged or for another key\n", st->bad);
+		ok = false;
+	}
+	rsa_cipher_close(&st->reader);
+	rsa_priv_batch_clear(key, &st->cp, st->cq);
+	for (uint32_t i = 0; i < RSA_MT_WINDOW; i += 1) {
+		mpz_clears(st->ring[i].c, st->ring[i].m, NULL);
+	}
+	pthread_cond_destroy(&st->cond);
+	pthread_mutex_destroy(&st->lock);
+	free(workers);
+	free(st);
+	free(arr);
+	return ok;
+}
 
 //
 // Signs some message given an RSA private key and public modulus.
+// Builds the Montgomery context of n on every call, rsa_sign_ctx reuses one.
 // All mpz_t arguments are expected to be initialized.
 //
 // s: will store the signed message (the signature).
@@ -287,9 +1819,55 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
 	pow_mod(s, m, d,n);
 }
 
+//
+// Signs some message given an RSA private key.
+// Uses CRT recombination when the key has the CRT components.
+// Builds the Montgomery contexts of the key on every call, rsa_sign_ctx reuses them.
+// All mpz_t arguments are expected to be initialized.
+//
+// s: will store the signed message (the signature).
+// m: the message to sign.
+// key: the private key.
+//
+void rsa_sign_key(mpz_t s, mpz_t m, rsa_priv_key *key) {
+	// s = m^d (mod n)
+	rsa_priv_pow(s, m, key);
+}
+
+//
+// Signs some message given an RSA private key whose Montgomery contexts are already built
+// with rsa_priv_batch_init. Lets callers that sign many messages under one key build them once.
+// All mpz_t arguments are expected to be initialized.
+//
+// s: will store the signed message (the signature).
+// m: the message to sign.
+// key: the private key.
+// cp: the context of p, or of n for a key without CRT components.
+// cq: the contexts of q and of the further primes.
+//
+void rsa_sign_ctx(mpz_t s, mpz_t m, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq) {
+	// s = m^d (mod n)
+	if (!key->crt) {
+		mont_pow_mod(s, m, key->d, &cp->scalar);
+		return;
+	}
+	const mont_ctx *ctx[RSA_MAX_PRIMES];
+	ctx[0] = &cp->scalar;
+	for (uint32_t i = 1; i < key->primes; i += 1) {
+		ctx[i] = &cq[i-1].scalar;
+	}
+	mpz_t m1;
+	mpz_init(m1);
+	mpz_t m2;
+	mpz_init(m2);
+	rsa_crt_pow(s, m, key, ctx, m1, m2);
+	mpz_clears(m1, m2, NULL);
+}
+
 //
 // Verifies some signature given an RSA public exponent and modulus.
 // Requires the expected message for verification.
+// Builds the Montgomery context of n on every call, rsa_verify_ctx reuses one.
 // All mpz_t arguments are expected to be initialized.
 //
 // m: the expected message.
@@ -310,3 +1888,210 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
 	mpz_clear(t);
 	return false;
 }
+
+//
+// Verifies some signature given an RSA public exponent and the Montgomery context of the modulus.
+// Lets callers that verify many signatures under one key build the context once.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: the expected message.
+// s: the signature to verify.
+// e: the public exponent.
+// ctx: the batched Montgomery context of the public modulus.
+// returns: true if signature is verified, false otherwise.
+//
+bool rsa_verify_ctx(mpz_t m, mpz_t s, mpz_t e, const mont_batch_ctx *ctx) {
+	mpz_t t;
+	mpz_init(t);
+	// t = s^e (mod n)
+	mont_pow_mod(t, s, e, &ctx->scalar);
+	bool verified = mpz_cmp(t, m) == 0;
+	mpz_clear(t);
+	return verified;
+}
+
+// state of one rsa_verify_batch call
+// the signatures and messages are kept in Montgomery form, size limbs each
+typedef struct {
+	const mont_ctx *ctx;
+	mp_limb_t *sm;    // Montgomery form of every signature
+	mp_limb_t *mm;    // Montgomery form of every message
+	uint64_t *t;      // random exponents of the current screen
+	mp_limb_t *a;     // product of the signature powers
+	mp_limb_t *b;     // product of the message powers
+	mp_limb_t *unit;  // the plain number 1, used to leave Montgomery form
+	mp_limb_t *tp;    // product scratch, 2*size limbs
+	mpz_t x;
+	mpz_t y;
+	mpz_t *m;         // the pairs themselves, for the exact check of a single pair
+	mpz_t *s;
+	rand_ctx *rng;
+} rsa_batch;
+
+// stores x, which must be in [0, n), in Montgomery form as size limbs at rp
+static void rsa_batch_put(mp_limb_t *rp, mpz_t x, const mont_ctx *ctx, mp_limb_t *tp) {
+	mp_size_t xn = mpz_size(x);
+	mpn_copyi(rp, mpz_limbs_read(x), xn);
+	mpn_zero(rp + xn, ctx->size - xn);
+	mont_mul(rp, rp, ctx->r2, ctx, tp);
+}
+
+// copies size limbs into an mpz, fully reducing them modulo n first
+static void rsa_batch_get(mpz_t o, mp_limb_t *xp, const mont_ctx *ctx) {
+	if (mpn_cmp(xp, ctx->n, ctx->size) >= 0) {
+		mpn_sub_n(xp, xp, ctx->n, ctx->size);
+	}
+	mpn_copyi(mpz_limbs_write(o, ctx->size), xp, ctx->size);
+	mpz_limbs_finish(o, ctx->size);
+}
+
+// screens the pairs listed in idx[0..count-1] with fresh random exponents t_i:
+// checks (prod s_i^t_i)^e = prod m_i^t_i (mod n)
+// a single bad pair makes the check fail except with probability about 2^-RSA_BATCH_EXP_BITS
+// the t_i are odd: n - s, which anyone holding s can make, puts a factor (-1)^t_i on the signature side
+static bool rsa_batch_screen(rsa_batch *bt, uint64_t *idx, uint64_t count, mpz_t e) {
+	const mont_ctx *ctx = bt->ctx;
+	mp_size_t size = ctx->size;
+	for (uint64_t i = 0; i < count; i += 1) {
+		bt->t[i] = (rand_ctx_u64(bt->rng) >> (64 - RSA_BATCH_EXP_BITS)) | 1;
+	}
+	// both products walk the exponent bits together from the top, sharing the squarings
+	mpn_copyi(bt->a, ctx->one, size);
+	mpn_copyi(bt->b, ctx->one, size);
+	for (uint32_t bit = RSA_BATCH_EXP_BITS; bit > 0; bit -= 1) {
+		mont_mul(bt->a, bt->a, bt->a, ctx, bt->tp);
+		mont_mul(bt->b, bt->b, bt->b, ctx, bt->tp);
+		for (uint64_t i = 0; i < count; i += 1) {
+			if ((bt->t[i] >> (bit - 1)) & 1) {
+				mont_mul(bt->a, bt->a, bt->sm + idx[i] * size, ctx, bt->tp);
+				mont_mul(bt->b, bt->b, bt->mm + idx[i] * size, ctx, bt->tp);
+			}
+		}
+	}
+	// leave Montgomery form and raise the signature side to e
+	mont_mul(bt->a, bt->a, bt->unit, ctx, bt->tp);
+	mont_mul(bt->b, bt->b, bt->unit, ctx, bt->tp);
+	rsa_batch_get(bt->x, bt->a, ctx);
+	rsa_batch_get(bt->y, bt->b, ctx);
+	mont_pow_mod(bt->x, bt->x, e, ctx);
+	return mpz_cmp(bt->x, bt->y) == 0;
+}
+
+// marks every pair of idx[0..count-1] that passes as ok
+// a batch that fails the screen is cut in half until the bad pairs are isolated
+static void rsa_batch_find(rsa_batch *bt, uint64_t *idx, uint64_t count, mpz_t e, bool ok[]) {
+	if (count == 0) {
+		return;
+	}
+	// a single pair costs one full exponentiation either way, so it is checked exactly: s^e = m (mod n)
+	if (count == 1) {
+		mpz_mod(bt->x, bt->s[idx[0]], bt->ctx->modulus);
+		mont_pow_mod(bt->x, bt->x, e, bt->ctx);
+		ok[idx[0]] = mpz_cmp(bt->x, bt->m[idx[0]]) == 0;
+		return;
+	}
+	if (rsa_batch_screen(bt, idx, count, e)) {
+		for (uint64_t i = 0; i < count; i += 1) {
+			ok[idx[i]] = true;
+		}
+		return;
+	}
+	rsa_batch_find(bt, idx, count / 2, e, ok);
+	rsa_batch_find(bt, idx + count / 2, count - count / 2, e, ok);
+}
+
+//
+// Verifies many signatures under one RSA public key at once.
+// Screens the whole set with random small exponents, which costs one full exponentiation
+// plus a few multiplications per pair instead of one full exponentiation per pair.
+// A set that fails the screen is cut in half until the bad pairs are found, so a set
+// with few bad pairs still costs only a few full exponentiations, and a pair left on its own is checked exactly.
+// Like any small exponent screen, a bad signature passes with probability about 2^-RSA_BATCH_EXP_BITS,
+// or 1/2 when it is a good signature multiplied by a nontrivial square root of 1 modulo n (which takes the
+// factors of n to find). A negated good signature, n - s, which anyone holding s can make, would pass
+// whenever two of them are screened together, so the screen is only used when (-1|n) = -1: e is odd,
+// so every pair's Jacobi symbols must match, which rejects all of them. For the other keys (about half)
+// every pair is checked exactly, at the cost of one rsa_verify per pair.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: the expected messages.
+// s: the signatures to verify.
+// count: the number of (message, signature) pairs.
+// ok: will store for every pair true if its signature is verified, false otherwise.
+// e: the public exponent.
+// n: the public modulus.
+// rng: the random context the screening exponents are drawn from.
+// returns: the number of pairs that failed.
+//
+uint64_t rsa_verify_batch(mpz_t m[], mpz_t s[], uint64_t count, bool ok[], mpz_t e, mpz_t n, rand_ctx *rng) {
+	if (count == 0) {
+		return 0;
+	}
+	// an even modulus is never an RSA modulus, fall back to one check per pair
+	if (mpz_even_p(n) != 0 || mpz_cmp_ui(n, 1) <= 0) {
+		uint64_t failed = 0;
+		for (uint64_t i = 0; i < count; i += 1) {
+			ok[i] = rsa_verify(m[i], s[i], e, n);
+			failed += !ok[i];
+		}
+		return failed;
+	}
+	mont_ctx ctx;
+	mont_init(&ctx, n);
+	mp_size_t size = ctx.size;
+	rsa_batch bt;
+	bt.ctx = &ctx;
+	bt.m = m;
+	bt.s = s;
+	bt.rng = rng;
+	// signatures, messages, a, b, unit and the product scratch share one allocation
+	bt.sm = (mp_limb_t *) malloc((2 * count + 5) * size * sizeof(mp_limb_t));
+	bt.mm = bt.sm + count * size;
+	bt.a = bt.mm + count * size;
+	bt.b = bt.a + size;
+	bt.unit = bt.b + size;
+	bt.tp = bt.unit + size;
+	bt.t = (uint64_t *) malloc(count * sizeof(uint64_t));
+	uint64_t *idx = (uint64_t *) malloc(count * sizeof(uint64_t));
+	mpz_inits(bt.x, bt.y, NULL);
+	mpn_zero(bt.unit, size);
+	bt.unit[0] = 1;
+
+	// a message outside [0, n) can never match s^e (mod n), so it fails without screening
+	// e is odd, so s^e = m (mod n) gives (s|n) = (m|n): the Jacobi symbols are compared first,
+	// which catches n - s whenever (-1|n) = -1, however many of them a screen would see
+	uint64_t live = 0;
+	for (uint64_t i = 0; i < count; i += 1) {
+		ok[i] = false;
+		if (mpz_sgn(m[i]) < 0 || mpz_cmp(m[i], n) >= 0) {
+			continue;
+		}
+		mpz_mod(bt.x, s[i], n);
+		if (mpz_jacobi(bt.x, n) != mpz_jacobi(m[i], n)) {
+			continue;
+		}
+		rsa_batch_put(bt.sm + i * size, bt.x, &ctx, bt.tp);
+		rsa_batch_put(bt.mm + i * size, m[i], &ctx, bt.tp);
+		idx[live] = i;
+		live += 1;
+	}
+	// without (-1|n) = -1 the screens cannot tell s from n - s, so every pair is checked on its own
+	if (mpz_si_kronecker(-1, n) == -1) {
+		rsa_batch_find(&bt, idx, live, e, ok);
+	} else {
+		for (uint64_t i = 0; i < live; i += 1) {
+			rsa_batch_find(&bt, idx + i, 1, e, ok);
+		}
+	}
+
+	uint64_t failed = 0;
+	for (uint64_t i = 0; i < count; i += 1) {
+		failed += !ok[i];
+	}
+	mpz_clears(bt.x, bt.y, NULL);
+	free(idx);
+	free(bt.t);
+	free(bt.sm);
+	mont_clear(&ctx);
+	return failed;
+}
@@ -4,12 +4,106 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+#include "montsimd.h"
+
+// binary ciphertext container: a header followed by fixed-width big-endian blocks
+// header: magic (4 bytes), version (1 byte), 3 zero bytes, modulus bits (4 bytes, big-endian),
+//         block count (8 bytes, big-endian, 0 if it could not be recorded because the output was not seekable)
+// every block is exactly ceil(modulus bits / 8) bytes
+#define RSA_BIN_MAGIC "RSAB"
+#define RSA_BIN_VERSION 1
+#define RSA_BIN_HEADER 20
+
+// hybrid container: RSA wraps a random ChaCha20-Poly1305 key, which encrypts the payload
+// header (RSA_BIN_HEADER bytes): magic (4 bytes), version (1 byte), 3 zero bytes, modulus bits (4 bytes, big-endian),
+//         wrapped key blocks (4 bytes, big-endian), 4 zero bytes
+// the header is followed by the wrapped key blocks, each ceil(modulus bits / 8) bytes like binary blocks,
+// then by records: length (4 bytes, big-endian, top bit set on the last record), ciphertext, 16-byte tag
+// record i is sealed under nonce i (12 bytes, big-endian) with its length field as associated data,
+// so records cannot be reordered, dropped or cut off without decrypt noticing
+#define RSA_HYBRID_MAGIC "RSAH"
+#define RSA_HYBRID_VERSION 1
+
+// most plaintext bytes in one hybrid record
+#define RSA_HYBRID_RECORD 65536
+
+// number of blocks the multi-threaded decrypt keeps in flight
+#define RSA_MT_WINDOW 256
+
+// bits of the random exponents rsa_verify_batch screens signatures with
+#define RSA_BATCH_EXP_BITS 64
+
+// most prime factors a multi-prime modulus may have
+#define RSA_MAX_PRIMES 4
+
+//
+// An RSA private key.
+// Extended key files also hold the Chinese Remainder Theorem (CRT) components,
+// which let decryption and signing do two half-size exponentiations instead of one full-size one.
+// A multi-prime key has up to RSA_MAX_PRIMES-2 further primes r, each with its own exponent and
+// Garner coefficient (the other prime infos of RFC 8017), and does one exponentiation per prime.
+// Legacy key files only hold n and d, in which case crt is false and the other components are unused.
+//
+// n: the public modulus.
+// d: the private exponent.
+// crt: true if p, q, dp, dq and qinv are set.
+// primes: the number of prime factors of n when crt is true, 2 to RSA_MAX_PRIMES.
+// p: the first prime factor of n.
+// q: the second prime factor of n.
+// dp: d mod (p-1).
+// dq: d mod (q-1).
+// qinv: q^-1 mod p.
+// r: the further prime factors of n, primes-2 of them.
+// dr: d mod (r[i]-1).
+// tr: (p*q*r[0]*...*r[i-1])^-1 mod r[i].
+// rprod: p*q*r[0]*...*r[i-1], not stored in the key file but derived from the primes.
+//
+typedef struct {
+	mpz_t n;
+	mpz_t d;
+	bool crt;
+	uint32_t primes;
+	mpz_t p;
+	mpz_t q;
+	mpz_t dp;
+	mpz_t dq;
+	mpz_t qinv;
+	mpz_t r[RSA_MAX_PRIMES-2];
+	mpz_t dr[RSA_MAX_PRIMES-2];
+	mpz_t tr[RSA_MAX_PRIMES-2];
+	mpz_t rprod[RSA_MAX_PRIMES-2];
+} rsa_priv_key;
+
+//
+// Counters and timings of one key generation, filled by rsa_make_pub_mt when it is given one.
+//
+// p: the counters of the searches for p, summed over every retry.
+// q: the counters of the searches for q, summed over every retry.
+// r: the counters of the searches for the further primes of a multi-prime key, summed over every retry.
+// retries: how many times the primes were thrown away because n came out too small.
+// sourced: primes taken from a prime source instead of searched for (see rsa_make_pub_source).
+// e_attempts: random exponents drawn until one was coprime with lambda(n).
+// primes_ns: wall time spent finding p and q (both searches run at once with several threads).
+// e_ns: wall time spent finding e.
+//
+typedef struct {
+	prime_stats p;
+	prime_stats q;
+	prime_stats r[RSA_MAX_PRIMES-2];
+	uint64_t retries;
+	uint64_t sourced;
+	uint64_t e_attempts;
+	uint64_t primes_ns;
+	uint64_t e_ns;
+} rsa_keygen_stats;
 
 //
 // Generates the components for a new public RSA key.
 // p and q will be large primes with n their product.
 // The product n will be of a specified minimum number of bits.
-// The primality is tested using Miller-Rabin.
+// The primality is tested using Miller-Rabin or Baillie-PSW.
 // The public exponent e will have around the same number of bits as n.
 // All mpz_t arguments are expected to be initialized.
 //
@@ -17,8 +111,81 @@
 // q: will store the second large prime.
 // n: will store the product of p and q.
 // e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// rng: the random context every random choice is drawn from.
+//
+void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, rand_ctx *rng);
+
+//
+// Generates the components for a new public RSA key using several threads.
+// p and q are searched for at the same time, and each search tests candidates on several threads.
+// Same as rsa_make_pub otherwise; the key only depends on rng, not on the number of threads.
+//
+// p: will store the first large prime.
+// q: will store the second large prime.
+// n: will store the product of p and q.
+// e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// threads: the number of worker threads.
+// rng: the random context every random choice is drawn from.
+// stats: if not NULL, will store the counters and timings of this key generation.
 //
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
+void rsa_make_pub_mt(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats);
+
+//
+// Generates the components for a new public RSA key whose modulus has several prime factors.
+// The primes all have about nbits/count bits, so each search is much cheaper than for a two-prime key,
+// and they are searched for at the same time like p and q are by rsa_make_pub_mt.
+// n has exactly nbits bits: like p and q, the primes are drawn again in the rare case it comes out short.
+// With count 2 the key is the one rsa_make_pub_mt makes from the same rng.
+// All mpz_t arguments are expected to be initialized.
+//
+// primes: will store the count distinct primes, primes[0] and primes[1] being p and q.
+// count: the number of primes, 2 to RSA_MAX_PRIMES.
+// n: will store the product of the primes.
+// e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// threads: the number of worker threads.
+// rng: the random context every random choice is drawn from.
+// stats: if not NULL, will store the counters and timings of this key generation.
+//
+void rsa_make_pub_multi(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats);
+
+//
+// A source of ready-made primes for rsa_make_pub_source, such as a prime pool (see primepool.h).
+// It is only called from the thread that runs rsa_make_pub_source.
+//
+// p: will store a prime of exactly bits bits, never handed out before.
+// bits: the size of the prime.
+// arg: the argument given to rsa_make_pub_source.
+// returns: true if p was set, false to have the prime searched for instead.
+//
+typedef bool (*rsa_prime_source)(mpz_t p, uint64_t bits, void *arg);
+
+//
+// Generates the components for a new public RSA key, asking a prime source for each prime first.
+// Only the primes the source cannot supply are searched for, at the same time like rsa_make_pub_multi does.
+// Every prime gets an equal share of the bits, so a source only needs one prime size per key size.
+// When n comes out short or two primes are equal, only one prime is replaced, so a retry takes a single prime.
+// Same as rsa_make_pub_multi otherwise; with a NULL source it is rsa_make_pub_multi.
+// All mpz_t arguments are expected to be initialized.
+//
+// primes: will store the count distinct primes, primes[0] and primes[1] being p and q.
+// count: the number of primes, 2 to RSA_MAX_PRIMES.
+// n: will store the product of the primes.
+// e: will store the public exponent.
+// iters: the number of Miller-Rabin rounds per candidate, 0 to pick it from the candidate size.
+// test: the primality test.
+// threads: the number of worker threads.
+// rng: the random context every random choice is drawn from.
+// stats: if not NULL, will store the counters and timings of this key generation.
+// source: the prime source, or NULL.
+// arg: passed on to source.
+//
+void rsa_make_pub_source(mpz_t primes[], uint32_t count, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters, prime_test test, uint32_t threads, rand_ctx *rng, rsa_keygen_stats *stats, rsa_prime_source source, void *arg);
 
 //
 // Writes a public RSA key to a file.
@@ -77,6 +244,66 @@ void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 // d: will store the private key.
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+//
+// Initializes every component of a private key (crt is set to false).
+//
+// key: the key to initialize.
+//
+void rsa_priv_key_init(rsa_priv_key *key);
+
+//
+// Frees any memory used by an initialized private key.
+//
+// key: the key to free.
+//
+void rsa_priv_key_clear(rsa_priv_key *key);
+
+//
+// Generates a full private key, including the CRT components.
+// All mpz_t arguments are expected to be initialized.
+//
+// key: will store the private key.
+// n: the public modulus.
+// e: the precomputed public exponent.
+// p: the first large prime from the public key generation.
+// q: the second large prime from the public key generation.
+//
+void rsa_make_priv_key(rsa_priv_key *key, mpz_t n, mpz_t e, mpz_t p, mpz_t q);
+
+//
+// Generates a full private key for a multi-prime modulus, including the components of every prime.
+// All mpz_t arguments are expected to be initialized.
+//
+// key: will store the private key.
+// n: the public modulus.
+// e: the precomputed public exponent.
+// primes: the primes from rsa_make_pub_multi.
+// count: the number of primes, 2 to RSA_MAX_PRIMES.
+//
+void rsa_make_priv_key_multi(rsa_priv_key *key, mpz_t n, mpz_t e, mpz_t primes[], uint32_t count);
+
+//
+// Writes a private key to a file.
+// Private key contents: n, d, and when the key has them p, q, dp, dq, qinv,
+// followed by r, dr, tr for every further prime of a multi-prime key.
+// The first two lines are the legacy format, so older readers still find n and d,
+// and readers that only know two primes fall back to d since p*q is not n.
+//
+// key: the private key.
+// pvfile: the file to write the private key to.
+//
+void rsa_write_priv_key(rsa_priv_key *key, FILE *pvfile);
+
+//
+// Reads a private key from a file.
+// Accepts the legacy (n, d), the extended CRT and the multi-prime format.
+// The CRT components are only used if the primes multiply to n.
+//
+// key: an initialized key that will store the private key.
+// pvfile: the file containing the private key.
+//
+void rsa_read_priv_key(rsa_priv_key *key, FILE *pvfile);
+
 //
 // Encrypts a message given an RSA public exponent and modulus.
 // All mpz_t arguments are expected to be initialized.
@@ -100,6 +327,52 @@ void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 //
 void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
 
+//
+// Encrypts an entire file given an RSA public modulus and exponent,
+// writing the compact binary container (see RSA_BIN_MAGIC) instead of hex text.
+// The decrypt functions detect this format on their own.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+//
+void rsa_encrypt_file_bin(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+
+//
+// Encrypts an entire file in the hybrid container (see RSA_HYBRID_MAGIC).
+// A fresh random key is wrapped with RSA and the payload is encrypted and authenticated
+// with ChaCha20-Poly1305, so large files need a handful of exponentiations instead of one per block.
+// The decrypt functions detect this format on their own.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// n: the public modulus.
+// e: the public exponent.
+// returns: false if no random key could be read from the system, true otherwise.
+//
+bool rsa_encrypt_file_hybrid(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
+
+//
+// Encrypts an entire file under a public key whose Montgomery context is already built.
+// Lets callers that encrypt many files under one key build the context once.
+// A regular input file is memory-mapped and its blocks are imported in place; with the binary
+// container a regular output file (opened for reading and writing) is mapped too. Pipes use stdio.
+// All mpz_t arguments are expected to be initialized.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to encrypt.
+// outfile: the output file to write the encrypted input to.
+// e: the public exponent.
+// ctx: the batched Montgomery context of the public modulus.
+// binary: true to write the binary container (see RSA_BIN_MAGIC), false for hex text.
+//
+void rsa_encrypt_file_ctx(FILE *infile, FILE *outfile, mpz_t e, const mont_batch_ctx *ctx, bool binary);
+
 //
 // Decrypts some ciphertext given an RSA private key and public modulus.
 // All mpz_t arguments are expected to be initialized.
@@ -111,8 +384,20 @@ void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
 //
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
+//
+// Decrypts some ciphertext given an RSA private key.
+// Uses CRT recombination when the key has the CRT components.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: will store the decrypted message.
+// c: the ciphertext to decrypt.
+// key: the private key.
+//
+void rsa_decrypt_key(mpz_t m, mpz_t c, rsa_priv_key *key);
+
 //
 // Decrypts an entire file given an RSA public modulus and private key.
+// The input may be hex text, the binary container or the hybrid container.
 // All mpz_t arguments are expected to be initialized.
 // All FILE * arguments are expected to be properly opened.
 //
@@ -120,11 +405,75 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 // outfile: the output file to write the decrypted input to.
 // n: the public modulus.
 // d: the private key.
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+
+//
+// Decrypts an entire file given an RSA private key.
+// The input may be hex text, the binary container or the hybrid container.
+// Uses CRT recombination when the key has the CRT components.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file_key(FILE *infile, FILE *outfile, rsa_priv_key *key);
+
 //
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
+// Initializes the batched Montgomery contexts decryption with key needs.
+// A CRT key gets contexts for p in cp and for q and the further primes in cq,
+// any other key one for n in cp (cq is then unused).
+//
+// key: the private key.
+// cp: the context of p, or of n.
+// cq: room for RSA_MAX_PRIMES-1 contexts, of q and then of r[0], r[1]...
+//
+void rsa_priv_batch_init(rsa_priv_key *key, mont_batch_ctx *cp, mont_batch_ctx *cq);
+
+//
+// Frees the contexts made by rsa_priv_batch_init.
+//
+// key: the private key the contexts were made for.
+// cp: the context of p, or of n.
+// cq: the contexts of q and of the further primes.
+//
+void rsa_priv_batch_clear(rsa_priv_key *key, mont_batch_ctx *cp, mont_batch_ctx *cq);
+
+//
+// Decrypts an entire file given an RSA private key whose Montgomery contexts are already built
+// with rsa_priv_batch_init. Lets callers that decrypt many files under one key build them once.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// cp: the context of p, or of n for a key without CRT components.
+// cq: the contexts of q and of the further primes.
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file_ctx(FILE *infile, FILE *outfile, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq);
+
+//
+// Decrypts an entire file given an RSA private key, using a pool of worker threads.
+// One reader thread parses blocks, the workers decrypt them in any order,
+// and the calling thread writes them back out in their original order.
+// At most RSA_MT_WINDOW blocks are held in memory at a time.
+// All FILE * arguments are expected to be properly opened.
+//
+// infile: the input file to decrypt.
+// outfile: the output file to write the decrypted input to.
+// key: the private key.
+// threads: the number of worker threads (1 falls back to rsa_decrypt_file_key).
+// returns: true if the whole file was decrypted, false (after printing why) if it is damaged or for another key.
+//
+bool rsa_decrypt_file_mt(FILE *infile, FILE *outfile, rsa_priv_key *key, uint32_t threads);
 
 //
 // Signs some message given an RSA private key and public modulus.
+// Builds the Montgomery context of n on every call, rsa_sign_ctx reuses one.
 // All mpz_t arguments are expected to be initialized.
 //
 // s: will store the signed message (the signature).
@@ -134,9 +483,35 @@ void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
 //
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+//
+// Signs some message given an RSA private key.
+// Uses CRT recombination when the key has the CRT components.
+// Builds the Montgomery contexts of the key on every call, rsa_sign_ctx reuses them.
+// All mpz_t arguments are expected to be initialized.
+//
+// s: will store the signed message (the signature).
+// m: the message to sign.
+// key: the private key.
+//
+void rsa_sign_key(mpz_t s, mpz_t m, rsa_priv_key *key);
+
+//
+// Signs some message given an RSA private key whose Montgomery contexts are already built
+// with rsa_priv_batch_init. Lets callers that sign many messages under one key build them once.
+// All mpz_t arguments are expected to be initialized.
+//
+// s: will store the signed message (the signature).
+// m: the message to sign.
+// key: the private key.
+// cp: the context of p, or of n for a key without CRT components.
+// cq: the contexts of q and of the further primes.
+//
+void rsa_sign_ctx(mpz_t s, mpz_t m, rsa_priv_key *key, const mont_batch_ctx *cp, const mont_batch_ctx *cq);
+
 //
 // Verifies some signature given an RSA public exponent and modulus.
 // Requires the expected message for verification.
+// Builds the Montgomery context of n on every call, rsa_verify_ctx reuses one.
 // All mpz_t arguments are expected to be initialized.
 //
 // m: the expected message.
@@ -146,3 +521,41 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 // returns: true if signature is verified, false otherwise.
 //
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+//
+// Verifies some signature given an RSA public exponent and the Montgomery context of the modulus.
+// Lets callers that verify many signatures under one key build the context once.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: the expected message.
+// s: the signature to verify.
+// e: the public exponent.
+// ctx: the batched Montgomery context of the public modulus.
+// returns: true if signature is verified, false otherwise.
+//
+bool rsa_verify_ctx(mpz_t m, mpz_t s, mpz_t e, const mont_batch_ctx *ctx);
+
+//
+// Verifies many signatures under one RSA public key at once.
+// Screens the whole set with random small exponents, which costs one full exponentiation
+// plus a few multiplications per pair instead of one full exponentiation per pair.
+// A set that fails the screen is cut in half until the bad pairs are found, so a set
+// with few bad pairs still costs only a few full exponentiations, and a pair left on its own is checked exactly.
+// Like any small exponent screen, a bad signature passes with probability about 2^-RSA_BATCH_EXP_BITS,
+// or 1/2 when it is a good signature multiplied by a nontrivial square root of 1 modulo n (which takes the
+// factors of n to find). A negated good signature, n - s, which anyone holding s can make, would pass
+// whenever two of them are screened together, so the screen is only used when (-1|n) = -1: e is odd,
+// so every pair's Jacobi symbols must match, which rejects all of them. For the other keys (about half)
+// every pair is checked exactly, at the cost of one rsa_verify per pair.
+// All mpz_t arguments are expected to be initialized.
+//
+// m: the expected messages.
+// s: the signatures to verify.
+// count: the number of (message, signature) pairs.
+// ok: will store for every pair true if its signature is verified, false otherwise.
+// e: the public exponent.
+// n: the public modulus.
+// rng: the random context the screening exponents are drawn from.
+// returns: the number of pairs that failed.
+//
+uint64_t rsa_verify_batch(mpz_t m[], mpz_t s[], uint64_t count, bool ok[], mpz_t e, mpz_t n, rand_ctx *rng);
@@ -0,0 +1,532 @@
+// implement rsaserver program: a long-running encrypt/decrypt/sign/verify daemon on a Unix domain socket
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gmp.h>
+#include "rsa.h"
+#include "keystore.h"
+#include "mempool.h"
+
+// protocol: every request and every response is one frame, a 4-byte big-endian length followed by that many bytes
+// request payload: op (1 byte), key name length (1 byte), key name (username, or key id for ops in lower case), data
+// response payload: status (1 byte), data
+#define SERVER_OP_ENCRYPT 'E'  // data: plaintext; response: binary ciphertext container
+#define SERVER_OP_DECRYPT 'D'  // data: ciphertext (binary container or hex lines); response: plaintext
+#define SERVER_OP_SIGN    'S'  // data: message as a big-endian number below n; response: signature, big-endian
+#define SERVER_OP_VERIFY  'V'  // data: message length (4 bytes, big-endian), message, signature; response: empty
+
+#define SERVER_OK          0
+#define SERVER_BAD_REQUEST 1  // malformed frame or unknown op
+#define SERVER_NO_KEY      2  // no key with that name
+#define SERVER_NO_PRIVATE  3  // the key has no private part
+#define SERVER_NOT_VERIFIED 4 // the signature does not match the message
+#define SERVER_FAILED      5  // the operation could not run
+
+// largest request the server reads, bigger frames close the connection
+#define SERVER_MAX_FRAME (64u << 20)
+
+// connections waiting for a worker
+#define SERVER_QUEUE 256
+
+// seconds a client has to send a whole request or read a whole response before its connection is closed
+// a worker serves one connection at a time, so this bounds how long a slow or idle client holds it
+#define SERVER_IDLE 10
+
+// state shared by the accepting thread and the workers
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int queue[SERVER_QUEUE];   // accepted connections, a ring buffer
+	uint32_t head;
+	uint32_t count;
+	bool stopping;
+	int *active;               // the connection each worker serves, -1 if idle
+	uint32_t workers;
+	keystore keys;
+	uint32_t idle;             // seconds of the frame deadlines
+	uint32_t verbose;
+} server_state;
+
+// set by the signal handlers, read by the accepting thread between two waits in pselect
+static volatile sig_atomic_t server_stop = 0;
+static volatile sig_atomic_t server_reload = 0;
+
+static void on_stop(int sig) {
+	(void) sig;
+	server_stop = 1;
+}
+
+static void on_reload(int sig) {
+	(void) sig;
+	server_reload = 1;
+}
+
+void print_error(void) {
+	fprintf(stderr, "Usage: ./rsaserver [options]\n  ./rsaserver keeps a directory of keys loaded and serves encrypt, decrypt, sign and verify\n  requests on a Unix domain socket. Send SIGHUP to reload changed keys, SIGINT or SIGTERM to stop.\n    -s <socket> : Listen on the socket <socket>. Default: rsa.sock\n    -k <keydir> : Load the <id>.pub and <id>.priv keys in <keydir>. Default: .\n    -t <threads>: Serve clients on <threads> worker threads. Default: 4\n    -i <seconds>: Close connections that take more than <seconds> seconds to send a request or read a response, so slow or idle clients do not hold workers. Default: 10\n    -v          : Enable verbose output.\n    -h          : Display program synopsis and usage.\n");
+}
+
+// milliseconds on the monotonic clock, which the frame deadlines are measured on
+static int64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the deadline of a frame that starts now
+static int64_t frame_deadline(server_state *st) {
+	return now_ms() + (int64_t) st->idle * 1000;
+}
+
+// waits until the connection is ready for events, returns false once the deadline has passed
+// checked before every read and write, so a client cannot stretch a frame by trickling bytes
+static bool wait_ready(int fd, short events, int64_t deadline) {
+	while (1) {
+		int64_t left = deadline - now_ms();
+		if (left <= 0) {
+			return false;
+		}
+		struct pollfd p;
+		p.fd = fd;
+		p.events = events;
+		p.revents = 0;
+		int r = poll(&p, 1, left > INT_MAX ? INT_MAX : (int) left);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		return r > 0;
+	}
+}
+
+// reads exactly len bytes from a non-blocking connection by the deadline, returns false on end of file, error or timeout
+static bool read_full(int fd, uint8_t *buf, size_t len, int64_t deadline) {
+	while (len > 0) {
+		if (!wait_ready(fd, POLLIN, deadline)) {
+			return false;
+		}
+		ssize_t r = read(fd, buf, len);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+			continue;
+		}
+		if (r <= 0) {
+			return false;
+		}
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+// writes exactly len bytes to a non-blocking connection by the deadline, returns false on error or timeout
+static bool write_full(int fd, const uint8_t *buf, size_t len, int64_t deadline) {
+	while (len > 0) {
+		if (!wait_ready(fd, POLLOUT, deadline)) {
+			return false;
+		}
+		ssize_t r = write(fd, buf, len);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+			continue;
+		}
+		if (r <= 0) {
+			return false;
+		}
+		buf += r;
+		len -= r;
+	}
+	return true;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// sends one response frame: status followed by len bytes of data, the client has until one deadline to read all of it
+static bool send_response(server_state *st, int fd, uint8_t status, const uint8_t *data, size_t len) {
+	uint8_t head[5];
+	put_be32(head, len + 1);
+	head[4] = status;
+	int64_t deadline = frame_deadline(st);
+	return write_full(fd, head, 5, deadline) && (len == 0 || write_full(fd, data, len, deadline));
+}
+
+// opens len bytes of memory as an input file (fmemopen does not take empty buffers everywhere)
+static FILE *open_input(uint8_t *data, size_t len) {
+	if (len == 0) {
+		return fopen("/dev/null", "r");
+	}
+	return fmemopen(data, len, "r");
+}
+
+// runs an encrypt or decrypt request through the file functions, with memory streams on both ends
+// the result is malloc'ed into *out and *out_len
+// returns false if the streams cannot be opened or the ciphertext is damaged or for another key
+static bool run_file_op(uint8_t op, keystore_entry *entry, uint8_t *data, size_t len, char **out, size_t *out_len) {
+	FILE *in = open_input(data, len);
+	if (!in) {
+		return false;
+	}
+	FILE *result = open_memstream(out, out_len);
+	if (!result) {
+		fclose(in);
+		return false;
+	}
+	bool ok = true;
+	if (op == SERVER_OP_ENCRYPT) {
+		rsa_encrypt_file_ctx(in, result, entry->e, &entry->pub, true);
+	} else {
+		ok = rsa_decrypt_file_ctx(in, result, &entry->priv, &entry->cp, entry->cq);
+	}
+	fclose(in);
+	fclose(result);
+	return ok;
+}
+
+// serves one request frame, returns false if the connection should be closed
+static bool serve_request(server_state *st, int fd, uint8_t *req, size_t len) {
+	uint8_t op = req[0];
+	// op, name length, name
+	if (len < 2 || len < 2 + (size_t) req[1]) {
+		return send_response(st, fd, SERVER_BAD_REQUEST, NULL, 0);
+	}
+	char name[KEYSTORE_NAME_MAX];
+	memcpy(name, req + 2, req[1]);
+	name[req[1]] = '\0';
+	uint8_t *data = req + 2 + req[1];
+	size_t data_len = len - 2 - req[1];
+	// upper case ops look the key up by username, lower case ones by key id
+	bool by_id = op >= 'a' && op <= 'z';
+	if (by_id) {
+		op = op - 'a' + 'A';
+	}
+	if (op != SERVER_OP_ENCRYPT && op != SERVER_OP_DECRYPT && op != SERVER_OP_SIGN && op != SERVER_OP_VERIFY) {
+		return send_response(st, fd, SERVER_BAD_REQUEST, NULL, 0);
+	}
+	keystore_entry *entry = by_id ? keystore_get_id(&st->keys, name) : keystore_get(&st->keys, name);
+	if (entry == NULL) {
+		return send_response(st, fd, SERVER_NO_KEY, NULL, 0);
+	}
+	if ((op == SERVER_OP_DECRYPT || op == SERVER_OP_SIGN) && !entry->has_priv) {
+		keystore_put(&st->keys, entry);
+		return send_response(st, fd, SERVER_NO_PRIVATE, NULL, 0);
+	}
+	bool ok = true;
+	if (op == SERVER_OP_ENCRYPT || op == SERVER_OP_DECRYPT) {
+		char *out = NULL;
+		size_t out_len = 0;
+		if (run_file_op(op, entry, data, data_len, &out, &out_len)) {
+			ok = send_response(st, fd, SERVER_OK, (uint8_t *) out, out_len);
+		} else {
+			ok = send_response(st, fd, SERVER_FAILED, NULL, 0);
+		}
+		free(out);
+	} else {
+		mpz_t m;
+		mpz_init(m);
+		mpz_t s;
+		mpz_init(s);
+		uint8_t status = SERVER_OK;
+		if (op == SERVER_OP_SIGN) {
+			mpz_import(m, data_len, 1, 1, 1, 0, data);
+			if (mpz_cmp(m, entry->n) >= 0) {
+				status = SERVER_BAD_REQUEST;
+			} else {
+				rsa_sign_ctx(s, m, &entry->priv, &entry->cp, entry->cq);
+			}
+		} else if (data_len < 4 || get_be32(data) > data_len - 4) {
+			status = SERVER_BAD_REQUEST;
+		} else {
+			uint32_t mlen = get_be32(data);
+			mpz_import(m, mlen, 1, 1, 1, 0, data + 4);
+			mpz_import(s, data_len - 4 - mlen, 1, 1, 1, 0, data + 4 + mlen);
+			// a signature is a residue, s + n must not verify as s
+			if (mpz_cmp(s, entry->n) >= 0 || !rsa_verify_ctx(m, s, entry->e, &entry->pub)) {
+				status = SERVER_NOT_VERIFIED;
+			}
+		}
+		if (op == SERVER_OP_SIGN && status == SERVER_OK) {
+			// exported into a buffer of our own: mpz_export(NULL, ...) would allocate through the GMP memory functions
+			size_t slen = 0;
+			uint8_t *sig = (uint8_t *) malloc((mpz_sizeinbase(s, 2) + 7) / 8);
+			mpz_export(sig, &slen, 1, 1, 1, 0, s);
+			ok = send_response(st, fd, status, sig, slen);
+			free(sig);
+		} else {
+			ok = send_response(st, fd, status, NULL, 0);
+		}
+		mpz_clears(m, s, NULL);
+	}
+	if (st->verbose) {
+		fprintf(stderr, "rsaserver: %c %s (%zu bytes)\n", req[0], name, data_len);
+	}
+	keystore_put(&st->keys, entry);
+	return ok;
+}
+
+// serves the requests of one connection until the client closes it
+static void serve_connection(server_state *st, int fd) {
+	uint8_t head[4];
+	while (1) {
+		// the whole request, length and payload, has to arrive by one deadline
+		int64_t deadline = frame_deadline(st);
+		if (!read_full(fd, head, 4, deadline)) {
+			break;
+		}
+		uint32_t len = get_be32(head);
+		if (len == 0 || len > SERVER_MAX_FRAME) {
+			break;
+		}
+		uint8_t *req = (uint8_t *) malloc(len);
+		bool keep = read_full(fd, req, len, deadline) && serve_request(st, fd, req, len);
+		free(req);
+		if (!keep) {
+			break;
+		}
+	}
+}
+
+// arguments of one worker thread
+typedef struct {
+	server_state *st;
+	uint32_t index;
+} server_worker;
+
+// worker: takes accepted connections off the queue until the server stops
+static void *worker_run(void *arg) {
+	server_worker *w = (server_worker *) arg;
+	server_state *st = w->st;
+	while (1) {
+		pthread_mutex_lock(&st->lock);
+		while (st->count == 0 && !st->stopping) {
+			pthread_cond_wait(&st->ready, &st->lock);
+		}
+		if (st->count == 0) {
+			pthread_mutex_unlock(&st->lock);
+			break;
+		}
+		int fd = st->queue[st->head];
+		st->head = (st->head + 1) % SERVER_QUEUE;
+		st->count -= 1;
+		st->active[w->index] = fd;
+		pthread_mutex_unlock(&st->lock);
+
+		serve_connection(st, fd);
+
+		pthread_mutex_lock(&st->lock);
+		st->active[w->index] = -1;
+		pthread_mutex_unlock(&st->lock);
+		close(fd);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int opt = 0; // used for getopt
+	// set default values
+	char *socket_name = "rsa.sock";
+	char *key_dir = ".";
+	uint32_t threads = 4;
+	uint32_t idle = SERVER_IDLE;
+	uint32_t message = 0;
+	// GMP buffers come from per-thread pools, installed before the first number exists
+	mempool_install();
+
+	// gets user input and runs until processes all the commands
+	while ((opt = getopt(argc, argv, "s:k:t:i:vh")) != -1) { //list of valid commands
+		// socket path
+		if (opt == 's') {
+			socket_name = optarg;
+		}
+		// key directory
+		else if (opt == 'k') {
+			key_dir = optarg;
+		}
+		// number of worker threads
+		else if (opt == 't') {
+			threads = strtoul(optarg, NULL, 10);
+			if (threads < 1 || threads > 128) {
+				fprintf(stderr, "./rsaserver: Number of threads must be 1-128, not %u.\n", threads);
+				print_error();
+				return 1;
+			}
+		}
+		// idle timeout
+		else if (opt == 'i') {
+			idle = strtoul(optarg, NULL, 10);
+			if (idle < 1 || idle > 86400) {
+				fprintf(stderr, "./rsaserver: Idle timeout must be 1-86400 seconds, not %u.\n", idle);
+				print_error();
+				return 1;
+			}
+		}
+		// enables verbose
+		else if (opt == 'v') {
+			message = 1;
+		}
+		// usage message
+		else if (opt == 'h') {
+			print_error();
+			return 0;
+		}
+		// if it's not in the above options, return an error number
+		else {
+			print_error();
+			return 1;
+		}
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "./rsaserver: Socket path %s is too long.\n", socket_name);
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_name);
+
+	server_state st;
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.ready, NULL);
+	st.head = 0;
+	st.count = 0;
+	st.stopping = false;
+	st.workers = threads;
+	st.idle = idle;
+	st.verbose = message;
+	int64_t loaded = keystore_open(&st.keys, key_dir);
+	if (loaded < 0) {
+		fprintf(stderr, "./rsaserver: Couldn't read key directory %s\n", key_dir);
+		keystore_close(&st.keys);
+		return 1;
+	}
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_name);
+	if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, SERVER_QUEUE) != 0) {
+		fprintf(stderr, "./rsaserver: Couldn't listen on %s\n", socket_name);
+		keystore_close(&st.keys);
+		return 1;
+	}
+	if (message == 1) {
+		fprintf(stderr, "rsaserver: %" PRId64 " keys loaded from %s, listening on %s with %u workers\n", loaded, key_dir, socket_name, threads);
+	}
+
+	// the workers never see signals, and this thread only takes them inside pselect:
+	// one that arrives while the flags are checked waits for pselect instead of being missed until the next client
+	sigset_t block;
+	sigset_t wait_mask;
+	sigemptyset(&block);
+	sigaddset(&block, SIGHUP);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigaddset(&block, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &block, &wait_mask);
+	st.active = (int *) malloc(threads * sizeof(int));
+	server_worker *args = (server_worker *) malloc(threads * sizeof(server_worker));
+	pthread_t *workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	for (uint32_t i = 0; i < threads; i += 1) {
+		st.active[i] = -1;
+		args[i].st = &st;
+		args[i].index = i;
+		pthread_create(&workers[i], NULL, worker_run, &args[i]);
+	}
+	// no SA_RESTART, so a signal makes pselect return with EINTR
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = on_reload;
+	sigaction(SIGHUP, &sa, NULL);
+	// a client that goes away mid-response must not kill the server
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	// a client that connects and goes away before accept must not leave it blocking
+	fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+	while (!server_stop) {
+		if (server_reload) {
+			server_reload = 0;
+			int64_t changed = keystore_reload(&st.keys);
+			if (message == 1) {
+				fprintf(stderr, "rsaserver: reload changed %" PRId64 " keys, %" PRIu64 " loaded\n", changed, keystore_size(&st.keys));
+			}
+		}
+		fd_set ready;
+		FD_ZERO(&ready);
+		FD_SET(listener, &ready);
+		if (pselect(listener + 1, &ready, NULL, NULL, NULL, &wait_mask) <= 0) {
+			continue;
+		}
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		// a worker stays with its connection, so a client that is slow to send a request or read a response
+		// is cut off at the frame deadline instead of holding the worker: the workers poll non-blocking connections
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		pthread_mutex_lock(&st.lock);
+		if (st.count == SERVER_QUEUE) {
+			// every worker is busy and the queue is full
+			pthread_mutex_unlock(&st.lock);
+			close(fd);
+			continue;
+		}
+		st.queue[(st.head + st.count) % SERVER_QUEUE] = fd;
+		st.count += 1;
+		pthread_cond_signal(&st.ready);
+		pthread_mutex_unlock(&st.lock);
+	}
+
+	// stop: finish the requests in flight, end idle connections, then let the workers drain the queue
+	close(listener);
+	unlink(socket_name);
+	pthread_mutex_lock(&st.lock);
+	st.stopping = true;
+	for (uint32_t i = 0; i < threads; i += 1) {
+		if (st.active[i] >= 0) {
+			shutdown(st.active[i], SHUT_RD);
+		}
+	}
+	for (uint32_t i = 0; i < st.count; i += 1) {
+		shutdown(st.queue[(st.head + i) % SERVER_QUEUE], SHUT_RD);
+	}
+	pthread_cond_broadcast(&st.ready);
+	pthread_mutex_unlock(&st.lock);
+	for (uint32_t i = 0; i < threads; i += 1) {
+		pthread_join(workers[i], NULL);
+	}
+	keystore_close(&st.keys);
+	// the workers have exited, so their counters are in
+	if (message == 1) {
+		mempool_stats pool;
+		mempool_get_stats(&pool);
+		fprintf(stderr, "allocator: %" PRIu64 " allocations, %" PRIu64 " served from the pool, %" PRIu64 " grown in place, %" PRIu64 " frees, %" PRIu64 " returned to malloc\n", pool.allocs, pool.reused, pool.grows, pool.frees, pool.released);
+	}
+	free(workers);
+	free(args);
+	free(st.active);
+	pthread_cond_destroy(&st.ready);
+	pthread_mutex_destroy(&st.lock);
+	return 0;
+}
@@ -0,0 +1,181 @@
+// implement verifytest program: checks that rsa_verify_batch rejects exactly the bad pairs
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "rsa.h"
+
+// pairs in every batch
+#define TEST_PAIRS 16
+
+// random screening seeds every case is run with
+#define TEST_SEEDS 32
+
+// a key and TEST_PAIRS good (message, signature) pairs under it
+typedef struct {
+	mpz_t n;
+	mpz_t e;
+	mpz_t m[TEST_PAIRS];
+	mpz_t good[TEST_PAIRS];
+	mpz_t s[TEST_PAIRS];
+} test_set;
+
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+// counts one check and prints it when it does not hold
+static void expect(bool cond, const char *what, uint64_t seed) {
+	checks += 1;
+	if (!cond) {
+		failures += 1;
+		fprintf(stderr, "verifytest: FAILED %s (seed %" PRIu64 ")\n", what, seed);
+	}
+}
+
+// makes a 1024-bit key and signs TEST_PAIRS random messages below n with it, reusing the contexts of the key
+static void test_set_init(test_set *ts, uint64_t seed) {
+	rand_ctx rng;
+	rand_ctx_init(&rng, seed);
+	mpz_t p;
+	mpz_t q;
+	mpz_inits(p, q, ts->n, ts->e, NULL);
+	rsa_make_pub_mt(p, q, ts->n, ts->e, 1024, 0, PRIME_TEST_MR, 1, &rng, NULL);
+	rsa_priv_key key;
+	rsa_priv_key_init(&key);
+	rsa_make_priv_key(&key, ts->n, ts->e, p, q);
+	mont_batch_ctx cp;
+	mont_batch_ctx cq[RSA_MAX_PRIMES-1];
+	rsa_priv_batch_init(&key, &cp, cq);
+	for (uint32_t i = 0; i < TEST_PAIRS; i += 1) {
+		mpz_inits(ts->m[i], ts->good[i], ts->s[i], NULL);
+		// 15 words of 64 bits stay below the 1024-bit modulus
+		for (uint32_t w = 0; w < 15; w += 1) {
+			mpz_mul_2exp(ts->m[i], ts->m[i], 64);
+			mpz_add_ui(ts->m[i], ts->m[i], rand_ctx_u64(&rng));
+		}
+		rsa_sign_ctx(ts->good[i], ts->m[i], &key, &cp, cq);
+	}
+	rsa_priv_batch_clear(&key, &cp, cq);
+	rsa_priv_key_clear(&key);
+	mpz_clears(p, q, NULL);
+	rand_ctx_clear(&rng);
+}
+
+static void test_set_clear(test_set *ts) {
+	for (uint32_t i = 0; i < TEST_PAIRS; i += 1) {
+		mpz_clears(ts->m[i], ts->good[i], ts->s[i], NULL);
+	}
+	mpz_clears(ts->n, ts->e, NULL);
+}
+
+// puts the good signatures back
+static void reset(test_set *ts) {
+	for (uint32_t i = 0; i < TEST_PAIRS; i += 1) {
+		mpz_set(ts->s[i], ts->good[i]);
+	}
+}
+
+// verifies the first count pairs and checks that exactly the pairs in bad[0..nbad-1] fail
+static void check_batch(test_set *ts, uint32_t count, const uint32_t *bad, uint32_t nbad, const char *what, uint64_t seed) {
+	rand_ctx rng;
+	rand_ctx_init(&rng, seed);
+	bool ok[TEST_PAIRS];
+	uint64_t failed = rsa_verify_batch(ts->m, ts->s, count, ok, ts->e, ts->n, &rng);
+	rand_ctx_clear(&rng);
+	bool exact = failed == nbad;
+	for (uint32_t i = 0; i < count; i += 1) {
+		bool want = true;
+		for (uint32_t b = 0; b < nbad; b += 1) {
+			want = want && bad[b] != i;
+		}
+		exact = exact && ok[i] == want;
+	}
+	expect(exact, what, seed);
+}
+
+// runs every case on a key
+static void run_cases(test_set *ts) {
+	mont_batch_ctx pub;
+	mont_batch_init(&pub, ts->n);
+	for (uint64_t seed = 1; seed <= TEST_SEEDS; seed += 1) {
+		uint32_t at = seed % TEST_PAIRS;
+		uint32_t bad[3] = { at, (at + 5) % TEST_PAIRS, (at + 11) % TEST_PAIRS };
+
+		reset(ts);
+		check_batch(ts, TEST_PAIRS, NULL, 0, "good signatures pass", seed);
+		expect(rsa_verify_ctx(ts->m[at], ts->s[at], ts->e, &pub) && rsa_verify(ts->m[at], ts->s[at], ts->e, ts->n), "a good signature passes one by one", seed);
+		check_batch(ts, 1, NULL, 0, "a single good signature passes", seed);
+
+		// a signature off by one
+		reset(ts);
+		mpz_add_ui(ts->s[at], ts->s[at], 1);
+		check_batch(ts, TEST_PAIRS, bad, 1, "a bad signature fails", seed);
+		expect(!rsa_verify_ctx(ts->m[at], ts->s[at], ts->e, &pub) && !rsa_verify(ts->m[at], ts->s[at], ts->e, ts->n), "a bad signature fails one by one", seed);
+
+		// a signature swapped with the one of another message
+		reset(ts);
+		mpz_swap(ts->s[bad[0]], ts->s[bad[1]]);
+		check_batch(ts, TEST_PAIRS, bad, 2, "swapped signatures fail", seed);
+
+		// n - s, which anyone holding s can make
+		reset(ts);
+		mpz_sub(ts->s[at], ts->n, ts->s[at]);
+		check_batch(ts, TEST_PAIRS, bad, 1, "a negated signature fails", seed);
+		check_batch(ts, at + 1, bad, 1, "a negated signature fails at the end of a batch", seed);
+
+		// a pair on its own is checked exactly
+		reset(ts);
+		mpz_sub(ts->s[0], ts->n, ts->s[0]);
+		uint32_t first[1] = { 0 };
+		check_batch(ts, 1, first, 1, "a single negated signature fails", seed);
+
+		// several negated signatures cancel out in the screens, the Jacobi symbols or the exact checks catch them
+		reset(ts);
+		for (uint32_t b = 0; b < 3; b += 1) {
+			mpz_sub(ts->s[bad[b]], ts->n, ts->s[bad[b]]);
+		}
+		check_batch(ts, TEST_PAIRS, bad, 3, "three negated signatures fail", seed);
+		mpz_set(ts->s[bad[2]], ts->good[bad[2]]);
+		check_batch(ts, TEST_PAIRS, bad, 2, "two negated signatures fail", seed);
+
+		// every signature negated, an even number of them in every screened set
+		uint32_t all[TEST_PAIRS];
+		for (uint32_t i = 0; i < TEST_PAIRS; i += 1) {
+			mpz_sub(ts->s[i], ts->n, ts->good[i]);
+			all[i] = i;
+		}
+		check_batch(ts, TEST_PAIRS, all, TEST_PAIRS, "every signature negated fails", seed);
+
+		// a message that is not below n
+		reset(ts);
+		mpz_add(ts->m[at], ts->m[at], ts->n);
+		check_batch(ts, TEST_PAIRS, bad, 1, "a message above n fails", seed);
+		mpz_sub(ts->m[at], ts->m[at], ts->n);
+	}
+	mont_batch_clear(&pub);
+}
+
+int main(void) {
+	// one key with (-1|n) = -1 and one with (-1|n) = 1, the first ones made from seeds counting up from 2021
+	bool done[2] = { false, false };
+	for (uint64_t seed = 2021; !done[0] || !done[1]; seed += 1) {
+		test_set ts;
+		test_set_init(&ts, seed);
+		uint32_t kind = mpz_si_kronecker(-1, ts.n) == -1 ? 0 : 1;
+		if (!done[kind]) {
+			run_cases(&ts);
+			done[kind] = true;
+		}
+		test_set_clear(&ts);
+	}
+	if (failures > 0) {
+		fprintf(stderr, "verifytest: %" PRIu64 " of %" PRIu64 " checks failed\n", failures, checks);
+		return 1;
+	}
+	fprintf(stderr, "verifytest: %" PRIu64 " checks passed\n", checks);
+	return 0;
+}